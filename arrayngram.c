@@ -3,9 +3,12 @@
 #include <unistd.h>
 #include <memory.h>
 #include <ctype.h>
+#include <math.h>
 #include <sys/types.h>
+#include <sys/mman.h>
 #include "ngram.h"
 #include "arrayngram.h"
+#include "counter.h"
 #include "libstats.h"
 
 /* The "generic" structure */
@@ -23,7 +26,9 @@ NgramOps arrayops = {
 	finddistarray,
 	distarrayrange,
 	dumparrayrange,
-	closearrayrange
+	closearrayrange,
+	mergearrayrange,
+	readngramscounts
 };
 
 Ngram array = {
@@ -38,6 +43,85 @@ Ngram array = {
  */
 #define NGRAMSIZE(i)	(long)(1L<<(8*i))
 #define NGRAMMASK(i)	(long)(NGRAMSIZE(i)-1L)
+#define ARRAYMAX	4	/* see above */
+#define ARRAY_PREFETCH	3	/* smallest size not (mostly) in cache */
+#define ARRAY_AHEAD	16	/* bytes ahead to prefetch */
+
+/* Counter width and overflow table for an array; the width follows from
+ * the size (see counter.h), so it doesn't need to be stored anywhere.
+ */
+#define ARRAYBITS(i)	CounterBits(NGRAMSIZE(i))
+#define ARRAYSPILL(i, ngrams)	\
+	CounterSpillTable((ngrams), ARRAYBITS(i), NGRAMSIZE(i))
+
+/* The 4-gram array is 2^32 counters, 8GB at 16 bits, and real traffic
+ * only ever touches a small part of it. So rather than malloc it and
+ * zero the lot up front, the big arrays are mapped MAP_NORESERVE, and
+ * the kernel only hands out (zeroed) memory for pages that get written.
+ * (A shared memory file is sparse to begin with, which comes to the
+ * same thing.) After the counters and spill is a bitmap of which
+ * ARRAY_PAGE byte pages of counters have been bumped, so the dump, the
+ * stats and the merge can go through just those, and leave the rest
+ * alone.
+ */
+#define ARRAY_PAGEDMIN	4	/* smallest size that's paged */
+#define ARRAY_PAGEBITS	16
+#define ARRAY_PAGE	(1L<<ARRAY_PAGEBITS)	/* 64KB */
+#define ARRAYPAGED(i)	((i) >= ARRAY_PAGEDMIN)
+#define ARRAYPERPAGE(i)	((size_t)(ARRAY_PAGE*8)/ARRAYBITS(i))	/* counters */
+#define ARRAYNPAGES(i)	(NGRAMSIZE(i)/ARRAYPERPAGE(i))
+#define ARRAYPAGEMAP(i, ngrams)	(ARRAYPAGED(i) ? \
+	(u_int8_t *)(ngrams) + CounterBytes(ARRAYBITS(i), NGRAMSIZE(i)) : NULL)
+#define ARRAYBYTES(i)	(CounterBytes(ARRAYBITS(i), NGRAMSIZE(i)) + \
+	(ARRAYPAGED(i) ? (ARRAYNPAGES(i)+7)/8 : 0))
+
+/* Note that a counter's page has been written */
+static inline void
+arraytouch(u_int8_t *map, int bits, size_t spot)
+{
+	size_t page = ((size_t)spot*bits) >> (ARRAY_PAGEBITS+3);
+	u_int8_t bit = 1 << (page&7);
+
+	if (!(map[page>>3] & bit))
+		map[page>>3] |= bit;
+}
+
+/* Step through the parts of an array that may have nonzero counters: a
+ * page at a time for a paged array, all in one go for the others. Start
+ * with *end at 0; returns 0 when there's no more.
+ */
+static int
+arraypages(int ngram, void *ngrams, size_t *start, size_t *end)
+{
+	size_t size = NGRAMSIZE(ngram);
+	size_t perpage, page, npages;
+	u_int8_t *map;
+
+	if (*end >= size)
+		return 0;
+	if (!ARRAYPAGED(ngram)) {
+		*start = 0;
+		*end = size;
+		return 1;
+	}
+	map = ARRAYPAGEMAP(ngram, ngrams);
+	perpage = ARRAYPERPAGE(ngram);
+	npages = ARRAYNPAGES(ngram);
+	for (page = *end/perpage; page < npages; ++page) {
+		if (!map[page>>3]) {
+			/* Skip the rest of the byte */
+			page |= 7;
+			continue;
+		}
+		if (map[page>>3] & (1 << (page&7))) {
+			*start = page*perpage;
+			*end = *start + perpage;
+			return 1;
+		}
+	}
+	*end = size;
+	return 0;
+}
 
 /* For checking adequacy of counter size */
 int overflows;
@@ -85,15 +169,25 @@ allocngramarray(int ngram)
 	NgramCounter *ngrams;
 	size_t bytesize;
 
-	bytesize = sizeof(NgramCounter)*NGRAMSIZE(ngram);
+	bytesize = ARRAYBYTES(ngram);
 	setngramlabel(NGRAM_ARRAY, NULL, ngram, bytesize, 0, 0);
 #ifdef SHMALLOC
 	ngrams = (NgramCounter *)ngram_shmalloc(bytesize, shmfilename, mode);
 #else
-	ngrams = (NgramCounter *)malloc(bytesize);
-	if (ngrams)
-		memset((void *)ngrams, 0, bytesize);
+	if (ARRAYPAGED(ngram)) {
+		ngrams = (NgramCounter *)mmap(NULL, bytesize,
+			PROT_READ|PROT_WRITE,
+			MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+		if (ngrams == (NgramCounter *)MAP_FAILED)
+			ngrams = NULL;
+	} else {
+		ngrams = (NgramCounter *)malloc(bytesize);
+		if (ngrams)
+			memset((void *)ngrams, 0, bytesize);
+	}
 #endif
+	if (ngrams)
+		CounterInit(ngrams, ARRAYBITS(ngram), NGRAMSIZE(ngram));
 	return ngrams;
 }
 
@@ -141,12 +235,15 @@ allocngramarrayrange(Range ngram)
 }
 
 void
-closearray(void *array)
+closearray(int ngram, void *array)
 {
 #ifdef SHMALLOC
 	ngram_shmfree(array);
 #else
-	free(array);
+	if (ARRAYPAGED(ngram))
+		(void) munmap(array, ARRAYBYTES(ngram));
+	else
+		free(array);
 #endif
 }
 
@@ -158,7 +255,7 @@ closearrayrange(NgramFilterSet *array)
 	if (!array) return;
 	for (ng=array->ngramsize.min; ng <= array->ngramsize.max; ++ng) {
 		if (array->filter[ng]) {
-			closearray(array->filter[ng]);
+			closearray(ng, array->filter[ng]);
 		}
 	}
 #ifdef SHMALLOC
@@ -175,8 +272,12 @@ readngrams(void *item, size_t length, int ngram, void *filter)
 	size_t count=0, distinct=0;
 	long int where;
 	int i;
+	u_int32_t value;
 	u_int8_t *input = (u_int8_t *)item;
 	NgramCounter *ngrams = (NgramCounter *)filter;
+	int bits = ARRAYBITS(ngram);
+	CounterSpill *spill = ARRAYSPILL(ngram, ngrams);
+	u_int8_t *map = ARRAYPAGEMAP(ngram, ngrams);
 
 	/* Ignore tiny fragments */
 	if (length < ngram) return 0;
@@ -189,36 +290,194 @@ readngrams(void *item, size_t length, int ngram, void *filter)
 	for (; i <= length; ++i) {
 		++count;
 		where = ((unsigned long)ngramwork&NGRAMMASK(ngram));
-		if (!ngrams[where])
+		/* The counter stops at COUNTER_MAX by itself */
+		value = CounterBump(ngrams, bits, spill, where);
+		if (value == 1) {
+			/* Only a new counter can be on a new page */
+			if (map)
+				arraytouch(map, bits, where);
 			++distinct;
-		if (ngrams[where] < COUNTER_MAX)
-			++ngrams[where];
-		else {
+		}
+		if (value > COUNTER_MAX) {
 			/* fprintf(stderr, "Item overflow in %d\n", spot); */
-			++overflows;
+			(void) __atomic_add_fetch(&overflows, 1,
+				__ATOMIC_RELAXED);
 		}
 		if (i < length) {
 			ngramwork <<= 8;
 			ngramwork += input[i];
 		}
 	}
-	totalentries += count;
-	distinctentries += distinct;
+	/* Worker threads share these; the distinct count for their private
+	 * arrays is worked out when they're merged.
+	 */
+	(void) __atomic_add_fetch(&totalentries, count, __ATOMIC_RELAXED);
+	if (!threadset)
+		distinctentries += distinct;
 	setngramlabel(NGRAM_ARRAY, NULL, ngram, 0, totalentries, distinctentries);
 	return count;
 }
 
+/* All the sizes in one pass: one rolling window, and each byte bumps a
+ * counter in each size's array, rather than going over the item once per
+ * size. lo and hi are constants wherever this is called (see
+ * readngramsrange), so the compiler can unroll the sizes and drop the
+ * ones that aren't there. The totals and overflows are added up in
+ * locals and only go out to the globals at the end.
+ *
+ * The arrays from 3 up don't fit in the cache, and with all the sizes
+ * in the one loop, a miss on a big one holds up the small ones too; so
+ * a second window runs ARRAY_AHEAD bytes ahead, prefetching the big
+ * sizes' counters.
+ */
+static inline __attribute__((always_inline)) int
+readngramsfused(u_int8_t *input, size_t length, NgramFilterSet *vfilter,
+	const int lo, const int hi)
+{
+	u_int32_t ngramwork = 0, aheadwork = 0;
+	u_int32_t value;
+	void *ngrams[ARRAYMAX+1];
+	int bits[ARRAYMAX+1];
+	CounterSpill *spill[ARRAYMAX+1];
+	u_int8_t *map[ARRAYMAX+1];
+	size_t i, j, head, where;
+	size_t count=0, distinct=0, over=0;
+	int ng;
+
+	for (ng=lo; ng <= hi; ++ng) {
+		ngrams[ng] = vfilter->filter[ng];
+		bits[ng] = ARRAYBITS(ng);
+		spill[ng] = ARRAYSPILL(ng, ngrams[ng]);
+		map[ng] = ARRAYPAGEMAP(ng, ngrams[ng]);
+		if (length >= ng)
+			count += length-ng+1;
+	}
+	/* Until the window's full, only the smaller sizes count */
+	head = min(length, hi-1);
+	for (i=0; i < head; ++i) {
+		ngramwork = (ngramwork << 8) + input[i];
+		for (ng=lo; ng <= i+1; ++ng) {
+			where = ngramwork & NGRAMMASK(ng);
+			value = CounterBump(ngrams[ng], bits[ng], spill[ng],
+				where);
+			if (value == 1) {
+				if (ARRAYPAGED(ng))
+					arraytouch(map[ng], bits[ng], where);
+				++distinct;
+			} else if (value > COUNTER_MAX)
+				++over;
+		}
+	}
+	for (j=0; j < i+ARRAY_AHEAD && j < length; ++j)
+		aheadwork = (aheadwork << 8) + input[j];
+	for (; i < length; ++i) {
+		ngramwork = (ngramwork << 8) + input[i];
+		if (j < length && hi >= ARRAY_PREFETCH) {
+			aheadwork = (aheadwork << 8) + input[j++];
+			for (ng=lo; ng <= hi; ++ng) {
+				if (ng < ARRAY_PREFETCH)
+					continue;
+				__builtin_prefetch(CounterAddr(ngrams[ng],
+					bits[ng], aheadwork & NGRAMMASK(ng)), 1);
+			}
+		}
+		for (ng=lo; ng <= hi; ++ng) {
+			/* The counter stops at COUNTER_MAX by itself */
+			where = ngramwork & NGRAMMASK(ng);
+			value = CounterBump(ngrams[ng], bits[ng], spill[ng],
+				where);
+			if (value == 1) {
+				if (ARRAYPAGED(ng))
+					arraytouch(map[ng], bits[ng], where);
+				++distinct;
+			} else if (value > COUNTER_MAX)
+				++over;
+		}
+	}
+	if (over)
+		(void) __atomic_add_fetch(&overflows, over, __ATOMIC_RELAXED);
+	/* As in readngrams */
+	(void) __atomic_add_fetch(&totalentries, count, __ATOMIC_RELAXED);
+	if (!threadset)
+		distinctentries += distinct;
+	for (ng=lo; ng <= hi; ++ng)
+		setngramlabel(NGRAM_ARRAY, NULL, ng, 0, totalentries,
+			distinctentries);
+	return count;
+}
+
+#define FUSED(lo, hi)	((lo)*10 + (hi))
+
 int
 readngramsrange(void *item, size_t length, NgramFilterSet *vfilter)
 {
+	Range r = vfilter->ngramsize;
 	int ret=0;
 	int ng;
 
-	for (ng=vfilter->ngramsize.min; ng <= vfilter->ngramsize.max; ++ng)
+	switch (FUSED(r.min, r.max)) {
+	case FUSED(1,1): return readngramsfused(item, length, vfilter, 1, 1);
+	case FUSED(1,2): return readngramsfused(item, length, vfilter, 1, 2);
+	case FUSED(1,3): return readngramsfused(item, length, vfilter, 1, 3);
+	case FUSED(1,4): return readngramsfused(item, length, vfilter, 1, 4);
+	case FUSED(2,2): return readngramsfused(item, length, vfilter, 2, 2);
+	case FUSED(2,3): return readngramsfused(item, length, vfilter, 2, 3);
+	case FUSED(2,4): return readngramsfused(item, length, vfilter, 2, 4);
+	case FUSED(3,3): return readngramsfused(item, length, vfilter, 3, 3);
+	case FUSED(3,4): return readngramsfused(item, length, vfilter, 3, 4);
+	case FUSED(4,4): return readngramsfused(item, length, vfilter, 4, 4);
+	default:
+		break;
+	}
+	for (ng=r.min; ng <= r.max; ++ng)
 		ret += readngrams(item, length, ng, vfilter->filter[ng]);
 	return ret;
 }
 
+/* The same, when we already have the byte counts (see PacketContext):
+ * the 1-grams are just the 256 counts added in, and only the bigger
+ * sizes need to go over the item. The 1-gram array is too small ever to
+ * be packed (see COUNTER_PACKMIN), so it's plain NgramCounters.
+ */
+int
+readngramscounts(void *item, size_t length, u_int32_t *bytes,
+	NgramFilterSet *vfilter)
+{
+	NgramFilterSet rest;
+	NgramCounter *ngrams = (NgramCounter *)vfilter->filter[1];
+	size_t distinct=0, over=0;
+	u_int32_t value;
+	int i, ret=length;
+
+	if (vfilter->ngramsize.min != 1 || ARRAYBITS(1) != 16)
+		return readngramsrange(item, length, vfilter);
+	for (i=0; i < OCTETSIZE; ++i) {
+		if (!bytes[i])
+			continue;
+		if (!ngrams[i])
+			++distinct;
+		value = ngrams[i] + bytes[i];
+		if (value > COUNTER_MAX) {
+			over += value - COUNTER_MAX;
+			value = COUNTER_MAX;
+		}
+		ngrams[i] = value;
+	}
+	if (over)
+		(void) __atomic_add_fetch(&overflows, over, __ATOMIC_RELAXED);
+	/* As in readngrams */
+	(void) __atomic_add_fetch(&totalentries, length, __ATOMIC_RELAXED);
+	if (!threadset)
+		distinctentries += distinct;
+	if (vfilter->ngramsize.max > 1) {
+		rest = *vfilter;
+		rest.ngramsize.min = 2;
+		ret += readngramsrange(item, length, &rest);
+	}
+	setngramlabel(NGRAM_ARRAY, NULL, 1, 0, totalentries, distinctentries);
+	return ret;
+}
+
 /* For the delete, the only cautionary note is when a bucket is full */
 int
 delngramarray(void *item, size_t length, int ngram, void *filter)
@@ -227,8 +486,11 @@ delngramarray(void *item, size_t length, int ngram, void *filter)
 	size_t count=0, indistinct=0;;
 	long int where;
 	int i;
+	u_int32_t value;
 	u_int8_t *input = (u_int8_t *)item;
 	NgramCounter *ngrams = (NgramCounter *)filter;
+	int bits = ARRAYBITS(ngram);
+	CounterSpill *spill = ARRAYSPILL(ngram, ngrams);
 
 	/* Ignore tiny fragments */
 	if (length < ngram) return 0;
@@ -241,13 +503,15 @@ delngramarray(void *item, size_t length, int ngram, void *filter)
 	for (; i <= length; ++i) {
 		++count;
 		where = ((unsigned long)ngramwork&NGRAMMASK(ngram));
-		if (ngrams[where] < COUNTER_MAX)
-			--ngrams[where];
+		value = CounterGet(ngrams, bits, spill, where);
+		if (value < COUNTER_MAX)
+			(void) CounterPut(ngrams, bits, spill, where,
+				(NgramCounter)--value);
 		else {
 			/* fprintf(stderr, "Item underflow in %d\n", spot); */
 			++underflows;
 		}
-		if (!ngrams[where])
+		if (!value)
 			++indistinct;
 		if (i < length) {
 			ngramwork <<= 8;
@@ -291,7 +555,8 @@ findarray(void *item, int ngram, void *filter)
 	}
 	/* This is where the array is nice ... */
 	where = ((unsigned long)ngramwork&NGRAMMASK(ngram));
-	return ngrams[where];
+	return CounterGet(ngrams, ARRAYBITS(ngram), ARRAYSPILL(ngram, ngrams),
+		where);
 }
 
 /* I should make the following generic ... */
@@ -373,27 +638,33 @@ reportngrams(FILE *file, u_int16_t *ngrams, int size)
 	long int i;
 	int byte;
 	long int total, ngramno, ngram10no, ngram1no, ngram01no;
+	u_int32_t count;
+	int bits = ARRAYBITS(size);
+	CounterSpill *spill = ARRAYSPILL(size, ngrams);
+	size_t start, end=0;
 
 	if (!file) return;
 	total = ngramno = ngram10no = ngram1no = ngram01no = 0;
-	for (i=0; i < NGRAMSIZE(size); ++i) {
-		if (ngrams[i]) {
-			++ngramno;
-			total += ngrams[i];
-			if (ngrams[i] >= 100) {
-				if (dumplevel == 1)
-					reportngram(file, ngrams[i], size, i);
-				++ngram01no;
-				if (ngrams[i] >= 1000) {
-					++ngram1no;
-					if (ngrams[i] >= 10000) {
-						++ngram10no;
+	while (arraypages(size, ngrams, &start, &end)) {
+		for (i=start; i < end; ++i) {
+			if ((count = CounterGet(ngrams, bits, spill, i))) {
+				++ngramno;
+				total += count;
+				if (count >= 100) {
+					if (dumplevel == 1)
+						reportngram(file, count, size, i);
+					++ngram01no;
+					if (count >= 1000) {
+						++ngram1no;
+						if (count >= 10000) {
+							++ngram10no;
+						}
 					}
 				}
-			}
 
-			if (dumplevel > 1)
-				reportngram(file, ngrams[i], size, i);
+				if (dumplevel > 1)
+					reportngram(file, count, size, i);
+			}
 		}
 	}
 	fprintf(file, "ngram %d: %ld total %ld distinct %ld %ld %ld\n", size,
@@ -411,15 +682,47 @@ distarray(int ngram, double *mu, double *sigma, u_int64_t *max, u_int64_t *min,
 {
 	NgramCounter *ngrams = (NgramCounter *)filter;
 	double chisquare;
-
-	bloomarraystats(ngrams, sizeof(NgramCounter),
-		ngram, mu, sigma, max, min, &chisquare);
+	int bits = ARRAYBITS(ngram);
+	CounterSpill *spill = ARRAYSPILL(ngram, ngrams);
+	size_t m = NGRAMSIZE(ngram);
+	size_t i, start, end=0, seen=0;
+	u_int64_t value;
+	double sumsquare=0.0, sum=0.0;
+
+	if (!ARRAYPAGED(ngram)) {
+		if (bits == 16)
+			bloomarraystats(ngrams, sizeof(NgramCounter),
+				m, mu, sigma, max, min, &chisquare);
+		else
+			CounterStats(ngrams, bits, spill, m, mu, sigma,
+				max, min);
+		return;
+	}
+	/* As CounterStats, over the pages that have been touched; the
+	 * rest are zeros, which only count towards m (and the min).
+	 */
+	*max = 0;
+	*min = 0xffffffff;
+	while (arraypages(ngram, ngrams, &start, &end)) {
+		for (i=start; i < end; ++i) {
+			value = CounterGet(ngrams, bits, spill, i);
+			sumsquare += (double)value*value;
+			sum += (double)value;
+			if (value > *max) *max = value;
+			if (value < *min) *min = value;
+		}
+		seen += end-start;
+	}
+	if (seen < m)
+		*min = 0;
+	*mu = sum/(double)m;
+	*sigma = sqrt((sumsquare - (double)m*(*mu)*(*mu))/(double)(m-1));
 }
 
 void
 distarrayrange(int ngram, double *mu, double *sigma, u_int64_t *max, u_int64_t *min, NgramFilterSet *filter)
 {
-	return;
+	distarray(ngram, mu, sigma, max, min, filter->filter[ngram]);
 }
 
 
@@ -435,6 +738,101 @@ dumparray(FILE *file, int ngram, void *filter)
 void
 dumparrayrange(FILE *file, NgramFilterSet *filter)
 {
+	int ng;
+
+	if (!file) return;
+	for (ng=filter->ngramsize.min; ng <= filter->ngramsize.max; ++ng)
+		dumparray(file, ng, filter->filter[ng]);
+}
+
+/* Merge one set of arrays into another. Here, a counter stops at
+ * COUNTER_MAX and counts each increment after that as an overflow, so
+ * the ones owed in the merge are just max(0, a+b-COUNTER_MAX). Newly
+ * nonzero counters in the real arrays are distinct ngrams, just as if
+ * they'd been added there directly.
+ */
+/* Packed arrays go one counter at a time, through the spill. Returns the
+ * overflows, and the newly nonzero counters in distinct.
+ */
+static size_t
+mergepacked(int ngram, NgramCounter *into, NgramCounter *from, size_t *distinct)
+{
+	size_t j;
+	size_t extra=0, newones=0;
+	int bits = ARRAYBITS(ngram);
+	CounterSpill *tospill = ARRAYSPILL(ngram, into);
+	CounterSpill *frspill = ARRAYSPILL(ngram, from);
+	u_int8_t *tomap = ARRAYPAGEMAP(ngram, into);
+	u_int32_t a, b, sum;
+	size_t start, end=0;
+
+	while (arraypages(ngram, from, &start, &end)) {
+		for (j=start; j < end; ++j) {
+			if (!(b = CounterGet(from, bits, frspill, j)))
+				continue;
+			if (tomap)
+				arraytouch(tomap, bits, j);
+			a = CounterGet(into, bits, tospill, j);
+			sum = a + b;
+			extra += sum > COUNTER_MAX ? sum-COUNTER_MAX : 0;
+			newones += (a == 0);
+			if (CounterPut(into, bits, tospill, j,
+					sum > COUNTER_MAX ? COUNTER_MAX : sum) < 0)
+				++tospill->lost;
+		}
+	}
+	tospill->lost += frspill->lost;
+	*distinct = newones;
+	return extra;
+}
+
+void
+mergearray(int ngram, NgramCounter *into, NgramCounter *from, int real)
+{
+	size_t i, j, end, start, last=0;
+	size_t extra=0, distinct=0;
+	u_int8_t *tomap = ARRAYPAGEMAP(ngram, into);
+
+	if (ARRAYBITS(ngram) != 16)
+		extra = mergepacked(ngram, into, from, &distinct);
+	else while (arraypages(ngram, from, &start, &last)) {
+		if (tomap)
+			arraytouch(tomap, 16, start);
+		for (i=start; i < last; i = end) {
+			u_int32_t chunkextra=0, chunkdistinct=0;
+
+			end = min(i+4096, last);
+			for (j=i; j < end; ++j) {
+				u_int32_t a = into[j], b = from[j];
+				u_int32_t sum = a + b;
+
+				chunkextra += sum > COUNTER_MAX ? sum-COUNTER_MAX : 0;
+				chunkdistinct += (a == 0 && b != 0);
+				into[j] = sum > COUNTER_MAX ? COUNTER_MAX : sum;
+			}
+			extra += chunkextra;
+			distinct += chunkdistinct;
+		}
+	}
+	(void) __atomic_add_fetch(&overflows, extra, __ATOMIC_RELAXED);
+	if (real) {
+		distinctentries += distinct;
+		setngramlabel(NGRAM_ARRAY, NULL, ngram, 0, totalentries,
+			distinctentries);
+	}
+}
+
+void
+mergearrayrange(NgramFilterSet *into, NgramFilterSet *from)
+{
+	int ng;
+
+	for (ng=into->ngramsize.min; ng <= into->ngramsize.max; ++ng) {
+		if (into->filter[ng] && from->filter[ng])
+			mergearray(ng, (NgramCounter *)into->filter[ng],
+				(NgramCounter *)from->filter[ng],
+				into == ngram->f);
+	}
 }
 
 #ifdef TEST
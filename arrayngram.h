@@ -11,6 +11,8 @@ NgramCounter * allocngramarray(int ngram);
 
 int readngramsrange(void *item, size_t length, NgramFilterSet *vfilter);
 int readngrams(void *item, size_t length, int ngram, void *filter);
+int readngramscounts(void *item, size_t length, u_int32_t *bytes,
+	NgramFilterSet *vfilter);
 int delngramarrayrange(void *item, size_t length, NgramFilterSet *filter);
 int delngramarray(void *item, size_t length, int ngram, void *filter);
 
@@ -30,5 +32,7 @@ void distarray(int ngram, double *mu, double *sigma, u_int64_t *max, u_int64_t *
 void distarrayrange(int ngram, double *mu, double *sigma, u_int64_t *max, u_int64_t *min, NgramFilterSet *filter);
 void dumparray(FILE *file, int ngram, void *filter);
 void dumparrayrange(FILE *file, NgramFilterSet *filter);
-void closearray(void *filter);
+void closearray(int ngram, void *filter);
 void closearrayrange(NgramFilterSet *filter);
+void mergearray(int ngram, NgramCounter *into, NgramCounter *from, int real);
+void mergearrayrange(NgramFilterSet *into, NgramFilterSet *from);
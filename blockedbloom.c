@@ -0,0 +1,532 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <memory.h>
+#include <malloc.h>
+#include <math.h>
+#include "libstats.h"
+/* For the "generic" ngram structure */
+#include "ngram.h"
+#include <stdint.h>
+#include "fnv.h"
+#include "fnvrange.h"
+#include "rolling.h"
+
+#include "bloom.h"
+#include "blockedbloom.h"
+
+NgramFilterSet blockedbloomset = {
+	{0,0},
+	NULL
+};
+NgramOps blockedbloomops = {
+	NewBlockedBloomNgramFilterSet,
+	AddBlockedBloomNgramFilterSet,
+	DeleteBlockedBloomNgramFilterSet,
+	FindBlockedBloomFilter,
+	FindBlockedBloomNgramFilterSet,
+	FindBlockedBloomNgramDistFilter,
+	DistBlockedBloomNgramFilter,
+	DumpBlockedBloomNgramFilterSet,
+	CloseBlockedBloomNgramFilterSet,
+	MergeBlockedBloomNgramFilterSet
+};
+
+Ngram blockedbloom = {
+	&blockedbloomset,
+	&blockedbloomops
+};
+
+/* We use the same amount of memory as the ordinary Bloom filter for
+ * the same ngram size, so the two can be compared directly.
+ */
+BlockedBloomFilter *
+#ifdef SHMALLOC
+NewBlockedBloomNgramFilter(int ngram, char *shmfilename, int mode)
+#else
+NewBlockedBloomNgramFilter(int ngram)
+#endif
+{
+	BlockedBloomFilter *answer;
+	size_t blocks, size, bytesize;
+
+	blocks = (BloomSize(ngram)+BLOCKEDBLOOM_SLOTS-1)/BLOCKEDBLOOM_SLOTS;
+	size = blocks*BLOCKEDBLOOM_SLOTS;
+	bytesize = sizeof(BlockedBloomFilter) + size*sizeof(NgramCounter);
+	setngramlabel(NGRAM_BLOCKEDBLOOM, NULL, ngram, bytesize, 0, 0);
+#ifdef SHMALLOC
+	answer = (BlockedBloomFilter *)ngram_shmalloc(bytesize,
+		shmfilename, mode);
+#else
+	/* The whole point is to stay within a cache line, so be sure
+	 * the blocks are actually aligned on one.
+	 */
+	if (posix_memalign((void **)&answer, BLOCKEDBLOOM_LINE, bytesize))
+		answer = NULL;
+	if (answer)
+		memset((void *)answer, 0, bytesize);
+#endif
+	if (!answer) {
+		fprintf(stderr, "Couldn't allocate %ld\n", bytesize);
+		perror("malloc");
+		return NULL;
+	}
+	answer->b = blocks;
+	answer->m = size;
+	answer->zeros = size;
+	answer->k = BLOCKEDBLOOM_K;
+	return answer;
+}
+
+int
+BlockedBloomFilterSetSize(Range ngram)
+{
+	return sizeof(NgramFilterSet) + (ngram.max-ngram.min+1)*sizeof(BlockedBloomFilter *);
+}
+
+NgramFilterSet *
+#ifdef SHMALLOC
+NewBlockedBloomNgramFilterSet(Range ngram, char *shmfilename, int mode)
+#else
+NewBlockedBloomNgramFilterSet(Range ngram)
+#endif
+{
+	NgramFilterSet *answer;
+	int ng;
+	size_t bytesize = BlockedBloomFilterSetSize(ngram);
+
+#ifdef SHMALLOC
+	answer = (NgramFilterSet *)ngram_shmalloc(bytesize,
+		shmfilename, mode);
+#else
+	answer = (NgramFilterSet *)malloc(bytesize);
+	if (answer)
+		memset((void *)answer, 0, bytesize);
+#endif
+	if (!answer) return NULL;
+	answer->ngramsize = ngram;
+	for (ng=ngram.min; ng <= ngram.max; ++ng) {
+		answer->filter[ng] =
+#ifdef SHMALLOC
+			(NgramFilter)NewBlockedBloomNgramFilter(ng, shmfilename, mode);
+#else
+			(NgramFilter)NewBlockedBloomNgramFilter(ng);
+#endif
+	}
+	return answer;
+}
+
+void
+CloseBlockedBloomNgramFilter(BlockedBloomFilter *filter)
+{
+	if (!filter) return;
+#ifdef SHMALLOC
+	ngram_shmfree((void *)filter);
+#else
+	free((void *)filter);
+#endif
+}
+
+void
+CloseBlockedBloomNgramFilterSet(NgramFilterSet *set)
+{
+	int ng;
+
+	if (!set) return;
+	for (ng=set->ngramsize.min; ng <= set->ngramsize.max; ++ng) {
+		if (set->filter[ng]) {
+			CloseBlockedBloomNgramFilter((BlockedBloomFilter *)set->filter[ng]);
+		}
+	}
+#ifdef SHMALLOC
+	ngram_shmfree(set);
+#else
+	free(set);
+#endif
+}
+
+/* The first half of the hash picks the block. Rather than a modulus,
+ * we scale it into range with a multiply and shift, which is a good
+ * deal cheaper and just as uniform.
+ */
+static inline NgramCounter *
+BlockedBloomBlock(u_int32_t h, BlockedBloomFilter *filter)
+{
+	return filter->counter +
+		(((u_int64_t)h*filter->b)>>32)*BLOCKEDBLOOM_SLOTS;
+}
+
+/* The second half picks the counters within the block, taking successive
+ * fields of it as slot numbers. The slots aren't guaranteed distinct, but
+ * a repeat just means that counter gets bumped twice, and lookups still
+ * come out right. An odd-stride walk through the block, which does
+ * guarantee distinct slots, turned out to give several times the false
+ * positive rate, since there are only a few hundred distinct patterns.
+ */
+#define BLOCKSLOT(g,i)	(((g)>>(BLOCKEDBLOOM_SLOTBITS*(i)))&(BLOCKEDBLOOM_SLOTS-1))
+
+/* Distinct items, estimated from the counters still zero */
+static size_t
+BlockedBloomDistinct(BlockedBloomFilter *filter)
+{
+	filter->d = BloomDistinctEstimate(filter->m, filter->k, filter->n,
+		filter->zeros);
+	return filter->d;
+}
+
+/* Add a hashed item to the filter. Returns number of overflows, if any. */
+int
+AddBlockedBloomHash64(Hash64 hash, BlockedBloomFilter *filter)
+{
+	NgramCounter *block;
+	u_int32_t spot;
+	u_int32_t newval;
+	int i;
+	int ret=0;
+
+	block = BlockedBloomBlock(hash.h.a, filter);
+	for (i=0; i < filter->k; ++i) {
+		spot = BLOCKSLOT(hash.h.b, i);
+		newval = ++block[spot];
+		if (newval >= COUNTER_MAX) {
+			++filter->overflows;
+			block[spot] = COUNTER_MAX;
+			++ret;
+		} else if (newval == 1) {
+			/* One less empty counter, for the distinct count */
+			--filter->zeros;
+		}
+	}
+	++filter->n;
+	return ret;
+}
+
+/* Look up a hashed item, returning its (approximate) frequency */
+int
+FindBlockedBloomHash64(Hash64 hash, BlockedBloomFilter *filter)
+{
+	NgramCounter *block;
+	u_int32_t spot;
+	int frequency;
+	int i;
+
+	block = BlockedBloomBlock(hash.h.a, filter);
+	frequency = block[BLOCKSLOT(hash.h.b, 0)];
+	for (i=1; frequency && i < filter->k; ++i) {
+		spot = BLOCKSLOT(hash.h.b, i);
+		if (frequency > block[spot])
+			frequency = block[spot];
+	}
+	return frequency;
+}
+
+/* Delete a hashed item. As with the ordinary filter, this is approximate
+ * once counters have maxxed out.
+ */
+static int
+DeleteBlockedBloomHash64(Hash64 hash, BlockedBloomFilter *filter)
+{
+	NgramCounter *block;
+	u_int32_t spot;
+	int ret=0;
+	int i;
+
+	if (!FindBlockedBloomHash64(hash, filter))
+		return -1;
+	block = BlockedBloomBlock(hash.h.a, filter);
+	for (i=0; i < filter->k; ++i) {
+		spot = BLOCKSLOT(hash.h.b, i);
+		if (block[spot] == COUNTER_MAX) {
+			++filter->underflows;
+			++ret;
+		} else if (!--block[spot]) {
+			++filter->zeros;
+		}
+	}
+	--filter->n;
+	return ret;
+}
+
+/* Hash a range of ngram sizes at one spot, and add them to the set */
+static int
+AddBlockedBloomFilterRange(void *item, int length, Range range, NgramFilterSet *filter)
+{
+	int i;
+	int ret=0;
+	Hash64 hvals[NGRAM_RANGEMAX+1];
+
+	if (range.min > length) return 0;
+	if (range.max > length) range.max = length;
+	fnv_64_buf_range(item, length, FNV1_64_INIT,
+		range.min, range.max, (Fnv64_t *)hvals);
+	for (i=range.min; i <= range.max; ++i) {
+		ret += AddBlockedBloomHash64(hvals[i-range.min],
+			(BlockedBloomFilter *)filter->filter[i]);
+	}
+	return ret;
+}
+
+/* Chop an item into overlapping ngrams, and add them to a single filter */
+int
+AddBlockedBloomNgramFilter(void *item, size_t length, int ngram, BlockedBloomFilter *filter)
+{
+	int i;
+	int ret=0;
+	Hash64 hval;
+
+	for (i=0; i+ngram <= length; ++i) {
+		hval.ab = BloomHashItem((u_int8_t *)item + i, ngram);
+		ret += AddBlockedBloomHash64(hval, filter);
+	}
+	setngramlabel(NGRAM_BLOCKEDBLOOM, NULL, ngram, 0, filter->n,
+		BlockedBloomDistinct(filter));
+	return ret;
+}
+
+/* Same approach as AddBloomNgramFilterSet - the full range of sizes
+ * at each offset, ramping down at the end, either rolled or rehashed.
+ */
+int
+AddBlockedBloomNgramFilterSet(void *item, size_t length, NgramFilterSet *vfilter)
+{
+	int i, count;
+	int ret=0;
+	Range r = vfilter->ngramsize;
+	Roll64 roll;
+	Hash64 hvals[ROLL_MAXN+1];
+
+	if (ngramlabel.hashfamily == HASH_ROLLING) {
+		roll_64_init(&roll, item, length, r.min, r.max);
+		while ((count = roll_64_next(&roll, (u_int64_t *)hvals)) > 0) {
+			for (i=0; i < count; ++i)
+				ret += AddBlockedBloomHash64(hvals[i],
+					(BlockedBloomFilter *)vfilter->filter[r.min+i]);
+		}
+	} else {
+		for (i=0; i+r.max <= length; ++i) {
+			ret += AddBlockedBloomFilterRange(item+i, length-i, r, vfilter);
+		}
+		for (--r.max; r.max >= r.min && i+r.max <= length;
+				++i, --r.max) {
+			ret += AddBlockedBloomFilterRange(item+i, length-i, r, vfilter);
+		}
+	}
+	for (i=vfilter->ngramsize.min; i <= vfilter->ngramsize.max; ++i) {
+		setngramlabel(NGRAM_BLOCKEDBLOOM, NULL, i, 0,
+			((BlockedBloomFilter *)vfilter->filter[i])->n,
+			BlockedBloomDistinct((BlockedBloomFilter *)vfilter->filter[i]));
+	}
+	return ret;
+}
+
+int
+DeleteBlockedBloomNgramFilterSet(void *item, size_t length, NgramFilterSet *vfilter)
+{
+	int i, ng;
+	int ret=0;
+	Hash64 hval;
+	BlockedBloomFilter *filter;
+
+	for (ng=vfilter->ngramsize.min; ng <= vfilter->ngramsize.max; ++ng) {
+		filter = (BlockedBloomFilter *)vfilter->filter[ng];
+		for (i=0; i+ng <= length; ++i) {
+			hval.ab = BloomHashItem((u_int8_t *)item + i, ng);
+			ret += DeleteBlockedBloomHash64(hval, filter);
+		}
+		setngramlabel(NGRAM_BLOCKEDBLOOM, NULL, ng, 0,
+			filter->n, BlockedBloomDistinct(filter));
+	}
+	return ret;
+}
+
+/* Find a single ngram */
+int
+FindBlockedBloomFilter(void *item, int ngram, void *vfilter)
+{
+	Hash64 hval;
+
+	hval.ab = BloomHashItem(item, (size_t)ngram);
+	return FindBlockedBloomHash64(hval, (BlockedBloomFilter *)vfilter);
+}
+
+/* Chop an item into ngrams, and total up their (approximate) frequencies */
+int
+FindBlockedBloomNgramFilterSet(void *item, size_t length, NgramFilterSet *vfilter)
+{
+	int i, ng;
+	int ret=0;
+
+	for (ng=vfilter->ngramsize.min; ng <= vfilter->ngramsize.max; ++ng) {
+		for (i=0; i+ng <= length; ++i) {
+			ret += FindBlockedBloomFilter((u_int8_t *)item + i,
+				ng, vfilter->filter[ng]);
+		}
+	}
+	return ret;
+}
+
+int
+FindBlockedBloomNgramDistFilter(void *item, size_t length, int ngram, double *mu, double *sigma, double *rho, NgramFilterSet *vfilter)
+{
+	int i;
+	int total=0;
+	static int frequencies[NGRAM_MAX];
+
+	for (i=0; i+ngram <= length && i < NGRAM_MAX; ++i) {
+		frequencies[i] =
+			FindBlockedBloomFilter((u_int8_t *)item + i, ngram,
+				vfilter->filter[ngram]);
+		total += frequencies[i];
+	}
+	intarraystats(frequencies, i, mu, sigma, rho);
+	return total;
+}
+
+/* Some simple statistics about the whole filter */
+void
+DistBlockedBloomNgramFilter(int ngram, double *mu, double *sigma,
+	u_int64_t *max, u_int64_t *min, NgramFilterSet *vfilter)
+{
+	double chisquare;
+	BlockedBloomFilter *filter = (BlockedBloomFilter *)vfilter->filter[ngram];
+
+	bloomarraystats(filter->counter, sizeof(NgramCounter),
+		filter->m, mu, sigma, max, min, &chisquare);
+}
+
+void
+DumpBlockedBloomNgramFilter(FILE *dumpfile, int ngram, BlockedBloomFilter *filter)
+{
+	size_t i;
+
+	if (!dumpfile) return;
+	fprintf(dumpfile, "ngram %d: k %d m %ld n %ld d %ld overflows %ld\n",
+		ngram, filter->k, filter->m, filter->n, filter->d,
+		filter->overflows);
+	for (i=0; i < filter->m; ++i)
+		if (filter->counter[i])
+			fprintf(dumpfile, "%ld %d\n", i, filter->counter[i]);
+}
+
+void
+DumpBlockedBloomNgramFilterSet(FILE *dumpfile, NgramFilterSet *vfilter)
+{
+	int ng;
+
+	if (!dumpfile) return;
+	for (ng=vfilter->ngramsize.min; ng <= vfilter->ngramsize.max; ++ng)
+		DumpBlockedBloomNgramFilter(dumpfile, ng,
+			(BlockedBloomFilter *)vfilter->filter[ng]);
+}
+
+/* Merge one set into another; the counters work just as in the ordinary
+ * filter, so we use its merge. The distinct estimate ignores the uneven
+ * loading of the blocks, so it runs a little low.
+ */
+void
+MergeBlockedBloomNgramFilterSet(NgramFilterSet *into, NgramFilterSet *from)
+{
+	int ng;
+	size_t zeros;
+	BlockedBloomFilter *to, *fr;
+
+	for (ng=into->ngramsize.min; ng <= into->ngramsize.max; ++ng) {
+		to = (BlockedBloomFilter *)into->filter[ng];
+		fr = (BlockedBloomFilter *)from->filter[ng];
+		if (!to || !fr || to->m != fr->m) continue;
+		to->overflows += fr->overflows +
+			MergeBloomCounters(to->counter, fr->counter, to->m, &zeros);
+		to->underflows += fr->underflows;
+		to->n += fr->n;
+		to->zeros = zeros;
+		(void) BlockedBloomDistinct(to);
+		if (into == ngram->f)
+			setngramlabel(NGRAM_BLOCKEDBLOOM, NULL, ng, 0,
+				to->n, to->d);
+	}
+}
+
+#ifdef TEST
+/* False positive comparison against the ordinary counting Bloom filter.
+ * Both are sized for the same ngram length, and so use the same amount
+ * of counter memory. We fill them both with the same random items,
+ * then probe with items we know weren't inserted.
+ */
+FILE *dumpfile=NULL;
+int dumplevel;
+
+static void
+randomitem(u_int8_t *item, int ngram)
+{
+	int i;
+
+	for (i=0; i < ngram; ++i)
+		item[i] = random()&0xff;
+}
+
+int
+main(int argc, char **argv)
+{
+	int ngram = 2;
+	long int count = 0, probes = 1000000L;
+	long int i;
+	long int bloomfp=0, blockedfp=0;
+	int c;
+	u_int8_t item[NGRAM_RANGEMAX+8];
+	BloomFilter *filter;
+	BlockedBloomFilter *blocked;
+
+	while ((c = getopt(argc, argv, "n:c:p:")) >= 0) {
+		switch (c) {
+		case 'n':
+			ngram = atoi(optarg);
+			break;
+		case 'c':
+			count = atol(optarg);
+			break;
+		case 'p':
+			probes = atol(optarg);
+			break;
+		default:
+			fprintf(stderr,
+				"Usage: blockedbloomtest [-n ngram] [-c items] [-p probes]\n");
+			exit(1);
+		}
+	}
+	/* Default to the load the filters were designed for. We use
+	 * 8 byte items regardless of the ngram size, so that we don't run
+	 * out of distinct ones.
+	 */
+	if (!count)
+		count = BloomSize(ngram)/32;
+	filter = NewBloomNgramFilter(ngram);
+	blocked = NewBlockedBloomNgramFilter(ngram);
+	if (!filter || !blocked)
+		exit(2);
+
+	srandom(1);
+	for (i=0; i < count; ++i) {
+		randomitem(item, 8);
+		AddBloomFilter(item, 8, filter);
+		AddBlockedBloomNgramFilter(item, 8, 8, blocked);
+	}
+	/* Probes come from a different stream; the odds of hitting an
+	 * inserted item by chance are negligible.
+	 */
+	srandom(2);
+	for (i=0; i < probes; ++i) {
+		randomitem(item, 8);
+		if (FindBloomFilter(item, 8, filter))
+			++bloomfp;
+		if (FindBlockedBloomFilter(item, 8, blocked))
+			++blockedfp;
+	}
+	printf("ngram %d items %ld counters %ld/%ld probes %ld\n",
+		ngram, count, filter->m, blocked->m, probes);
+	printf("bloom   k %2d false positives %ld rate %10.8lf\n",
+		filter->k, bloomfp, (double)bloomfp/probes);
+	printf("blocked k %2d false positives %ld rate %10.8lf\n",
+		blocked->k, blockedfp, (double)blockedfp/probes);
+	exit(0);
+}
+#endif
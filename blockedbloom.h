@@ -0,0 +1,79 @@
+/* A cache-line-blocked variant of the counting Bloom filter in bloom.c.
+ *
+ * The ordinary filter scatters its k counters over the whole table, so
+ * every insert or lookup costs k cache (and TLB) misses. Here, the first
+ * hash picks a single 64-byte block, and the second hash picks k counters
+ * within that block, so an insert or lookup costs about one miss.
+ *
+ * The price is a higher false positive rate at a given size, since the
+ * load on individual blocks varies quite a bit (it's roughly Poisson).
+ * With 16-bit counters there are only 32 counters per block, and the
+ * best k drops to around 6 (versus 23). Expect a false positive rate in
+ * the 10^-3 range, rather than 10^-7. See the TEST driver in
+ * blockedbloom.c for a comparison against the ordinary filter at equal
+ * memory.
+ */
+
+#ifndef _BLOCKEDBLOOM_H
+#define _BLOCKEDBLOOM_H
+
+/* Block size is one (x86) cache line */
+#define BLOCKEDBLOOM_LINE	64
+#define BLOCKEDBLOOM_SLOTS	(BLOCKEDBLOOM_LINE/sizeof(NgramCounter))
+#define BLOCKEDBLOOM_SLOTBITS	5	/* log2 of the above */
+/* Number of counters set per item - near optimal for 32 slots and our
+ * usual ratio of 32 counters per item. Each one takes SLOTBITS of the
+ * second 32-bit hash, so 6 is also as many as we can get.
+ */
+#define BLOCKEDBLOOM_K		6
+
+typedef struct _BlockedBloomFilter {
+	/* k - number of counters per item, all in one block
+	 * b - number of blocks
+	 * m - size of hash table (i.e., b*BLOCKEDBLOOM_SLOTS counters)
+	 * n - total number of items inserted into filter
+	 * d - number of distinct items inserted into filter (estimated
+	 *	from zeros, as in the ordinary filter)
+	 * zeros - counters still zero
+	 */
+	int k;
+	/* For checking adequacy of counter size */
+	size_t overflows;
+	size_t underflows;
+	size_t b, m, n, d;
+	size_t zeros;
+	/* Keep the blocks on cache line boundaries */
+	NgramCounter counter[0] __attribute__((aligned(BLOCKEDBLOOM_LINE)));
+} BlockedBloomFilter;
+
+BlockedBloomFilter *
+#ifdef SHMALLOC
+NewBlockedBloomNgramFilter(int ngram, char *shmfilename, int mode);
+#else
+NewBlockedBloomNgramFilter(int ngram);
+#endif
+
+NgramFilterSet *
+#ifdef SHMALLOC
+NewBlockedBloomNgramFilterSet(Range ngram, char *shmfilename, int mode);
+#else
+NewBlockedBloomNgramFilterSet(Range ngram);
+#endif
+
+/* Basic operations - these parallel the ones in bloom.h */
+int AddBlockedBloomHash64(Hash64 hash, BlockedBloomFilter *filter);
+int AddBlockedBloomNgramFilter(void *item, size_t length, int ngram, BlockedBloomFilter *filter);
+int AddBlockedBloomNgramFilterSet(void *item, size_t length, NgramFilterSet *vfilter);
+int DeleteBlockedBloomNgramFilterSet(void *item, size_t length, NgramFilterSet *vfilter);
+int FindBlockedBloomHash64(Hash64 hash, BlockedBloomFilter *filter);
+int FindBlockedBloomFilter(void *item, int ngram, void *vfilter);
+int FindBlockedBloomNgramFilterSet(void *item, size_t length, NgramFilterSet *vfilter);
+int FindBlockedBloomNgramDistFilter(void *item, size_t length, int ngram, double *mu, double *sigma, double *rho, NgramFilterSet *vfilter);
+void DistBlockedBloomNgramFilter(int ngram, double *mu, double *sigma, u_int64_t *max, u_int64_t *min, NgramFilterSet *vfilter);
+void DumpBlockedBloomNgramFilter(FILE *file, int ngram, BlockedBloomFilter *filter);
+void DumpBlockedBloomNgramFilterSet(FILE *file, NgramFilterSet *vfilter);
+void CloseBlockedBloomNgramFilter(BlockedBloomFilter *filter);
+void CloseBlockedBloomNgramFilterSet(NgramFilterSet *vfilter);
+void MergeBlockedBloomNgramFilterSet(NgramFilterSet *into, NgramFilterSet *from);
+
+#endif /* _BLOCKEDBLOOM_H */
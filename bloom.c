@@ -11,8 +11,10 @@
 #include <stdint.h>
 #include "fnv.h"
 #include "fnvrange.h"
+#include "rolling.h"
 
 #include "bloom.h"
+#include "counter.h"
 
 NgramFilterSet bloomset = {
 	{0,0},
@@ -27,7 +29,8 @@ NgramOps bloomops = {
 	FindBloomNgramDistFilter,
 	DistBloomNgramFilter,
 	DumpBloomNgramFilterSet,
-	CloseBloomNgramFilterSet
+	CloseBloomNgramFilterSet,
+	MergeBloomNgramFilterSet
 };
 
 Ngram bloom = {
@@ -135,9 +138,14 @@ NewBloomNgramFilter(int ngram)
 {
 	BloomFilter *answer;
 	size_t size, bytesize;
+	int bits;
 
 	size = BloomSize(ngram);
-	bytesize = sizeof(BloomFilter) + size*sizeof(NgramCounter);
+	/* One spare counter - the wraparound in BloomSpots can land on
+	 * counter[m], and always has, so make that a real one.
+	 */
+	bits = CounterBits(size+1);
+	bytesize = sizeof(BloomFilter) + CounterBytes(bits, size+1);
 	setngramlabel(NGRAM_BLOOM, NULL, ngram, bytesize, 0, 0);
 #ifdef SHMALLOC
 	answer = (BloomFilter *)ngram_shmalloc(bytesize,
@@ -153,6 +161,9 @@ NewBloomNgramFilter(int ngram)
 		return NULL;
 	}
 	answer->m = size;
+	answer->bits = bits;
+	answer->zeros = size+1;
+	CounterInit(answer->counter, bits, size+1);
 	/* k = (m/n)*ln 2. Here (see below), we're using a fixed value
 	 * for m/n of 32. So k = 22 or 23.
 	 */
@@ -240,6 +251,19 @@ CloseBloomNgramFilterSet(NgramFilterSet *array)
  * into two 32-bit hash values. If we ever needed to expand beyond
  * this, we could rework the hash to squeeze out a few more bits.
  */
+/* Alternatively, we use a rolling hash (see libs/rolling), which gives
+ * all the ngrams in an item for a fraction of the cost. Which one a
+ * filter uses is recorded in its label, and single items have to be
+ * hashed the same way to be found.
+ */
+u_int64_t
+BloomHashItem(void *item, size_t length)
+{
+	if (ngramlabel.hashfamily == HASH_ROLLING)
+		return roll_64_buf(item, length);
+	return (u_int64_t)fnv_64_buf(item, length, FNV1_64_INIT);
+}
+
 /* This function isn't actually used, since we always do a range of
  * hashes at once.
  */
@@ -249,13 +273,28 @@ BloomHash(int i, void *item, size_t length)
 	u_int32_t h, g;
 	Hash64 hval;
 
-	hval.ab = (u_int64_t)fnv_64_buf(item, length, FNV1_64_INIT);
+	hval.ab = BloomHashItem(item, length);
 	h = hval.h.a;
 	g = hval.h.b;
 	return h + (u_int32_t)i*g;
 }
 
 
+/* The counters' overflow table, if they're packed (including the spare) */
+#define BloomSpill(filter)	\
+	CounterSpillTable((filter)->counter, (filter)->bits, (filter)->m+1)
+
+/* Distinct items, estimated from the counters still zero (see
+ * BloomDistinctEstimate below), which the filter keeps up to date.
+ */
+static size_t
+BloomDistinct(BloomFilter *filter)
+{
+	filter->d = BloomDistinctEstimate(filter->m+1, filter->k, filter->n,
+		filter->zeros);
+	return filter->d;
+}
+
 /* Add an item to a Bloom filter. Done with atomic operations, so
  * this can be run in parallel.
  *
@@ -268,12 +307,12 @@ AddBloomFilter(void *item, size_t length, BloomFilter *filter)
 	u_int32_t i;
 	u_int32_t h, g;
 	size_t spot;
-	int distinct = 0;
 	int ret=0;
 	u_int32_t newval;
 	Hash64 hval;
+	CounterSpill *spill = BloomSpill(filter);
 
-	hval.ab = (u_int64_t)fnv_64_buf(item, length, FNV1_64_INIT);
+	hval.ab = BloomHashItem(item, length);
 	h = hval.h.a;
 	g = hval.h.b;
 	/* @@ Trivial optimization */
@@ -290,7 +329,9 @@ AddBloomFilter(void *item, size_t length, BloomFilter *filter)
 		newval = __atomic_add_fetch(filter->counter+spot, (u_int32_t)1,
 				__ATOMIC_RELAXED);
 #else
-		newval = ++filter->counter[spot];
+		/* This one stops at COUNTER_MAX on its own */
+		newval = CounterBump(filter->counter, filter->bits, spill,
+				spot);
 #endif
 		/*@@ check for overflow */
 		if (newval >= COUNTER_MAX) {
@@ -302,14 +343,16 @@ AddBloomFilter(void *item, size_t length, BloomFilter *filter)
 				(u_int32_t)COUNTER_MAX, __ATOMIC_RELAXED);
 #else
 			++filter->overflows;
-			filter->counter[spot] = COUNTER_MAX;
 #endif
 			++ret;
 		} else if (newval == 1) {
-			/* We can't always tell if an item is new, but
-			 * if this spot was empty, then it has to be.
-			 */
-				distinct = 1;
+			/* One less empty counter, for the distinct count */
+#ifdef NGRAM_PARALLEL
+			(void) __atomic_sub_fetch(&filter->zeros, (size_t)1,
+				__ATOMIC_RELAXED);
+#else
+			--filter->zeros;
+#endif
 		}
 		spot += g;
 	}
@@ -320,34 +363,18 @@ AddBloomFilter(void *item, size_t length, BloomFilter *filter)
 #else
 		++filter->n;
 #endif
-	/* number of distinct items */
-	if (distinct) {
-#ifdef NGRAM_PARALLEL
-		(void) __atomic_add_fetch(&filter->d, (size_t)distinct,
-			__ATOMIC_RELAXED);
-#else
-		++filter->d;
-#endif
-	}
 	return ret;
 }
 
 /* Split a 64-bit hash into two 32-bit parts, and use them to
- * generate Bloom filter entries.
- *
- * Done with atomic operations, so this can be run in parallel.
- *
- * Returns number of overflows, if any.
+ * find the k counters for an item. Returns k.
  */
-int
-AddBloomHash64(Hash64 hash, BloomFilter *filter)
+static inline int
+BloomSpots(Hash64 hash, BloomFilter *filter, size_t *where)
 {
 	u_int32_t h, g;
 	size_t spot;
 	u_int32_t i;
-	u_int32_t newval;
-	int ret=0;
-	int distinct = 0;
 
 	h = hash.h.a;
 	g = hash.h.b;
@@ -363,31 +390,55 @@ AddBloomHash64(Hash64 hash, BloomFilter *filter)
 		/* equal to spot = (h + i*k)%filter->m */
 		if (spot > filter->m)
 			spot -= filter->m;
+		where[i] = spot;
+		spot += g;
+	}
+	return filter->k;
+}
+
+/* Bump the counters found above.
+ *
+ * Done with atomic operations, so this can be run in parallel.
+ *
+ * Returns number of overflows, if any.
+ */
+static inline int
+BloomCount(size_t *where, BloomFilter *filter)
+{
+	u_int32_t i;
+	u_int32_t newval;
+	int ret=0;
+	CounterSpill *spill = BloomSpill(filter);
+
+	for (i=0; i < filter->k; ++i) {
 #ifdef NGRAM_PARALLEL
-		newval = __atomic_add_fetch(filter->counter+spot, (u_int32_t)1,
-				__ATOMIC_RELAXED);
+		newval = __atomic_add_fetch(filter->counter+where[i],
+				(u_int32_t)1, __ATOMIC_RELAXED);
 #else
-		newval = ++filter->counter[spot];
+		newval = CounterBump(filter->counter, filter->bits, spill,
+				where[i]);
 #endif
 		if (newval >= COUNTER_MAX) {
-			/* fprintf(stderr, "Item overflow in %d\n", spot); */
+			/* fprintf(stderr, "Item overflow in %ld\n",
+				where[i]); */
 #ifdef NGRAM_PARALLEL
 			(void) __atomic_add_fetch(&filter->overflows,
 				(size_t)1, __ATOMIC_RELAXED);
-			__atomic_store_n (filter->counter+spot,
+			__atomic_store_n (filter->counter+where[i],
 				(u_int32_t)COUNTER_MAX, __ATOMIC_RELAXED);
 #else
 			++filter->overflows;
-			filter->counter[spot] = COUNTER_MAX;
 #endif
 			++ret;
 		} else if (newval == 1) {
-			/* We can't always tell if an item is new, but
-			 * if this spot was empty, then it has to be.
-			 */
-				distinct = 1;
+			/* One less empty counter, for the distinct count */
+#ifdef NGRAM_PARALLEL
+			(void) __atomic_sub_fetch(&filter->zeros, (size_t)1,
+				__ATOMIC_RELAXED);
+#else
+			--filter->zeros;
+#endif
 		}
-		spot += g;
 	}
 	/* total number of items */
 #ifdef NGRAM_PARALLEL
@@ -396,27 +447,98 @@ AddBloomHash64(Hash64 hash, BloomFilter *filter)
 #else
 		++filter->n;
 #endif
-	/* number of distinct items */
-	if (distinct) {
-#ifdef NGRAM_PARALLEL
-		(void) __atomic_add_fetch(&filter->d, (size_t)distinct,
-			__ATOMIC_RELAXED);
-#else
-		++filter->d;
-#endif
-	}
 	return ret;
 }
 
-/* Add a range of items to a Bloom filter set.
+/* The two together - add a hashed item to the filter.
+ *
+ * Returns number of overflows, if any.
  */
 int
-AddBloomFilterRange(void *item, int length, Range range, NgramFilterSet *filter)
+AddBloomHash64(Hash64 hash, BloomFilter *filter)
+{
+	size_t where[BLOOM_MAXK];
+
+	(void) BloomSpots(hash, filter, where);
+	return BloomCount(where, filter);
+}
+
+/* Batched insertion. AddBloomHash64 touches k counters scattered all over
+ * a table far bigger than the cache, so adding ngrams one at a time means
+ * a long string of misses, with only as many overlapping as the processor
+ * happens to find on its own. Instead, we hash all the ngrams of an item
+ * (or several) and work out their counters into an index buffer first,
+ * then go through the buffer, prefetching a fixed distance ahead of the
+ * counter we're incrementing, which keeps a steady number of misses in
+ * flight.
+ *
+ * The entries are applied in exactly the order the unbatched code would
+ * have added them, with the same arithmetic, so the counters (and the
+ * overflow and distinct counts) come out the same.
+ */
+#define BLOOM_BATCH	128	/* items buffered before applying */
+#define BLOOM_AHEAD	16	/* counters prefetched ahead */
+
+typedef struct _bloomBatch {
+	int count;		/* items */
+	int spots;		/* counters */
+	BloomFilter *filter[BLOOM_BATCH];
+	size_t where[BLOOM_BATCH*BLOOM_MAXK];
+} BloomBatch;
+
+static int
+FlushBloomBatch(BloomBatch *batch)
+{
+	int i, j, k;
+	int spot=0;
+	int ret=0;
+	BloomFilter *f;
+
+	if (!batch->count)
+		return 0;
+	/* The buffer holds counter numbers rather than addresses (they
+	 * may be packed - see counter.h), so to prefetch one we need its
+	 * filter. All our filters have the same k, so that's easy.
+	 */
+	k = batch->filter[0]->k;
+	for (j=0; j < BLOOM_AHEAD && j < batch->spots; ++j) {
+		f = batch->filter[j/k];
+		__builtin_prefetch(CounterAddr(f->counter, f->bits,
+			batch->where[j]), 1);
+	}
+	for (i=0; i < batch->count; ++i) {
+		for (j=spot+BLOOM_AHEAD; j < spot+k+BLOOM_AHEAD &&
+				j < batch->spots; ++j) {
+			f = batch->filter[j/k];
+			__builtin_prefetch(CounterAddr(f->counter, f->bits,
+				batch->where[j]), 1);
+		}
+		ret += BloomCount(batch->where+spot, batch->filter[i]);
+		spot += k;
+	}
+	batch->count = 0;
+	batch->spots = 0;
+	return ret;
+}
+
+static inline int
+BatchBloomHash64(Hash64 hash, BloomFilter *filter, BloomBatch *batch)
+{
+	batch->filter[batch->count] = filter;
+	batch->spots += BloomSpots(hash, filter, batch->where+batch->spots);
+	if (++batch->count < BLOOM_BATCH)
+		return 0;
+	return FlushBloomBatch(batch);
+}
+
+/* Hash a range of ngram sizes at one spot into the batch.
+ */
+static int
+BatchBloomFilterRange(void *item, int length, Range range, NgramFilterSet *filter, BloomBatch *batch)
 {
 	u_int32_t i;
 	int ret=0;
-	Hash64 hvals[RANGEMAX];
-	
+	Hash64 hvals[NGRAM_RANGEMAX+1];
 
 	/* We limit the range to the length of the item. */
 	if (range.min > length) return 0;
@@ -425,9 +547,31 @@ AddBloomFilterRange(void *item, int length, Range range, NgramFilterSet *filter)
 	/* Hash over the range */
 	fnv_64_buf_range(item, length, FNV1_64_INIT,
 		range.min, range.max, (Fnv64_t *)hvals);
-	/* Now use each 64-bit hash to generate k spots in the bloom filter */
+	/* Each 64-bit hash will generate k spots in the bloom filter */
 	for (i=range.min; i <= range.max; ++i) {
-		ret += AddBloomHash64(hvals[i-range.min], filter->filter[i]);
+		ret += BatchBloomHash64(hvals[i-range.min], filter->filter[i],
+			batch);
+	}
+	return ret;
+}
+
+/* The rolling version of the above - roll along the whole item, getting
+ * the full range of sizes at each offset (fewer at the end), so the
+ * ngrams go in in the same order as with FNV.
+ */
+static int
+BatchBloomRollingSet(void *item, size_t length, Range range, NgramFilterSet *filter, BloomBatch *batch)
+{
+	int i, count;
+	int ret=0;
+	Roll64 roll;
+	Hash64 hvals[ROLL_MAXN+1];
+
+	roll_64_init(&roll, item, length, range.min, range.max);
+	while ((count = roll_64_next(&roll, (u_int64_t *)hvals)) > 0) {
+		for (i=0; i < count; ++i)
+			ret += BatchBloomHash64(hvals[i],
+				filter->filter[range.min+i], batch);
 	}
 	return ret;
 }
@@ -445,37 +589,65 @@ AddBloomNgramFilter(void *item, size_t length, int ngram, BloomFilter *filter)
 		ret += AddBloomFilter((u_int8_t *)item + i, ngram, filter);
 	}
 	/* Record stats */
-	setngramlabel(NGRAM_BLOOM, NULL, ngram, 0, filter->n, filter->d);
+	setngramlabel(NGRAM_BLOOM, NULL, ngram, 0, filter->n,
+		BloomDistinct(filter));
 	return ret;
 }
 
 /* Here, we add the pieces to a set of filters in parallel. Well,
- * parallel-ish, at any rate.
+ * parallel-ish, at any rate - see the batching above.
  */
 int
 AddBloomNgramFilterSet(void *item, size_t length, NgramFilterSet *vfilter)
+{
+	return AddBloomNgramFilterSetBatch(&item, &length, 1, vfilter);
+}
+
+/* The same for several items at once, e.g. a batch of packets. The
+ * ngrams of all of them share the batch, which helps with short ones.
+ */
+int
+AddBloomNgramFilterSetBatch(void **items, size_t *lengths, int nitems, NgramFilterSet *vfilter)
 {
 	int i, j;
 	int ret=0;
-	Range r = vfilter->ngramsize;
-	
-	/* We do the whole range each time until we butt up against
-	 * the end, where we have to ramp down and only do the amount
-	 * that fits.
-	 */
-	for (i=0; i+r.max <= length; ++i) {
-		ret += AddBloomFilterRange(item+i, length, r, vfilter);
-	}
-	/* Ramp down to get the rest of the hashes */
-	for (--r.max; r.max >= r.min && i+r.max <= length;
-			++i, --r.max) {
-		ret += AddBloomFilterRange(item+i, length, r, vfilter);
+	Range r;
+	u_int8_t *item;
+	size_t length;
+	BloomBatch batch;
+
+	batch.count = 0;
+	batch.spots = 0;
+	for (j=0; j < nitems; ++j) {
+		item = (u_int8_t *)items[j];
+		length = lengths[j];
+		r = vfilter->ngramsize;
+		if (ngramlabel.hashfamily == HASH_ROLLING) {
+			ret += BatchBloomRollingSet(item, length, r, vfilter,
+				&batch);
+			continue;
+		}
+		/* We do the whole range each time until we butt up against
+		 * the end, where we have to ramp down and only do the amount
+		 * that fits.
+		 */
+		for (i=0; i+r.max <= length; ++i) {
+			ret += BatchBloomFilterRange(item+i, length, r, vfilter,
+				&batch);
+		}
+		/* Ramp down to get the rest of the hashes */
+		for (--r.max; r.max >= r.min && i+r.max <= length;
+				++i, --r.max) {
+			ret += BatchBloomFilterRange(item+i, length, r, vfilter,
+				&batch);
+		}
 	}
+	ret += FlushBloomBatch(&batch);
 	/* Now record the stats */
 	for (i=bloomset.ngramsize.min; i <= bloomset.ngramsize.max; ++i) {
 		setngramlabel(NGRAM_BLOOM, NULL, i, 0,
 			((BloomFilter *)vfilter->filter[i])->n,
-			((BloomFilter *)vfilter->filter[i])->d);
+			BloomDistinct((BloomFilter *)vfilter->filter[i]));
 	}
 	return ret;
 }
@@ -488,37 +660,38 @@ DeleteBloomFilter(void *item, size_t length, BloomFilter *filter)
 	u_int32_t i;
 	u_int32_t h, g;
 	size_t spot;
-	int indistinct=0;
 	int ret=0;
+	u_int32_t value;
 	Hash64 hval;
+	CounterSpill *spill = BloomSpill(filter);
 
-	hval.ab = (u_int64_t)fnv_64_buf(item, length, FNV1_64_INIT);
+	hval.ab = BloomHashItem(item, length);
 	h = hval.h.a;
 	g = hval.h.b;
 	/* First, check if it's there ... */
 	for (i=0; i < filter->k; ++i) {
 		spot = ((size_t)h+(size_t)i*g)%filter->m;
-		if (!filter->counter[spot]) {
+		if (!CounterGet(filter->counter, filter->bits, spill, spot)) {
 			/* fprintf(stderr, "Item not found\n"); */
 			return -1;
 		}
 	}
 	for (i=0; i < filter->k; ++i) {
 		spot = ((size_t)h+(size_t)i*g)%filter->m;
+		value = CounterGet(filter->counter, filter->bits, spill, spot);
 		/*@@ check if we're at max */
-		if (filter->counter[spot] == COUNTER_MAX) {
+		if (value == COUNTER_MAX) {
 			/* fprintf(stderr, "Item underflow in %d\n", spot); */
 			++filter->underflows;
 			++ret;
 		} else {
-			--filter->counter[spot];
-			if (!filter->counter[spot])
-				++indistinct;
+			(void) CounterPut(filter->counter, filter->bits, spill,
+				spot, --value);
+			if (!value)
+				++filter->zeros;
 		}
 	}
 	--filter->n;	/* total number of items */
-	if (indistinct)	/* because of clashes, can't get a exact count, but..*/
-		--filter->d;
 	return ret;
 }
 
@@ -537,7 +710,8 @@ DeleteBloomNgramFilter(void *item, size_t length, int ngram,
 		ret += DeleteBloomFilter((u_int8_t *)item + i, ngram, filter);
 	}
 	/* Record stats */
-	setngramlabel(NGRAM_BLOOM, NULL, ngram, 0, filter->n, filter->d);
+	setngramlabel(NGRAM_BLOOM, NULL, ngram, 0, filter->n,
+		BloomDistinct(filter));
 	return ret;
 }
 
@@ -562,18 +736,21 @@ FindBloomFilter(void *item, int ngram, void *vfilter)
 	u_int32_t h, g;
 	size_t spot;
 	int frequency=0;
+	int value;
 	BloomFilter *filter = (BloomFilter *)vfilter;
+	CounterSpill *spill = BloomSpill(filter);
 	Hash64 hval;
 
-	hval.ab = (u_int64_t)fnv_64_buf(item, (size_t)ngram, FNV1_64_INIT);
+	hval.ab = BloomHashItem(item, (size_t)ngram);
 	h = hval.h.a;
 	g = hval.h.b;
 	for (i=0; i < filter->k; ++i) {
 		spot = ((size_t)h+(size_t)i*g)%filter->m;
+		value = CounterGet(filter->counter, filter->bits, spill, spot);
 		if (!frequency)
-			frequency = filter->counter[spot];
-		else if (frequency > filter->counter[spot])
-			frequency = filter->counter[spot];
+			frequency = value;
+		else if (frequency > value)
+			frequency = value;
 		if (!frequency) {
 			/* fprintf(stderr, "Item not found\n"); */
 			return 0;
@@ -645,10 +822,20 @@ DistBloomNgramFilter(int ngram, double *mu, double *sigma,
 	size_t nonzero;
 	BloomFilter *filter = (BloomFilter *)vfilter->filter[ngram];
 
+	CounterSpill *spill = BloomSpill(filter);
+
 	/*printf("Bloom filter k %d m %ld n %ld d %ld\n",
 		filter->k, filter->m, filter->n, filter->d);*/
-	bloomarraystats(filter->counter, sizeof(NgramCounter),
-		filter->m, mu, sigma, max, min, &chisquare);
+	if (filter->bits == 16)
+		bloomarraystats(filter->counter, sizeof(NgramCounter),
+			filter->m, mu, sigma, max, min, &chisquare);
+	else
+		CounterStats(filter->counter, filter->bits, spill,
+			filter->m, mu, sigma, max, min);
+	if (spill && dumplevel > 0)
+		fprintf(stderr, "ngram %d: %d-bit counters, %ld of %ld overflow slots used, %ld increments lost\n",
+			ngram, filter->bits, spill->used, spill->size,
+			spill->lost);
 	/*printf("mu %9.6lf sigma %9.6lf sigma2/mu %9.6lf chisquare %9.6lf\n",
 		mu, sigma, sigma*sigma/mu, chisquare);*/
 	/* Do some histogram stuff here ... */
@@ -658,11 +845,13 @@ void
 DumpBloomNgramFilter(FILE *dumpfile, BloomFilter *filter)
 {
 	size_t i;
+	u_int32_t value;
+	CounterSpill *spill = BloomSpill(filter);
 
 	if (!dumpfile) return;
 	for (i=0; i < filter->m; ++i)
-		if (filter->counter[i]) 
-			fprintf(dumpfile, "%ld %d\n", i, filter->counter[i]);
+		if ((value = CounterGet(filter->counter, filter->bits, spill, i)))
+			fprintf(dumpfile, "%ld %d\n", i, value);
 	fclose(dumpfile);
 	dumpfile = NULL;
 }
@@ -673,6 +862,132 @@ DumpBloomNgramFilterSet(FILE *dumpfile, NgramFilterSet *vfilter)
 	return;
 }
 
+/* Merging filters (e.g. the private ones of several threads). Counters
+ * saturate, so the merged counter is min(a+b, COUNTER_MAX). Overflows need
+ * a little care: a counter that has had t increments added to it has
+ * counted max(0, t-COUNTER_MAX+1) overflows along the way, and a
+ * saturated counter has lost track of t. Working through the cases, the
+ * overflows we're owed in the merge come to
+ *	max(0, a+b-COUNTER_MAX+1) - (a == COUNTER_MAX) - (b == COUNTER_MAX)
+ * which makes the merged totals exactly what one filter would have had.
+ *
+ * The loop is kept simple enough for the compiler to vectorize, with
+ * 32-bit sums over chunks small enough that they can't overflow.
+ * Returns the overflows, and the number of zero counters in zeros.
+ */
+#define MERGE_CHUNK	4096
+
+size_t
+MergeBloomCounters(NgramCounter *into, NgramCounter *from, size_t m, size_t *zeros)
+{
+	size_t i, j, end;
+	size_t extra=0, zero=0;
+
+	for (i=0; i < m; i = end) {
+		u_int32_t chunkextra=0, chunkzero=0;
+
+		end = min(i+MERGE_CHUNK, m);
+		for (j=i; j < end; ++j) {
+			u_int32_t a = into[j], b = from[j];
+			u_int32_t sum = a + b;
+			u_int32_t over;
+
+			over = sum > COUNTER_MAX-1 ? sum-(COUNTER_MAX-1) : 0;
+			over -= (a == COUNTER_MAX) + (b == COUNTER_MAX);
+			sum = sum > COUNTER_MAX ? COUNTER_MAX : sum;
+			into[j] = sum;
+			chunkextra += over;
+			chunkzero += (sum == 0);
+		}
+		extra += chunkextra;
+		zero += chunkzero;
+	}
+	if (zeros)
+		*zeros = zero;
+	return extra;
+}
+
+/* Counting items that find an empty counter depends on the order they
+ * arrive in, so it would come out differently when threads' filters are
+ * merged. Instead, estimate the distinct count from the fraction of
+ * counters still zero - with d distinct items, each counter has been
+ * missed with probability (1-1/m)^(kd), so d ~ -(m/k) ln(zeros/m).
+ */
+size_t
+BloomDistinctEstimate(size_t m, int k, size_t n, size_t zeros)
+{
+	double d;
+
+	if (!zeros || !k)
+		return n;
+	d = -((double)m/(double)k)*log((double)zeros/(double)m);
+	if (d > (double)n)
+		return n;
+	return (size_t)(d+0.5);
+}
+
+/* The same for packed counters, one at a time. Anything the spill has no
+ * room for is lost, as when adding.
+ */
+static size_t
+MergePackedBloomCounters(BloomFilter *to, BloomFilter *fr, size_t *zeros)
+{
+	size_t j;
+	size_t extra=0, zero=0;
+	u_int32_t a, b, sum, top = (1<<to->bits)-1;
+	CounterSpill *tospill = BloomSpill(to), *frspill = BloomSpill(fr);
+
+	for (j=0; j <= to->m; ++j) {
+		a = CounterGet(to->counter, to->bits, tospill, j);
+		b = CounterGet(fr->counter, fr->bits, frspill, j);
+		if (!b) {
+			zero += (a == 0);
+			continue;
+		}
+		sum = a + b;
+		if (sum > COUNTER_MAX-1)
+			extra += sum-(COUNTER_MAX-1);
+		extra -= (a == COUNTER_MAX) + (b == COUNTER_MAX);
+		if (sum > COUNTER_MAX)
+			sum = COUNTER_MAX;
+		if (CounterPut(to->counter, to->bits, tospill, j, sum) < 0)
+			tospill->lost += sum-top;
+	}
+	tospill->lost += frspill->lost;
+	*zeros = zero;
+	return extra;
+}
+
+void
+MergeBloomNgramFilterSet(NgramFilterSet *into, NgramFilterSet *from)
+{
+	int ng;
+	size_t zeros;
+	BloomFilter *to, *fr;
+
+	for (ng=into->ngramsize.min; ng <= into->ngramsize.max; ++ng) {
+		to = (BloomFilter *)into->filter[ng];
+		fr = (BloomFilter *)from->filter[ng];
+		if (!to || !fr || to->m != fr->m || to->bits != fr->bits)
+			continue;
+		/* Including the spare counter at m */
+		if (to->bits == 16)
+			to->overflows += MergeBloomCounters(to->counter,
+				fr->counter, to->m+1, &zeros);
+		else
+			to->overflows += MergePackedBloomCounters(to, fr,
+				&zeros);
+		to->overflows += fr->overflows;
+		to->underflows += fr->underflows;
+		to->n += fr->n;
+		to->zeros = zeros;
+		(void) BloomDistinct(to);
+		/* Shards are merged in parallel; only the real ones get labeled */
+		if (into == ngram->f)
+			setngramlabel(NGRAM_BLOOM, NULL, ng, 0, to->n, to->d);
+	}
+}
+
 #ifdef TEST
 void
 getngrams(FILE *fp, int ngram, BloomFilter *filter)
@@ -686,6 +1001,7 @@ getngrams(FILE *fp, int ngram, BloomFilter *filter)
 }
 
 FILE *dumpfile=NULL;
+int dumplevel;
 
 main(int argc, char **argv)
 {
@@ -42,6 +42,14 @@ int AddBloomHash64(Hash64 hash, BloomFilter *filter);
  */
 u_int32_t BloomHash(int i, void *item, size_t length);
 
+/* The 64-bit hash of a whole item, in whichever family (FNV or rolling)
+ * the filters were built with - see ngramlabel.hashfamily.
+ */
+u_int64_t BloomHashItem(void *item, size_t length);
+
+/* Number of counters used for a given ngram size */
+size_t BloomSize(int ngram);
+
 /* The ideal size of a Bloom filter and the number of hash functions
  * to be used depend on the number of items to be inserted and the
  * acceptable false positive rate. The size of the counter should also
@@ -84,6 +92,9 @@ int
 AddBloomNgramFilter(void *item, size_t length, int ngram, BloomFilter *vfilter);
 int
 AddBloomNgramFilterSet(void *item, size_t length, NgramFilterSet *vfilter);
+/* The same for a batch of items (e.g. packets), prefetching as it goes */
+int
+AddBloomNgramFilterSetBatch(void **items, size_t *lengths, int nitems, NgramFilterSet *vfilter);
 /* Delete is sort of approximate - in the unlikely event all of the
  * counters are maxxed out, it won't work.
  */
@@ -107,24 +118,36 @@ void DumpBloomNgramFilter(FILE *file, BloomFilter *vfilter);
 void DumpBloomNgramFilterSet(FILE *file, NgramFilterSet *vfilter);
 void CloseBloomNgramFilter(BloomFilter *vfilter);
 void CloseBloomNgramFilterSet(NgramFilterSet *vfilter);
+/* Merging - see ngram.h */
+void MergeBloomNgramFilterSet(NgramFilterSet *into, NgramFilterSet *from);
+size_t MergeBloomCounters(NgramCounter *into, NgramCounter *from, size_t m, size_t *zeros);
+size_t BloomDistinctEstimate(size_t m, int k, size_t n, size_t zeros);
 
 
 /* "Private" */
 
 typedef struct _BloomFilter {
 	/* k - number of hash functions
-	 * m - size of hash table (i.e., number of 16 or 32 bit counters)
+	 * bits - counter width, 16, 8 or 4 (see counter.h)
+	 * m - size of hash table (i.e., number of counters)
 	 * n - total number of items inserted into filter
-	 * d - number of distinct items inserted into filter (approximate)
+	 * d - number of distinct items inserted into filter (estimated
+	 *	from zeros, see BloomDistinct)
+	 * zeros - counters still zero, the spare at m included
 	 */
 	int k;
+	int bits;
 	/* For checking adequacy of counter size */
 	size_t overflows;
 	size_t underflows;
 	size_t m, n, d;
+	size_t zeros;
 	NgramCounter counter[0];
 } BloomFilter;
 
+/* Upper limit on k, for sizing buffers */
+#define BLOOM_MAXK	32
+
 
 
 
@@ -0,0 +1,242 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <sys/types.h>
+#include "ngram.h"
+#include "counter.h"
+
+/* Packed counters and their spill - see counter.h */
+
+int
+CounterBits(size_t m)
+{
+	int bits = ngramlabel.counterbits;
+
+#ifdef NGRAM_PARALLEL
+	/* The atomic update paths only know about 16 bits */
+	bits = 16;
+#endif
+	if (bits != 4 && bits != 8)
+		return 16;
+	if (m < COUNTER_PACKMIN)
+		return 16;
+	return bits;
+}
+
+/* Bytes in the counters proper, rounded up to keep the spill aligned */
+static size_t
+CounterPackedBytes(int bits, size_t m)
+{
+	return ((m*bits+7)/8 + 7) & ~(size_t)7;
+}
+
+static size_t
+CounterSpillSlots(int bits, size_t m)
+{
+	size_t want, size;
+
+	want = m/(bits == 4 ? COUNTER_SPILL4 : COUNTER_SPILL8);
+	for (size=64; size < want; size <<= 1)
+		;
+	return size;
+}
+
+size_t
+CounterBytes(int bits, size_t m)
+{
+	if (bits == 16)
+		return m*sizeof(NgramCounter);
+	return CounterPackedBytes(bits, m) + sizeof(CounterSpill) +
+		CounterSpillSlots(bits, m)*sizeof(u_int64_t);
+}
+
+CounterSpill *
+CounterSpillTable(void *counters, int bits, size_t m)
+{
+	if (bits == 16)
+		return NULL;
+	return (CounterSpill *)((u_int8_t *)counters +
+		CounterPackedBytes(bits, m));
+}
+
+void
+CounterInit(void *counters, int bits, size_t m)
+{
+	CounterSpill *spill = CounterSpillTable(counters, bits, m);
+	size_t size;
+
+	if (!spill)
+		return;
+	/* A shared memory file may already have one */
+	if (spill->size)
+		return;
+	spill->size = CounterSpillSlots(bits, m);
+	for (size=spill->size, spill->shift=64; size > 1; size >>= 1)
+		--spill->shift;
+}
+
+/* Linear probing on a multiplicative hash of the spot. Nothing is ever
+ * removed - a counter that drops back below the top just has its extra
+ * count zeroed - so there's no need for tombstones. We stop adding at
+ * 7/8 full, to keep the probes short.
+ */
+static u_int64_t *
+CounterSpillSlot(CounterSpill *spill, size_t spot, int add)
+{
+	u_int64_t key = (u_int64_t)spot+1;
+	size_t i, mask = spill->size-1;
+
+	i = (key*0x9e3779b97f4a7c15ULL) >> spill->shift;
+	while (spill->slot[i]) {
+		if ((spill->slot[i] & SPILL_KEYMASK) == key)
+			return spill->slot+i;
+		i = (i+1) & mask;
+	}
+	if (!add || spill->used >= spill->size - spill->size/8)
+		return NULL;
+	++spill->used;
+	spill->slot[i] = key;
+	return spill->slot+i;
+}
+
+u_int32_t
+CounterSpillGet(CounterSpill *spill, size_t spot)
+{
+	u_int64_t *slot = CounterSpillSlot(spill, spot, 0);
+
+	return slot ? (u_int32_t)(*slot >> SPILL_KEYBITS) : 0;
+}
+
+int
+CounterSpillPut(CounterSpill *spill, size_t spot, u_int32_t extra)
+{
+	u_int64_t *slot = CounterSpillSlot(spill, spot, extra != 0);
+
+	if (!slot)
+		return extra ? -1 : 0;
+	*slot = (*slot & SPILL_KEYMASK) | ((u_int64_t)extra << SPILL_KEYBITS);
+	return 0;
+}
+
+/* The top end of CounterBump */
+u_int32_t
+CounterSpillBump(CounterSpill *spill, u_int32_t top, size_t spot)
+{
+	u_int64_t *slot = CounterSpillSlot(spill, spot, 1);
+	u_int32_t v;
+
+	if (!slot) {
+		++spill->lost;
+		return top+1;
+	}
+	v = top + (u_int32_t)(*slot >> SPILL_KEYBITS) + 1;
+	if (v <= COUNTER_MAX)
+		*slot += 1ULL << SPILL_KEYBITS;
+	return v;
+}
+
+/* The same as bloomarraystats (less the chisquare, which nobody uses),
+ * for any width.
+ */
+void
+CounterStats(void *counters, int bits, CounterSpill *spill, size_t m,
+	double *mu, double *sigma, u_int64_t *max, u_int64_t *min)
+{
+	size_t i;
+	u_int64_t value;
+	double sumsquare=0.0, sum=0.0;
+
+	*max = 0;
+	*min = 0xffffffff;
+	for (i=0; i < m; ++i) {
+		value = CounterGet(counters, bits, spill, i);
+		sumsquare += (double)value*value;
+		sum += (double)value;
+		if (value > *max) *max = value;
+		if (value < *min) *min = value;
+	}
+	*mu = sum/(double)m;
+	*sigma = sqrt((sumsquare - (double)m*(*mu)*(*mu))/(double)(m-1));
+}
+
+#ifdef TEST
+/* Check packed counters against plain ones. Most spots get a count or
+ * two, some a few hundred (into the spill), and a few hot ones get pushed
+ * up to COUNTER_MAX.
+ */
+NgramLabel ngramlabel;
+
+int
+main(int argc, char **argv)
+{
+	size_t m = 1<<20;
+	int widths[] = {4, 8, 16};
+	int w, bits, errors=0;
+	size_t i, spot, bytes;
+	u_int32_t v, want, *ref;
+	void *counters;
+	CounterSpill *spill;
+
+	ref = (u_int32_t *)malloc(m*sizeof(u_int32_t));
+	for (w=0; w < 3; ++w) {
+		bits = widths[w];
+		bytes = CounterBytes(bits, m);
+		counters = calloc(1, bytes);
+		if (!ref || !counters) {
+			perror("malloc");
+			exit(1);
+		}
+		memset(ref, 0, m*sizeof(u_int32_t));
+		CounterInit(counters, bits, m);
+		spill = CounterSpillTable(counters, bits, m);
+		srandom(1);
+		for (i=0; i < 2000000; ++i) {
+			spot = random();
+			switch (spot & 7) {
+			case 0: case 1:		/* hot */
+				spot = ((spot>>3) % 4) * 4099;
+				break;
+			case 2:			/* warm */
+				spot = ((spot>>3) % 1024) * 1021;
+				break;
+			default:
+				spot = (spot>>3) % m;
+				break;
+			}
+			if (i % 7 == 0 && ref[spot]) {
+				/* take one off now and then */
+				v = CounterGet(counters, bits, spill, spot);
+				if (v < COUNTER_MAX)
+					(void) CounterPut(counters, bits, spill,
+						spot, v-1);
+				if (ref[spot] < COUNTER_MAX)
+					--ref[spot];
+				continue;
+			}
+			v = CounterBump(counters, bits, spill, spot);
+			want = ref[spot]+1;
+			if (ref[spot] < COUNTER_MAX)
+				++ref[spot];
+			if (v != want && errors++ < 10)
+				fprintf(stderr, "%d bits: bump %ld gave %d, not %d\n",
+					bits, spot, v, want);
+		}
+		for (i=0; i < m; ++i) {
+			v = CounterGet(counters, bits, spill, i);
+			if (v != ref[i] && errors++ < 10)
+				fprintf(stderr, "%d bits: counter %ld is %d, not %d\n",
+					bits, i, v, ref[i]);
+		}
+		printf("%2d bits: %ld bytes", bits, bytes);
+		if (spill)
+			printf(", spill %ld of %ld slots, %ld lost",
+				spill->used, spill->size, spill->lost);
+		printf("\n");
+		free(counters);
+	}
+	free(ref);
+	printf("%s\n", errors ? "FAILED" : "ok");
+	return errors != 0;
+}
+#endif
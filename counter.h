@@ -0,0 +1,160 @@
+/* Counter arrays for the array and Bloom filter backends.
+ *
+ * Counters are normally NgramCounters (16 bits). Most of them, though,
+ * never get past a handful, so they can be packed into 8 or 4 bits
+ * instead (-C), which cuts the memory, and the memory traffic per update,
+ * by 2 to 4 times. A packed counter that reaches its top value (255 or
+ * 15) keeps the rest of its count in a small hash table (the "spill")
+ * right after the counters, so heavy counters still count properly, up
+ * to COUNTER_MAX just like the 16-bit ones. If the spill fills up, the
+ * counter stays at its top value and the increments are counted as lost.
+ *
+ * The spill has to live in the same block of memory as the counters (it
+ * may be in a shared memory file), so everything here goes by the
+ * address of the counters, the width, and the number of counters.
+ */
+
+#ifndef _COUNTER_H
+#define _COUNTER_H
+
+/* Arrays smaller than this (in counters) always get 16 bits - the small
+ * ngram sizes have few, mostly heavy counters, which would all spill,
+ * and the savings wouldn't be worth anything anyway.
+ */
+#define COUNTER_PACKMIN	(1L<<22)
+
+/* Spill slots per counter - 1 in 64 for 4 bits, 1 in 256 for 8 bits */
+#define COUNTER_SPILL4	64
+#define COUNTER_SPILL8	256
+
+/* A slot holds spot+1 in the low 48 bits (0 for empty), and the count
+ * above the top value in the high 16 (COUNTER_MAX fits).
+ */
+#define SPILL_KEYBITS	48
+#define SPILL_KEYMASK	((1ULL<<SPILL_KEYBITS)-1)
+
+typedef struct _counterSpill {
+	size_t size;		/* slots, a power of 2 */
+	size_t used;		/* slots filled */
+	size_t lost;		/* increments we had no room for */
+	int shift;		/* 64 - log2(size), for the hash */
+	int pad;
+	u_int64_t slot[0];
+} CounterSpill;
+
+/* Width to use for an array of m counters, from ngramlabel.counterbits */
+int CounterBits(size_t m);
+/* Bytes needed for m counters of the given width, spill included */
+size_t CounterBytes(int bits, size_t m);
+/* Set up the spill on (zeroed) memory */
+void CounterInit(void *counters, int bits, size_t m);
+/* Where the spill is - NULL for 16 bits */
+CounterSpill *CounterSpillTable(void *counters, int bits, size_t m);
+
+u_int32_t CounterSpillGet(CounterSpill *spill, size_t spot);
+int CounterSpillPut(CounterSpill *spill, size_t spot, u_int32_t extra);
+u_int32_t CounterSpillBump(CounterSpill *spill, u_int32_t top, size_t spot);
+void CounterStats(void *counters, int bits, CounterSpill *spill, size_t m,
+	double *mu, double *sigma, u_int64_t *max, u_int64_t *min);
+
+/* The accessors proper. These are on every ngram, so they're inline, and
+ * only go out of line for the spill.
+ */
+
+/* Address of the byte(s) holding a counter, e.g. for prefetching */
+static inline void *
+CounterAddr(void *counters, int bits, size_t spot)
+{
+	if (bits == 16)
+		return (NgramCounter *)counters + spot;
+	if (bits == 8)
+		return (u_int8_t *)counters + spot;
+	return (u_int8_t *)counters + (spot>>1);
+}
+
+/* The value of a counter */
+static inline u_int32_t
+CounterGet(void *counters, int bits, CounterSpill *spill, size_t spot)
+{
+	u_int32_t v, top;
+
+	if (bits == 16)
+		return ((NgramCounter *)counters)[spot];
+	top = (1<<bits)-1;
+	if (bits == 8)
+		v = ((u_int8_t *)counters)[spot];
+	else
+		v = (((u_int8_t *)counters)[spot>>1] >> ((spot&1)<<2)) & 0xf;
+	if (v < top)
+		return v;
+	return top + CounterSpillGet(spill, spot);
+}
+
+/* Add one to a counter, stopping at COUNTER_MAX. Returns the value it
+ * would have had (so COUNTER_MAX+1 if it was already there); what the
+ * caller counts as an overflow is up to it.
+ */
+static inline u_int32_t
+CounterBump(void *counters, int bits, CounterSpill *spill, size_t spot)
+{
+	u_int32_t v, top;
+	u_int8_t *p;
+	int shift;
+
+	if (bits == 16) {
+		NgramCounter *c = (NgramCounter *)counters + spot;
+
+		v = *c + 1;
+		*c = v > COUNTER_MAX ? COUNTER_MAX : v;
+		return v;
+	}
+	top = (1<<bits)-1;
+	if (bits == 8) {
+		p = (u_int8_t *)counters + spot;
+		if (*p < top)
+			return ++*p;
+	} else {
+		p = (u_int8_t *)counters + (spot>>1);
+		shift = (spot&1)<<2;
+		v = (*p >> shift) & 0xf;
+		if (v < top) {
+			*p += 1<<shift;
+			return v+1;
+		}
+	}
+	return CounterSpillBump(spill, top, spot);
+}
+
+/* Set a counter outright (v <= COUNTER_MAX). Returns 0, or -1 if there
+ * was no room in the spill.
+ */
+static inline int
+CounterPut(void *counters, int bits, CounterSpill *spill, size_t spot, u_int32_t v)
+{
+	u_int32_t old, top;
+	u_int8_t *p;
+	int shift;
+
+	if (bits == 16) {
+		((NgramCounter *)counters)[spot] = v;
+		return 0;
+	}
+	top = (1<<bits)-1;
+	if (bits == 8) {
+		p = (u_int8_t *)counters + spot;
+		old = *p;
+		*p = v < top ? v : top;
+	} else {
+		p = (u_int8_t *)counters + (spot>>1);
+		shift = (spot&1)<<2;
+		old = (*p >> shift) & 0xf;
+		*p = (*p & ~(0xf<<shift)) | ((v < top ? v : top) << shift);
+	}
+	if (v >= top)
+		return CounterSpillPut(spill, spot, v-top);
+	if (old == top)
+		(void) CounterSpillPut(spill, spot, 0);
+	return 0;
+}
+
+#endif /* _COUNTER_H */
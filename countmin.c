@@ -0,0 +1,557 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <memory.h>
+#include <malloc.h>
+#include <math.h>
+#include "libstats.h"
+/* For the "generic" ngram structure */
+#include "ngram.h"
+#include <stdint.h>
+#include "fnv.h"
+#include "fnvrange.h"
+#include "rolling.h"
+
+#include "bloom.h"
+#include "countmin.h"
+
+NgramFilterSet countminset = {
+	{0,0},
+	NULL
+};
+NgramOps countminops = {
+	NewCountMinNgramFilterSet,
+	AddCountMinNgramFilterSet,
+	DeleteCountMinNgramFilterSet,
+	FindCountMinFilter,
+	FindCountMinNgramFilterSet,
+	FindCountMinNgramDistFilter,
+	DistCountMinNgramFilter,
+	DumpCountMinNgramFilterSet,
+	CloseCountMinNgramFilterSet,
+	MergeCountMinNgramFilterSet
+};
+
+Ngram countmin = {
+	&countminset,
+	&countminops
+};
+
+int countminrows = COUNTMIN_ROWS;
+
+/* Same counter memory as the ordinary Bloom filter for the same ngram
+ * size, split into d rows.
+ */
+CountMinSketch *
+#ifdef SHMALLOC
+NewCountMinNgramFilter(int ngram, char *shmfilename, int mode)
+#else
+NewCountMinNgramFilter(int ngram)
+#endif
+{
+	CountMinSketch *answer;
+	size_t width, bytesize;
+	int rows = countminrows;
+
+	if (rows < 1 || rows > COUNTMIN_MAXROWS)
+		rows = COUNTMIN_ROWS;
+	width = BloomSize(ngram)/rows;
+	bytesize = sizeof(CountMinSketch) + rows*width*sizeof(NgramCounter);
+	setngramlabel(NGRAM_COUNTMIN, NULL, ngram, bytesize, 0, 0);
+#ifdef SHMALLOC
+	answer = (CountMinSketch *)ngram_shmalloc(bytesize,
+		shmfilename, mode);
+#else
+	answer = (CountMinSketch *)malloc(bytesize);
+	if (answer)
+		memset((void *)answer, 0, bytesize);
+#endif
+	if (!answer) {
+		fprintf(stderr, "Couldn't allocate %ld\n", bytesize);
+		perror("malloc");
+		return NULL;
+	}
+	answer->d = rows;
+	answer->w = width;
+	answer->m = rows*width;
+	return answer;
+}
+
+int
+CountMinFilterSetSize(Range ngram)
+{
+	return sizeof(NgramFilterSet) + (ngram.max-ngram.min+1)*sizeof(CountMinSketch *);
+}
+
+NgramFilterSet *
+#ifdef SHMALLOC
+NewCountMinNgramFilterSet(Range ngram, char *shmfilename, int mode)
+#else
+NewCountMinNgramFilterSet(Range ngram)
+#endif
+{
+	NgramFilterSet *answer;
+	int ng;
+	size_t bytesize = CountMinFilterSetSize(ngram);
+
+#ifdef SHMALLOC
+	answer = (NgramFilterSet *)ngram_shmalloc(bytesize,
+		shmfilename, mode);
+#else
+	answer = (NgramFilterSet *)malloc(bytesize);
+	if (answer)
+		memset((void *)answer, 0, bytesize);
+#endif
+	if (!answer) return NULL;
+	answer->ngramsize = ngram;
+	for (ng=ngram.min; ng <= ngram.max; ++ng) {
+		answer->filter[ng] =
+#ifdef SHMALLOC
+			(NgramFilter)NewCountMinNgramFilter(ng, shmfilename, mode);
+#else
+			(NgramFilter)NewCountMinNgramFilter(ng);
+#endif
+	}
+	return answer;
+}
+
+void
+CloseCountMinNgramFilter(CountMinSketch *sketch)
+{
+	if (!sketch) return;
+#ifdef SHMALLOC
+	ngram_shmfree((void *)sketch);
+#else
+	free((void *)sketch);
+#endif
+}
+
+void
+CloseCountMinNgramFilterSet(NgramFilterSet *set)
+{
+	int ng;
+
+	if (!set) return;
+	for (ng=set->ngramsize.min; ng <= set->ngramsize.max; ++ng) {
+		if (set->filter[ng]) {
+			CloseCountMinNgramFilter((CountMinSketch *)set->filter[ng]);
+		}
+	}
+#ifdef SHMALLOC
+	ngram_shmfree(set);
+#else
+	free(set);
+#endif
+}
+
+/* Find an item's counter in each row. As in the Bloom filter, row i uses
+ * the hash h + i*g, but rather than a modulus, we scale it into the row
+ * with a multiply and shift. We fetch all the rows before looking at any
+ * of them, so the misses overlap.
+ */
+static inline void
+CountMinSpots(Hash64 hash, CountMinSketch *sketch, NgramCounter **where)
+{
+	u_int32_t h = hash.h.a, g = hash.h.b;
+	NgramCounter *row = sketch->counter;
+	int i;
+
+	/* There's always at least one row (see NewCountMinNgramFilter), and
+	 * saying so up front lets the compiler see where[0] is set
+	 */
+	where[0] = row + (((u_int64_t)h*sketch->w)>>32);
+	__builtin_prefetch(where[0], 1);
+	for (i=1; i < sketch->d; ++i) {
+		h += g;
+		row += sketch->w;
+		where[i] = row + (((u_int64_t)h*sketch->w)>>32);
+		__builtin_prefetch(where[i], 1);
+	}
+}
+
+/* Add a hashed item, with conservative update: the estimate is the
+ * smallest of the counters, so only those at the smallest need go up.
+ * Returns number of overflows, if any.
+ */
+int
+AddCountMinHash64(Hash64 hash, CountMinSketch *sketch)
+{
+	NgramCounter *where[COUNTMIN_MAXROWS];
+	u_int32_t low, newval;
+	int i;
+	int ret=0;
+
+	CountMinSpots(hash, sketch, where);
+	low = *where[0];
+	for (i=1; i < sketch->d; ++i)
+		if (*where[i] < low)
+			low = *where[i];
+	newval = low + 1;
+	if (newval >= COUNTER_MAX) {
+		++sketch->overflows;
+		newval = COUNTER_MAX;
+		++ret;
+	}
+	for (i=0; i < sketch->d; ++i)
+		if (*where[i] < newval)
+			*where[i] = newval;
+	++sketch->n;
+	/* A zero estimate means it has to be new */
+	if (!low)
+		++sketch->distinct;
+	return ret;
+}
+
+/* Look up a hashed item, returning its (approximate) frequency */
+int
+FindCountMinHash64(Hash64 hash, CountMinSketch *sketch)
+{
+	NgramCounter *where[COUNTMIN_MAXROWS];
+	int frequency;
+	int i;
+
+	CountMinSpots(hash, sketch, where);
+	frequency = *where[0];
+	for (i=1; frequency && i < sketch->d; ++i)
+		if (frequency > *where[i])
+			frequency = *where[i];
+	return frequency;
+}
+
+/* Delete a hashed item. Conservative update doesn't really allow for
+ * this - taking one off every row can leave other items' counts short -
+ * so, as with the Bloom filter, it's approximate.
+ */
+static int
+DeleteCountMinHash64(Hash64 hash, CountMinSketch *sketch)
+{
+	NgramCounter *where[COUNTMIN_MAXROWS];
+	int low;
+	int ret=0;
+	int i;
+
+	if (!(low = FindCountMinHash64(hash, sketch)))
+		return -1;
+	CountMinSpots(hash, sketch, where);
+	for (i=0; i < sketch->d; ++i) {
+		if (*where[i] == COUNTER_MAX) {
+			++sketch->underflows;
+			++ret;
+		} else {
+			--*where[i];
+		}
+	}
+	--sketch->n;
+	if (low == 1)
+		--sketch->distinct;
+	return ret;
+}
+
+/* Hash a range of ngram sizes at one spot, and add them to the set */
+static int
+AddCountMinFilterRange(void *item, int length, Range range, NgramFilterSet *filter)
+{
+	int i;
+	int ret=0;
+	Hash64 hvals[NGRAM_RANGEMAX+1];
+
+	if (range.min > length) return 0;
+	if (range.max > length) range.max = length;
+	fnv_64_buf_range(item, length, FNV1_64_INIT,
+		range.min, range.max, (Fnv64_t *)hvals);
+	for (i=range.min; i <= range.max; ++i) {
+		ret += AddCountMinHash64(hvals[i-range.min],
+			(CountMinSketch *)filter->filter[i]);
+	}
+	return ret;
+}
+
+/* Chop an item into overlapping ngrams, and add them to a single sketch */
+int
+AddCountMinNgramFilter(void *item, size_t length, int ngram, CountMinSketch *sketch)
+{
+	int i;
+	int ret=0;
+	Hash64 hval;
+
+	for (i=0; i+ngram <= length; ++i) {
+		hval.ab = BloomHashItem((u_int8_t *)item + i, ngram);
+		ret += AddCountMinHash64(hval, sketch);
+	}
+	setngramlabel(NGRAM_COUNTMIN, NULL, ngram, 0, sketch->n,
+		sketch->distinct);
+	return ret;
+}
+
+/* Same approach as AddBloomNgramFilterSet - the full range of sizes
+ * at each offset, ramping down at the end, either rolled or rehashed.
+ */
+int
+AddCountMinNgramFilterSet(void *item, size_t length, NgramFilterSet *vfilter)
+{
+	int i, count;
+	int ret=0;
+	Range r = vfilter->ngramsize;
+	Roll64 roll;
+	Hash64 hvals[ROLL_MAXN+1];
+
+	if (ngramlabel.hashfamily == HASH_ROLLING) {
+		roll_64_init(&roll, item, length, r.min, r.max);
+		while ((count = roll_64_next(&roll, (u_int64_t *)hvals)) > 0) {
+			for (i=0; i < count; ++i)
+				ret += AddCountMinHash64(hvals[i],
+					(CountMinSketch *)vfilter->filter[r.min+i]);
+		}
+	} else {
+		for (i=0; i+r.max <= length; ++i) {
+			ret += AddCountMinFilterRange(item+i, length-i, r, vfilter);
+		}
+		for (--r.max; r.max >= r.min && i+r.max <= length;
+				++i, --r.max) {
+			ret += AddCountMinFilterRange(item+i, length-i, r, vfilter);
+		}
+	}
+	for (i=vfilter->ngramsize.min; i <= vfilter->ngramsize.max; ++i) {
+		setngramlabel(NGRAM_COUNTMIN, NULL, i, 0,
+			((CountMinSketch *)vfilter->filter[i])->n,
+			((CountMinSketch *)vfilter->filter[i])->distinct);
+	}
+	return ret;
+}
+
+int
+DeleteCountMinNgramFilterSet(void *item, size_t length, NgramFilterSet *vfilter)
+{
+	int i, ng;
+	int ret=0;
+	Hash64 hval;
+	CountMinSketch *sketch;
+
+	for (ng=vfilter->ngramsize.min; ng <= vfilter->ngramsize.max; ++ng) {
+		sketch = (CountMinSketch *)vfilter->filter[ng];
+		for (i=0; i+ng <= length; ++i) {
+			hval.ab = BloomHashItem((u_int8_t *)item + i, ng);
+			ret += DeleteCountMinHash64(hval, sketch);
+		}
+		setngramlabel(NGRAM_COUNTMIN, NULL, ng, 0,
+			sketch->n, sketch->distinct);
+	}
+	return ret;
+}
+
+/* Find a single ngram */
+int
+FindCountMinFilter(void *item, int ngram, void *vfilter)
+{
+	Hash64 hval;
+
+	hval.ab = BloomHashItem(item, (size_t)ngram);
+	return FindCountMinHash64(hval, (CountMinSketch *)vfilter);
+}
+
+/* Chop an item into ngrams, and total up their (approximate) frequencies */
+int
+FindCountMinNgramFilterSet(void *item, size_t length, NgramFilterSet *vfilter)
+{
+	int i, ng;
+	int ret=0;
+
+	for (ng=vfilter->ngramsize.min; ng <= vfilter->ngramsize.max; ++ng) {
+		for (i=0; i+ng <= length; ++i) {
+			ret += FindCountMinFilter((u_int8_t *)item + i,
+				ng, vfilter->filter[ng]);
+		}
+	}
+	return ret;
+}
+
+int
+FindCountMinNgramDistFilter(void *item, size_t length, int ngram, double *mu, double *sigma, double *rho, NgramFilterSet *vfilter)
+{
+	int i;
+	int total=0;
+	static int frequencies[NGRAM_MAX];
+
+	for (i=0; i+ngram <= length && i < NGRAM_MAX; ++i) {
+		frequencies[i] =
+			FindCountMinFilter((u_int8_t *)item + i, ngram,
+				vfilter->filter[ngram]);
+		total += frequencies[i];
+	}
+	intarraystats(frequencies, i, mu, sigma, rho);
+	return total;
+}
+
+/* Some simple statistics about the whole sketch, plus the error bounds:
+ * an estimate is at most epsilon*N too high, except with probability
+ * delta, where epsilon = e/w and delta = e^-d.
+ */
+void
+DistCountMinNgramFilter(int ngram, double *mu, double *sigma,
+	u_int64_t *max, u_int64_t *min, NgramFilterSet *vfilter)
+{
+	double chisquare;
+	CountMinSketch *sketch = (CountMinSketch *)vfilter->filter[ngram];
+
+	bloomarraystats(sketch->counter, sizeof(NgramCounter),
+		sketch->m, mu, sigma, max, min, &chisquare);
+	if (dumplevel > 0)
+		fprintf(stderr, "ngram %d: count-min %d x %ld, n %ld: estimates at most %.2lf high (epsilon %.3le) with probability %.6lf (delta %.3le)\n",
+			ngram, sketch->d, sketch->w, sketch->n,
+			M_E/(double)sketch->w*(double)sketch->n,
+			M_E/(double)sketch->w,
+			1.0 - exp(-(double)sketch->d), exp(-(double)sketch->d));
+}
+
+void
+DumpCountMinNgramFilter(FILE *dumpfile, int ngram, CountMinSketch *sketch)
+{
+	size_t i;
+
+	if (!dumpfile) return;
+	fprintf(dumpfile, "ngram %d: d %d w %ld n %ld distinct %ld overflows %ld\n",
+		ngram, sketch->d, sketch->w, sketch->n, sketch->distinct,
+		sketch->overflows);
+	for (i=0; i < sketch->m; ++i)
+		if (sketch->counter[i])
+			fprintf(dumpfile, "%ld %d\n", i, sketch->counter[i]);
+}
+
+void
+DumpCountMinNgramFilterSet(FILE *dumpfile, NgramFilterSet *vfilter)
+{
+	int ng;
+
+	if (!dumpfile) return;
+	for (ng=vfilter->ngramsize.min; ng <= vfilter->ngramsize.max; ++ng)
+		DumpCountMinNgramFilter(dumpfile, ng,
+			(CountMinSketch *)vfilter->filter[ng]);
+}
+
+/* Merge one set into another. Sketches add counter by counter, which for
+ * plain count-min gives exactly the sketch of the combined items. Not so
+ * with conservative update: the sum still never underestimates, and the
+ * bounds above still hold, but it comes out higher than if the items had
+ * all gone into one sketch, by an amount that depends on how the items
+ * were split up. So ngram won't run count-min with -j or -J; this is
+ * for putting together sketches built separately, and doesn't claim to
+ * match one built from everything. The distinct count is estimated from
+ * the empty counters, as for the Bloom filter, with one "hash function"
+ * per row.
+ */
+void
+MergeCountMinNgramFilterSet(NgramFilterSet *into, NgramFilterSet *from)
+{
+	int ng;
+	size_t zeros;
+	CountMinSketch *to, *fr;
+
+	for (ng=into->ngramsize.min; ng <= into->ngramsize.max; ++ng) {
+		to = (CountMinSketch *)into->filter[ng];
+		fr = (CountMinSketch *)from->filter[ng];
+		if (!to || !fr || to->d != fr->d || to->w != fr->w) continue;
+		to->overflows += fr->overflows +
+			MergeBloomCounters(to->counter, fr->counter, to->m, &zeros);
+		to->underflows += fr->underflows;
+		to->n += fr->n;
+		to->distinct = BloomDistinctEstimate(to->m, to->d, to->n, zeros);
+		if (into == ngram->f)
+			setngramlabel(NGRAM_COUNTMIN, NULL, ng, 0, to->n,
+				to->distinct);
+	}
+}
+
+#ifdef TEST
+/* Accuracy comparison against the ordinary counting Bloom filter, at the
+ * same counter memory. We feed both a skewed stream of items (a few very
+ * common, most rare, as with ngrams), then check every item's estimate
+ * against its true count.
+ */
+FILE *dumpfile=NULL;
+int dumplevel;
+
+static void
+itemof(u_int8_t *item, long int id)
+{
+	/* 8 bytes regardless of the ngram size, as in blockedbloomtest */
+	memcpy(item, &id, 8);
+}
+
+int
+main(int argc, char **argv)
+{
+	int ngram = 2;
+	long int items = 0, count = 0;
+	long int i, id;
+	int c;
+	double r;
+	u_int8_t item[8];
+	int *truth;
+	long int bloomexact=0, cmexact=0;
+	double bloomerr=0.0, cmerr=0.0;
+	long int bloommax=0, cmmax=0, err;
+	BloomFilter *filter;
+	CountMinSketch *sketch;
+
+	while ((c = getopt(argc, argv, "n:i:c:d:")) >= 0) {
+		switch (c) {
+		case 'n':
+			ngram = atoi(optarg);
+			break;
+		case 'i':
+			items = atol(optarg);
+			break;
+		case 'c':
+			count = atol(optarg);
+			break;
+		case 'd':
+			countminrows = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr,
+				"Usage: countmintest [-n ngram] [-i distinct items] [-c stream length] [-d rows]\n");
+			exit(1);
+		}
+	}
+	/* Default to the load the filters were designed for */
+	if (!items)
+		items = BloomSize(ngram)/32;
+	if (!count)
+		count = 10*items;
+	filter = NewBloomNgramFilter(ngram);
+	sketch = NewCountMinNgramFilter(ngram);
+	truth = (int *)calloc(items, sizeof(int));
+	if (!filter || !sketch || !truth)
+		exit(2);
+
+	srandom(1);
+	for (i=0; i < count; ++i) {
+		/* Cubing a uniform variable piles things up near 0 */
+		r = (double)random()/((double)RAND_MAX+1.0);
+		id = (long int)(r*r*r*items);
+		++truth[id];
+		itemof(item, id);
+		AddBloomFilter(item, 8, filter);
+		AddCountMinNgramFilter(item, 8, 8, sketch);
+	}
+	for (id=0; id < items; ++id) {
+		itemof(item, id);
+		err = FindBloomFilter(item, 8, filter) - truth[id];
+		bloomerr += err;
+		bloomexact += !err;
+		if (err > bloommax) bloommax = err;
+		err = FindCountMinFilter(item, 8, sketch) - truth[id];
+		cmerr += err;
+		cmexact += !err;
+		if (err > cmmax) cmmax = err;
+	}
+	printf("ngram %d distinct %ld stream %ld counters %ld/%ld\n",
+		ngram, items, count, filter->m, sketch->m);
+	printf("bloom    %2d counters/item: mean error %8.4lf max %ld exact %6.2lf%%\n",
+		filter->k, bloomerr/items, bloommax, 100.0*bloomexact/items);
+	printf("countmin %2d counters/item: mean error %8.4lf max %ld exact %6.2lf%% (bound %.2lf)\n",
+		sketch->d, cmerr/items, cmmax, 100.0*cmexact/items,
+		M_E/(double)sketch->w*(double)sketch->n);
+	exit(0);
+}
+#endif
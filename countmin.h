@@ -0,0 +1,71 @@
+/* A count-min sketch, as an alternative to the counting Bloom filter.
+ *
+ * We only ever read counts back out of the Bloom filter as the minimum
+ * over an item's counters, which is just what a count-min sketch does,
+ * but with the counters split into d rows, one counter per row. That's d
+ * counters touched per ngram (4 by default) rather than 23. Updates are
+ * conservative - only the counters at the current minimum are bumped -
+ * which cuts the overestimates considerably.
+ *
+ * With w counters per row and N ngrams in all, an estimate is at most
+ * e/w * N over the true count, with probability at least 1 - e^-d (the
+ * usual bounds; conservative update only does better). These are
+ * reported along with the stats (diststats).
+ *
+ * For comparison with the Bloom filter, we use the same amount of counter
+ * memory for the same ngram size.
+ */
+
+#ifndef _COUNTMIN_H
+#define _COUNTMIN_H
+
+/* The number of rows (countminrows, COUNTMIN_ROWS by default) is in
+ * ngram.h, since it's set from the command line.
+ */
+
+typedef struct _CountMinSketch {
+	/* d - number of rows
+	 * w - counters per row
+	 * m - total counters (d*w)
+	 * n - total number of items inserted
+	 * distinct - number of distinct items inserted (approximate)
+	 */
+	int d;
+	/* For checking adequacy of counter size */
+	size_t overflows;
+	size_t underflows;
+	size_t w, m, n, distinct;
+	NgramCounter counter[0];	/* row by row */
+} CountMinSketch;
+
+CountMinSketch *
+#ifdef SHMALLOC
+NewCountMinNgramFilter(int ngram, char *shmfilename, int mode);
+#else
+NewCountMinNgramFilter(int ngram);
+#endif
+
+NgramFilterSet *
+#ifdef SHMALLOC
+NewCountMinNgramFilterSet(Range ngram, char *shmfilename, int mode);
+#else
+NewCountMinNgramFilterSet(Range ngram);
+#endif
+
+/* Basic operations - these parallel the ones in bloom.h */
+int AddCountMinHash64(Hash64 hash, CountMinSketch *sketch);
+int AddCountMinNgramFilter(void *item, size_t length, int ngram, CountMinSketch *sketch);
+int AddCountMinNgramFilterSet(void *item, size_t length, NgramFilterSet *vfilter);
+int DeleteCountMinNgramFilterSet(void *item, size_t length, NgramFilterSet *vfilter);
+int FindCountMinHash64(Hash64 hash, CountMinSketch *sketch);
+int FindCountMinFilter(void *item, int ngram, void *vfilter);
+int FindCountMinNgramFilterSet(void *item, size_t length, NgramFilterSet *vfilter);
+int FindCountMinNgramDistFilter(void *item, size_t length, int ngram, double *mu, double *sigma, double *rho, NgramFilterSet *vfilter);
+void DistCountMinNgramFilter(int ngram, double *mu, double *sigma, u_int64_t *max, u_int64_t *min, NgramFilterSet *vfilter);
+void DumpCountMinNgramFilter(FILE *file, int ngram, CountMinSketch *sketch);
+void DumpCountMinNgramFilterSet(FILE *file, NgramFilterSet *vfilter);
+void CloseCountMinNgramFilter(CountMinSketch *sketch);
+void CloseCountMinNgramFilterSet(NgramFilterSet *vfilter);
+void MergeCountMinNgramFilterSet(NgramFilterSet *into, NgramFilterSet *from);
+
+#endif /* _COUNTMIN_H */
@@ -8,8 +8,12 @@
 #include <memory.h>
 #include <getopt.h>
 #include "ymd.h"
+#include "pcapindex.h"
+#include "pcapzip.h"
 
-/*  pull the date from a pcap file */
+/*  pull the date from a pcap file - from its index, if it has one (see
+ *  pcapindex.h)
+ */
 
 int
 datepcap(char *pcap, struct timeval *tpcap)
@@ -19,8 +23,16 @@ datepcap(char *pcap, struct timeval *tpcap)
 	char errbuf[PCAP_ERRBUF_SIZE];
 	struct pcap_pkthdr *pkt_header;
 	u_int8_t *pkt_data;
+	PcapIndex *pi;
+	int kind;
 
-	if (!(fp = fopen(pcap, "r")))
+	if ((pi = pcapindexopen(pcap))) {
+		*tpcap = pcapindextime(&pi->first);
+		pcapindexclose(pi);
+		return 0;
+	}
+	if (!(fp = pcapzipopen(pcap, &kind)) &&
+			(kind != PCAPZIP_NONE || !(fp = fopen(pcap, "r"))))
 		return -1;
 	if (!(readp = pcap_fopen_offline(fp, errbuf))) {
 		fclose(fp);
@@ -65,8 +77,9 @@ main(int argc, char **argv)
 	void datemskinit(void);
 	struct timeval starttime, endtime;
 	int starti=0, endi=0;
-	int limitonly=0;
+	int limitonly=0, lastindexed=0;
 	int c;
+	PcapIndex *pi;
 
 	while ((c = getopt(argc, argv, "T:l"))>=0) {
 		switch (c) {
@@ -87,6 +100,21 @@ main(int argc, char **argv)
 	 * out of sequence);
 	 */
 	for (i = optind; i < argc; ++i) {
+		/* With an index, we know exactly whether it has any */
+		if ((pi = pcapindexopen(argv[i]))) {
+			c = pcapindexrange(pi, &starttime, &endtime);
+			pcapindexclose(pi);
+			/* ... but one before without an index might, too */
+			if (c >= 0 && !starti)
+				starti = i > optind && !lastindexed ? i-1 : i;
+			if (c > 0) {
+				endi = i > starti ? i-1 : starti;
+				goto printout;
+			}
+			lastindexed = 1;
+			continue;
+		}
+		lastindexed = 0;
 		if (datepcap(argv[i], &t) < 0) {
 			perror(argv[i]);
 		} else {
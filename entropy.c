@@ -6,33 +6,106 @@
 #include <sys/stat.h>
 #include <strings.h>
 #include <memory.h>
+#include <pthread.h>
 #include "entropy.h"
 
 #define OCTETSIZE	256		/* 8 bits */
+#define min(a,b)	((a)<=(b) ? (a) : (b))
+#define max(a,b)	((a)>=(b) ? (a) : (b))
 
 /* We are given a range of bytes, and calculate their statistical
  * (byte-wise) entropy, on a range from 0 to 8.
+ *
+ * With n bytes, c[i] of them with value i, that's
+ *	sum (c[i]/n) log2(n/c[i]) = log2(n) - (sum c[i] log2(c[i]))/n
+ * so with c log2(c) tabulated, all we need per packet is the counts,
+ * a lookup for each of them, and a division at the end.
  */
 
+static double clog2c[ENTROPY_TABLE];	/* c*log2(c) */
+static pthread_once_t clog2conce = PTHREAD_ONCE_INIT;
+
+static void
+clog2cinit(void)
+{
+	int c;
+
+	clog2c[0] = 0.0;
+	for (c=1; c < ENTROPY_TABLE; ++c)
+		clog2c[c] = (double)c * log2((double)c);
+}
+
+static inline double
+clog2cvalue(u_int32_t c)
+{
+	if (c < ENTROPY_TABLE)
+		return clog2c[c];
+	return (double)c * log2((double)c);
+}
+
+/* Count the byte values. A byte's count can't be bumped until the last
+ * bump of the same value has been stored, which is what runs of the same
+ * byte (zero padding, say) do all the time; with ENTROPY_SPLIT separate
+ * counts, taken in turn, consecutive bytes never wait on each other.
+ * They're added up at the end, which is cheap (and vectorizes), but
+ * clearing them isn't free, so small payloads just use the one.
+ */
 void
-entropyp(u_int8_t *x, int limit, double *entropy)
+entropycount(u_int8_t *x, int limit, u_int32_t *bytes)
 {
-	int count;
-	int bytes[OCTETSIZE];
+	u_int32_t split[ENTROPY_SPLIT][OCTETSIZE];
+	int i, j;
 
-	int n=0, i;
+	memset((void *)bytes, 0, OCTETSIZE*sizeof(u_int32_t));
+	if (limit < ENTROPY_SPLITMIN) {
+		for (i=0; i < limit; ++i)
+			++bytes[x[i]];
+		return;
+	}
+	memset((void *)split, 0, sizeof(split));
+	for (i=0; i + ENTROPY_SPLIT <= limit; i += ENTROPY_SPLIT) {
+		++split[0][x[i]];
+		++split[1][x[i+1]];
+		++split[2][x[i+2]];
+		++split[3][x[i+3]];
+	}
+	for (; i < limit; ++i)
+		++split[0][x[i]];
+	for (j=0; j < ENTROPY_SPLIT; ++j)
+		for (i=0; i < OCTETSIZE; ++i)
+			bytes[i] += split[j][i];
+}
+
+/* The entropy of limit bytes, given their counts */
+double
+entropycounts(u_int32_t *bytes, int limit)
+{
 	double sum=0.0;
+	int i;
 
-	memset((void *)bytes, 0, OCTETSIZE*sizeof(int));
-	for (i=0; i < limit; ++i) {
-		++bytes[x[i]&0xff];	/* belt and suspenders */
-	}
-	/* Shall we be stupid about it? Yes, we shall. */
-	*entropy = 0;
-	for (i=0; i<OCTETSIZE; ++i) {
-		if (bytes[i])
-			*entropy += ((double)bytes[i]/(double)limit)*log2((double)limit/((double)bytes[i]));
+	if (limit <= 0)
+		return 0.0;
+	pthread_once(&clog2conce, clog2cinit);
+	/* No count can be more than limit, and we've got the sizes of
+	 * any packet tabulated
+	 */
+	if (limit < ENTROPY_TABLE) {
+		for (i=0; i < OCTETSIZE; ++i)
+			sum += clog2c[bytes[i]];
+		return (clog2c[limit] - sum) / (double)limit;
 	}
+	for (i=0; i < OCTETSIZE; ++i)
+		sum += clog2cvalue(bytes[i]);
+	return (clog2cvalue(limit) - sum) / (double)limit;
+}
+
+void
+entropyp(u_int8_t *x, int limit, double *entropy)
+{
+	u_int32_t bytes[OCTETSIZE];
+
+	entropycount(x, limit, bytes);
+	*entropy = entropycounts(bytes, limit);
 }
 
 double
@@ -44,6 +117,244 @@ entropy(u_int8_t *x, int limit)
 	return answer;
 }
 
+/* Deciding on part of the payload (see entropy.h). Each thread counts
+ * how that went, for entropystats.
+ */
+typedef struct _entropyStats {
+	u_int64_t packets, early, bytes, skipped;
+	u_int64_t windowed, kept;	/* bytes, with -w */
+	struct _entropyStats *next;
+} EntropyStats;
+
+static __thread EntropyStats *stats;
+static EntropyStats *allstats;
+static pthread_mutex_t statslock = PTHREAD_MUTEX_INITIALIZER;
+
+/* 1 if everything from lo to hi is in range (as in indoublerange),
+ * 0 if none of it is, -1 if we can't say
+ */
+static int
+entropyinrange(double lo, double hi, DRange *range)
+{
+	if (hi < range->min - ENTROPY_SLOP ||
+			(range->max != 0.0 && lo > range->max + ENTROPY_SLOP))
+		return 0;
+	if (lo >= range->min + ENTROPY_SLOP &&
+			(range->max == 0.0 || hi <= range->max - ENTROPY_SLOP))
+		return 1;
+	return -1;
+}
+
+/* The least and most the entropy of all limit bytes can be, having
+ * counted seen of them. c log2 c is convex, so the least is with the
+ * rest all the commonest value so far. For the most, no count can go
+ * down, so it can't be over what we'd get with the counts so far and
+ * the total. (Spreading the rest over the rarest values would be closer,
+ * but working that out costs more than counting what's left.)
+ */
+static void
+entropybounds(u_int32_t *bytes, int seen, int limit, double *low,
+	double *high)
+{
+	double sum=0.0, total;
+	u_int32_t most=0;
+	int i;
+
+	for (i=0; i < OCTETSIZE; ++i) {
+		sum += clog2c[bytes[i]];
+		if (bytes[i] > most)
+			most = bytes[i];
+	}
+	total = clog2cvalue(limit);
+	*high = (total - sum) / (double)limit;
+	sum += clog2cvalue(most + limit - seen) - clog2c[most];
+	*low = (total - sum) / (double)limit;
+}
+
+/* Can we tell already? 1 to keep the packet, 0 not, -1 don't know */
+static int
+entropyearly(u_int32_t *bytes, int seen, int limit, DRange *range,
+	int flag, double margin)
+{
+	double guess, low, high;
+	int i, values, in;
+
+	/* The entropy of what we've seen, corrected for it being a small
+	 * sample (Miller and Madow); we only go on this to throw packets
+	 * out.
+	 */
+	if (margin >= 0.0) {
+		for (values=0, i=0; i < OCTETSIZE; ++i)
+			values += bytes[i] != 0;
+		guess = entropycounts(bytes, seen) +
+			(values - 1) / (2.0 * seen * M_LN2);
+		in = entropyinrange(guess - margin, guess + margin, range);
+		if (in >= 0 && in != flag)
+			return 0;
+	}
+	/* The bounds are no use till we've seen most of it */
+	if (limit - seen > seen)
+		return -1;
+	entropybounds(bytes, seen, limit, &low, &high);
+	if ((in = entropyinrange(low, high, range)) < 0)
+		return -1;
+	return in == flag;
+}
+
+static EntropyStats *
+newstats(void)
+{
+	EntropyStats *es;
+
+	if (!(es = (EntropyStats *)calloc(1, sizeof(EntropyStats))))
+		return NULL;
+	pthread_mutex_lock(&statslock);
+	es->next = allstats;
+	allstats = es;
+	pthread_mutex_unlock(&statslock);
+	return stats = es;
+}
+
+int
+entropyselect(u_int8_t *x, int limit, u_int32_t *counts, DRange *range,
+	int flag, double margin)
+{
+	u_int32_t mine[OCTETSIZE], *bytes = counts ? counts : mine;
+	EntropyStats *es;
+	int seen=0, step, i, answer=-1;
+
+	pthread_once(&clog2conce, clog2cinit);
+	memset((void *)bytes, 0, OCTETSIZE*sizeof(u_int32_t));
+	/* Blocks doubling to start with, for the guess, then halving what's
+	 * left, for the bounds
+	 */
+	while (seen < limit) {
+		step = max(ENTROPY_BLOCK, min(seen, (limit - seen)/2));
+		step = min(step, limit - seen);
+		for (i=seen; i < seen + step; ++i)
+			++bytes[x[i]];
+		seen += step;
+		if (seen < limit && (answer = entropyearly(bytes, seen, limit,
+				range, flag, margin)) >= 0)
+			break;
+	}
+	if (answer < 0) {
+		double ent = entropycounts(bytes, limit);
+
+		answer = (ent >= range->min && (ent <= range->max ||
+			range->max == 0.0)) == flag;
+	}
+	if ((es = stats) || (es = newstats())) {
+		++es->packets;
+		es->bytes += limit;
+		if (seen < limit) {
+			++es->early;
+			es->skipped += limit - seen;
+		}
+	}
+	/* Whoever wanted the counts will want all of them */
+	if (answer && counts)
+		for (i=seen; i < limit; ++i)
+			++bytes[x[i]];
+	return answer;
+}
+
+/* Slide the window along one byte at a time: one count goes down and
+ * one up, and the sum of c log2 c changes by the difference in each, so
+ * every window's entropy comes in constant time. (The sum is only ever
+ * added to and taken from, so it drifts with the rounding, though by
+ * far less than ENTROPY_SLOP over any packet; right at the ends of the
+ * range, we add the counts up afresh.) Every window that's selected
+ * takes its bytes along, and windows that overlap or touch make one
+ * segment.
+ */
+int
+entropysegments(u_int8_t *x, int limit, int window, DRange *range, int flag,
+	double margin, EntropySegment *segment, int maxsegments)
+{
+	u_int32_t bytes[OCTETSIZE];
+	EntropyStats *es;
+	EntropySegment *last=NULL;
+	double sum=0.0, total, ent;
+	int i, n=0;
+	u_int8_t in, out;
+
+	/* Nothing to slide: the whole thing, as usual */
+	if (limit <= window || window >= ENTROPY_TABLE) {
+		if (!entropyselect(x, limit, NULL, range, flag, margin))
+			return 0;
+		segment->start = 0;
+		segment->length = limit;
+		return 1;
+	}
+	pthread_once(&clog2conce, clog2cinit);
+	memset((void *)bytes, 0, sizeof(bytes));
+	for (i=0; i < window; ++i) {
+		in = x[i];
+		sum += clog2c[bytes[in]+1] - clog2c[bytes[in]];
+		++bytes[in];
+	}
+	total = clog2c[window];
+	for (i=0; ; ++i) {
+		ent = (total - sum) / (double)window;
+		/* Too close to call, with the drift: do it properly */
+		if (fabs(ent - range->min) < ENTROPY_SLOP ||
+				fabs(ent - range->max) < ENTROPY_SLOP)
+			ent = entropycounts(bytes, window);
+		if ((ent >= range->min && (ent <= range->max ||
+				range->max == 0.0)) == flag) {
+			if (last && i <= last->start + last->length)
+				last->length = i + window - last->start;
+			else if (n < maxsegments) {
+				last = &segment[n++];
+				last->start = i;
+				last->length = window;
+			} else	/* out of room: take the gap too */
+				last->length = i + window - last->start;
+		}
+		if (i + window >= limit)
+			break;
+		out = x[i];
+		--bytes[out];
+		sum -= clog2c[bytes[out]+1] - clog2c[bytes[out]];
+		in = x[i + window];
+		sum += clog2c[bytes[in]+1] - clog2c[bytes[in]];
+		++bytes[in];
+	}
+	if ((es = stats) || (es = newstats())) {
+		es->windowed += limit;
+		for (i=0; i < n; ++i)
+			es->kept += segment[i].length;
+	}
+	return n;
+}
+
+void
+entropystats(void)
+{
+	EntropyStats *es;
+	u_int64_t packets=0, early=0, bytes=0, skipped=0;
+	u_int64_t windowed=0, kept=0;
+
+	pthread_mutex_lock(&statslock);
+	for (es = allstats; es; es = es->next) {
+		packets += es->packets;
+		early += es->early;
+		bytes += es->bytes;
+		skipped += es->skipped;
+		windowed += es->windowed;
+		kept += es->kept;
+	}
+	pthread_mutex_unlock(&statslock);
+	fprintf(stderr, "Entropy: %lu packets, %lu decided early; "
+		"%lu of %lu bytes skipped\n", (unsigned long)packets,
+		(unsigned long)early, (unsigned long)skipped,
+		(unsigned long)bytes);
+	if (windowed)
+		fprintf(stderr, "Entropy windows: %lu of %lu bytes kept\n",
+			(unsigned long)kept, (unsigned long)windowed);
+}
+
 #ifdef TEST
 fileentropy(FILE *fp)
 {
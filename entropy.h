@@ -1,2 +1,62 @@
+#ifndef _ENTROPY_H
+#define _ENTROPY_H
+
+#include "range.h"
+
+/* Tuning for the byte counts (see entropycount):
+ * ENTROPY_SPLIT - how many separate counts we keep (the loop there is
+ *	unrolled to match)
+ * ENTROPY_SPLITMIN - payloads smaller than this just use one
+ * ENTROPY_TABLE - counts below this have c*log2(c) looked up; bigger
+ *	than any packet
+ */
+#define ENTROPY_SPLIT		4
+#define ENTROPY_SPLITMIN	256
+#define ENTROPY_TABLE		65536
+
 double entropy(u_int8_t *x, int count);
 void entropyp(u_int8_t *x, int count, double *entropy);
+void entropycount(u_int8_t *x, int count, u_int32_t *bytes);
+double entropycounts(u_int32_t *bytes, int count);
+
+/* Selecting by entropy (-E, -e), without necessarily counting all of
+ * the payload: we count it a block at a time, and stop as soon as we
+ * know which side of the range it's on. Halfway through, the rest of
+ * the bytes can only move the entropy so far, and we stop if that's
+ * not far enough to make a difference. Before that, if margin (-c) is
+ * not negative, we throw the packet out if the entropy of what we've
+ * seen so far is more than margin bits the wrong side of the range -
+ * not certain, but long runs of compressed or encrypted data don't
+ * usually change their minds.
+ *
+ * ENTROPY_BLOCK - the fewest bytes we count between looks
+ * ENTROPY_SLOP - how far outside the range the bounds have to be, to
+ *	allow for rounding
+ */
+#define ENTROPY_BLOCK		64
+#define ENTROPY_SLOP		1e-9
+
+/* 1 to keep the packet, as in indoublerange(entropy, range) == flag.
+ * If counts isn't NULL, and we keep it, that gets the byte counts of all
+ * of it (see PacketContext in ngram.h).
+ */
+int entropyselect(u_int8_t *x, int count, u_int32_t *counts, DRange *range,
+	int flag, double margin);
+
+/* Selecting parts of a payload (-w): a header in the clear followed by
+ * compressed data comes out somewhere in between, and gets taken or
+ * left as a whole. Instead, we work out the entropy of every window
+ * bytes of it, and take just the windows that are selected, as up to
+ * maxsegments segments (any more, and the last one takes in the gaps).
+ * A payload no longer than the window is taken or left whole, as with
+ * entropyselect. The number of segments, 0 if there's nothing to take.
+ */
+typedef struct _entropySegment {
+	int start, length;
+} EntropySegment;
+
+int entropysegments(u_int8_t *x, int count, int window, DRange *range,
+	int flag, double margin, EntropySegment *segment, int maxsegments);
+void entropystats(void);
+
+#endif /* _ENTROPY_H */
@@ -0,0 +1,649 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <memory.h>
+#include <ctype.h>
+#include <math.h>
+#include <sys/types.h>
+#include "ngram.h"
+#include "libstats.h"
+
+#include "hashngram.h"
+
+NgramFilterSet hashset = {
+	{0,0},
+	NULL
+};
+NgramOps hashops = {
+	NewHashNgramFilterSet,
+	AddHashNgramFilterSet,
+	DeleteHashNgramFilterSet,
+	FindHashFilter,
+	FindHashNgramFilterSet,
+	FindHashNgramDistFilter,
+	DistHashNgramFilter,
+	DumpHashNgramFilterSet,
+	CloseHashNgramFilterSet,
+	MergeHashNgramFilterSet
+};
+
+Ngram hashngram = {
+	&hashset,
+	&hashops
+};
+
+/* The low n bytes of the packed ngram */
+#define HASHMASK(n)	\
+	((n) >= HASHNGRAM_MAX ? ~(u_int64_t)0 : ((u_int64_t)1<<(8*(n)))-1)
+
+/* Grow at 7/8 full */
+#define HASHFULL(t)	((t)->used >= (t)->size - (t)->size/8)
+
+#define HASHCOUNTMAX	0xffffffffU
+
+static inline size_t
+HashHome(u_int64_t key, int shift)
+{
+	return (size_t)((key*0x9e3779b97f4a7c15ULL) >> shift);
+}
+
+static int
+HashTableInit(HashTable *t, int bits)
+{
+	t->size = (size_t)1<<bits;
+	t->shift = 64-bits;
+	t->used = 0;
+	t->slot = (HashEntry *)calloc(t->size, sizeof(HashEntry));
+	return t->slot ? 0 : -1;
+}
+
+/* Robin Hood lookup: entries along the way are all at least as far from
+ * home as we are, so we can stop as soon as one isn't.
+ */
+static inline HashEntry *
+HashTableFind(HashTable *t, u_int64_t key)
+{
+	size_t i, mask = t->size-1;
+	u_int32_t d;
+	HashEntry *e;
+
+	i = HashHome(key, t->shift);
+	for (d=1; ; ++d, i = (i+1) & mask) {
+		e = t->slot+i;
+		if (e->dist < d)
+			return NULL;
+		if (e->key == key)
+			return e;
+	}
+}
+
+/* Put in a key that isn't there already, displacing anything that's
+ * nearer home than the one we're carrying.
+ */
+static inline void
+HashTablePut(HashTable *t, u_int64_t key, u_int32_t count)
+{
+	size_t i, mask = t->size-1;
+	HashEntry e, swap;
+
+	e.key = key;
+	e.count = count;
+	e.dist = 1;
+	i = HashHome(key, t->shift);
+	for (;; i = (i+1) & mask, ++e.dist) {
+		if (!t->slot[i].dist) {
+			t->slot[i] = e;
+			++t->used;
+			return;
+		}
+		if (t->slot[i].dist < e.dist) {
+			swap = t->slot[i];
+			t->slot[i] = e;
+			e = swap;
+		}
+	}
+}
+
+HashNgramFilter *
+NewHashNgramFilter(int ngram)
+{
+	HashNgramFilter *answer;
+
+	answer = (HashNgramFilter *)calloc(1, sizeof(HashNgramFilter));
+	if (!answer)
+		return NULL;
+	if (HashTableInit(&answer->cur, HASHNGRAM_SLOTBITS) < 0) {
+		free(answer);
+		return NULL;
+	}
+	answer->ngram = ngram;
+	return answer;
+}
+
+static size_t
+HashBytes(HashNgramFilter *filter)
+{
+	return sizeof(HashNgramFilter) +
+		(filter->cur.size + (filter->old.slot ? filter->old.size : 0))*
+		sizeof(HashEntry);
+}
+
+/* The tables grow, so they can't live in a fixed-size shared memory
+ * region; with SHMALLOC, they're in ordinary memory all the same.
+ */
+NgramFilterSet *
+#ifdef SHMALLOC
+NewHashNgramFilterSet(Range ngram, char *shmfilename, int mode)
+#else
+NewHashNgramFilterSet(Range ngram)
+#endif
+{
+	NgramFilterSet *answer;
+	int ng;
+
+	if (ngram.min < 1 || ngram.max > HASHNGRAM_MAX) {
+		fprintf(stderr, "Hash filter ngrams only go up to %d\n",
+			HASHNGRAM_MAX);
+		return NULL;
+	}
+	answer = (NgramFilterSet *)calloc(1, sizeof(NgramFilterSet));
+	if (!answer) return NULL;
+	answer->ngramsize = ngram;
+	for (ng=ngram.min; ng <= ngram.max; ++ng) {
+		if (!(answer->filter[ng] = (NgramFilter)NewHashNgramFilter(ng))) {
+			CloseHashNgramFilterSet(answer);
+			return NULL;
+		}
+		setngramlabel(NGRAM_HASH, NULL, ng,
+			HashBytes((HashNgramFilter *)answer->filter[ng]), 0, 0);
+	}
+	return answer;
+}
+
+void
+CloseHashNgramFilter(HashNgramFilter *filter)
+{
+	if (!filter) return;
+	free(filter->cur.slot);
+	free(filter->old.slot);
+	free(filter);
+}
+
+void
+CloseHashNgramFilterSet(NgramFilterSet *set)
+{
+	int ng;
+
+	if (!set) return;
+	for (ng=set->ngramsize.min; ng <= set->ngramsize.max; ++ng)
+		CloseHashNgramFilter((HashNgramFilter *)set->filter[ng]);
+	free(set);
+}
+
+/* Move some of the old table over. Anything below moved is done, and
+ * anything deleted (or already moved by an insert) has a zero count.
+ */
+static void
+HashMigrate(HashNgramFilter *filter, size_t slots)
+{
+	HashEntry *e;
+	size_t end = filter->moved + slots;
+
+	if (end > filter->old.size)
+		end = filter->old.size;
+	for (; filter->moved < end; ++filter->moved) {
+		e = filter->old.slot + filter->moved;
+		if (e->dist && e->count)
+			HashTablePut(&filter->cur, e->key, e->count);
+	}
+	if (filter->moved >= filter->old.size) {
+		free(filter->old.slot);
+		filter->old.slot = NULL;
+		filter->old.size = filter->old.used = 0;
+		filter->moved = 0;
+	}
+}
+
+/* Start a new table twice the size; the current one becomes the old one,
+ * to be moved over bit by bit. (If the last one isn't all moved yet,
+ * finish that first.)
+ */
+static int
+HashGrow(HashNgramFilter *filter)
+{
+	HashTable bigger;
+
+	if (filter->old.slot)
+		HashMigrate(filter, filter->old.size);
+	if (HashTableInit(&bigger, 64-filter->cur.shift+1) < 0)
+		return -1;
+	filter->old = filter->cur;
+	filter->cur = bigger;
+	filter->moved = 0;
+	return 0;
+}
+
+/* A live entry for this key, in either table, or NULL */
+static inline HashEntry *
+HashEntryFor(HashNgramFilter *filter, u_int64_t key)
+{
+	HashEntry *e;
+
+	if ((e = HashTableFind(&filter->cur, key)))
+		return e;
+	if (filter->old.slot && (e = HashTableFind(&filter->old, key)) &&
+			e >= filter->old.slot + filter->moved)
+		return e;
+	return NULL;
+}
+
+/* Add count to a key. Returns 1 if we couldn't, or it overflowed, as the
+ * other filters count them.
+ */
+static int
+HashAdd(HashNgramFilter *filter, u_int64_t key, u_int32_t count)
+{
+	HashEntry *e;
+	u_int64_t newcount = count;
+
+	if (filter->old.slot)
+		HashMigrate(filter, HASHNGRAM_MIGRATE);
+	filter->n += count;
+	if ((e = HashTableFind(&filter->cur, key))) {
+		if (!e->count)
+			++filter->distinct;
+		newcount += e->count;
+		if (newcount > HASHCOUNTMAX) {
+			++filter->overflows;
+			e->count = HASHCOUNTMAX;
+			return 1;
+		}
+		e->count = newcount;
+		return 0;
+	}
+	if (HASHFULL(&filter->cur) && HashGrow(filter) < 0) {
+		if (!filter->lost && dumplevel > 0)
+			fprintf(stderr, "ngram %d: no memory to grow hash table past %ld\n",
+				filter->ngram, filter->cur.size);
+		filter->n -= count;
+		filter->lost += count;
+		return 1;
+	}
+	/* If it's still in the old table, bring it along now */
+	if (filter->old.slot && (e = HashTableFind(&filter->old, key)) &&
+			e >= filter->old.slot + filter->moved && e->count) {
+		newcount += e->count;
+		e->count = 0;
+	} else {
+		++filter->distinct;
+	}
+	if (newcount > HASHCOUNTMAX) {
+		++filter->overflows;
+		HashTablePut(&filter->cur, key, HASHCOUNTMAX);
+		return 1;
+	}
+	HashTablePut(&filter->cur, key, newcount);
+	return 0;
+}
+
+static void
+HashLabel(NgramFilterSet *set)
+{
+	HashNgramFilter *filter;
+	int ng;
+
+	for (ng=set->ngramsize.min; ng <= set->ngramsize.max; ++ng) {
+		filter = (HashNgramFilter *)set->filter[ng];
+		setngramlabel(NGRAM_HASH, NULL, ng, HashBytes(filter),
+			filter->n, filter->distinct);
+	}
+}
+
+/* The same rolling pack as readngrams, but keeping the last 8 bytes, so
+ * every size in the range is just a mask of it. We work out all the
+ * sizes' home slots and fetch them before touching any of them, so the
+ * misses overlap.
+ */
+int
+AddHashNgramFilterSet(void *item, size_t length, NgramFilterSet *vfilter)
+{
+	u_int8_t *input = (u_int8_t *)item;
+	Range r = vfilter->ngramsize;
+	HashNgramFilter *filter;
+	u_int64_t ngramwork = 0;
+	u_int64_t key[HASHNGRAM_MAX+1];
+	size_t i;
+	int ng, top;
+	int ret=0;
+
+	for (i=0; i < length; ++i) {
+		ngramwork <<= 8;
+		ngramwork += input[i];
+		top = min(r.max, i+1);
+		for (ng=r.min; ng <= top; ++ng) {
+			filter = (HashNgramFilter *)vfilter->filter[ng];
+			key[ng] = ngramwork & HASHMASK(ng);
+			__builtin_prefetch(filter->cur.slot +
+				HashHome(key[ng], filter->cur.shift), 1);
+		}
+		for (ng=r.min; ng <= top; ++ng) {
+			ret += HashAdd((HashNgramFilter *)vfilter->filter[ng],
+				key[ng], 1);
+		}
+	}
+	HashLabel(vfilter);
+	return ret;
+}
+
+int
+DeleteHashNgramFilterSet(void *item, size_t length, NgramFilterSet *vfilter)
+{
+	u_int8_t *input = (u_int8_t *)item;
+	Range r = vfilter->ngramsize;
+	HashNgramFilter *filter;
+	HashEntry *e;
+	u_int64_t ngramwork = 0;
+	size_t i;
+	int ng, top;
+	int ret=0;
+
+	for (i=0; i < length; ++i) {
+		ngramwork <<= 8;
+		ngramwork += input[i];
+		top = min(r.max, i+1);
+		for (ng=r.min; ng <= top; ++ng) {
+			filter = (HashNgramFilter *)vfilter->filter[ng];
+			e = HashEntryFor(filter, ngramwork & HASHMASK(ng));
+			if (!e || !e->count) continue;
+			if (!--e->count)
+				--filter->distinct;
+			--filter->n;
+			++ret;
+		}
+	}
+	HashLabel(vfilter);
+	return ret;
+}
+
+/* Find a single ngram */
+int
+FindHashFilter(void *item, int ngram, void *vfilter)
+{
+	u_int8_t *input = (u_int8_t *)item;
+	u_int64_t key = 0;
+	HashEntry *e;
+	int i;
+
+	for (i=0; i < ngram; ++i) {
+		key <<= 8;
+		key += input[i];
+	}
+	e = HashEntryFor((HashNgramFilter *)vfilter, key);
+	if (!e)
+		return 0;
+	return e->count > 0x7fffffff ? 0x7fffffff : e->count;
+}
+
+/* Chop an item into ngrams, and total up their frequencies */
+int
+FindHashNgramFilterSet(void *item, size_t length, NgramFilterSet *vfilter)
+{
+	u_int8_t *input = (u_int8_t *)item;
+	Range r = vfilter->ngramsize;
+	HashEntry *e;
+	u_int64_t ngramwork = 0;
+	size_t i;
+	int ng, top;
+	int ret=0;
+
+	for (i=0; i < length; ++i) {
+		ngramwork <<= 8;
+		ngramwork += input[i];
+		top = min(r.max, i+1);
+		for (ng=r.min; ng <= top; ++ng) {
+			e = HashEntryFor((HashNgramFilter *)vfilter->filter[ng],
+				ngramwork & HASHMASK(ng));
+			if (e)
+				ret += e->count;
+		}
+	}
+	return ret;
+}
+
+int
+FindHashNgramDistFilter(void *item, size_t length, int ngram, double *mu, double *sigma, double *rho, NgramFilterSet *vfilter)
+{
+	int i;
+	int total=0;
+	static int frequencies[NGRAM_MAX];
+
+	for (i=0; i+ngram <= length && i < NGRAM_MAX; ++i) {
+		frequencies[i] =
+			FindHashFilter((u_int8_t *)item + i, ngram,
+				vfilter->filter[ngram]);
+		total += frequencies[i];
+	}
+	intarraystats(frequencies, i, mu, sigma, rho);
+	return total;
+}
+
+/* Walk the live entries, old table (what's left of it) and all */
+static HashEntry *
+HashNext(HashNgramFilter *filter, size_t *i)
+{
+	HashEntry *e;
+
+	for (; *i < filter->cur.size; ++*i) {
+		e = filter->cur.slot + *i;
+		if (e->dist && e->count) {
+			++*i;
+			return e;
+		}
+	}
+	if (!filter->old.slot)
+		return NULL;
+	if (*i < filter->cur.size + filter->moved)
+		*i = filter->cur.size + filter->moved;
+	for (; *i < filter->cur.size + filter->old.size; ++*i) {
+		e = filter->old.slot + (*i - filter->cur.size);
+		if (e->dist && e->count) {
+			++*i;
+			return e;
+		}
+	}
+	return NULL;
+}
+
+/* Statistics of the counts of the distinct ngrams; as with the trie,
+ * there are no zeros in here.
+ */
+void
+DistHashNgramFilter(int ngram, double *mu, double *sigma,
+	u_int64_t *max, u_int64_t *min, NgramFilterSet *vfilter)
+{
+	HashNgramFilter *filter = (HashNgramFilter *)vfilter->filter[ngram];
+	HashEntry *e;
+	size_t i=0, n=0;
+	double sum=0.0, sumsquare=0.0;
+
+	*mu = *sigma = 0.0;
+	*max = 0;
+	*min = 0xffffffff;
+	while ((e = HashNext(filter, &i))) {
+		sum += (double)e->count;
+		sumsquare += (double)e->count*e->count;
+		if (e->count > *max) *max = e->count;
+		if (e->count < *min) *min = e->count;
+		++n;
+	}
+	if (!n) {
+		*min = 0;
+		return;
+	}
+	*mu = sum/(double)n;
+	if (n > 1)
+		*sigma = sqrt((sumsquare - (double)n*(*mu)*(*mu))/(double)(n-1));
+	if (dumplevel > 0)
+		fprintf(stderr, "ngram %d: hash table %ld slots, %.1lf%% full, %ld overflows, %ld lost\n",
+			ngram, filter->cur.size,
+			100.0*filter->cur.used/filter->cur.size,
+			filter->overflows, filter->lost);
+}
+
+/* Dump the ngrams and their counts, in the same format as the array's
+ * reportngram (but in no particular order).
+ */
+void
+DumpHashNgramFilter(FILE *dumpfile, HashNgramFilter *filter)
+{
+	HashEntry *e;
+	size_t i=0;
+	u_int8_t byte;
+	int j;
+
+	if (!dumpfile) return;
+	fprintf(dumpfile, "ngram %d: %ld total %ld distinct\n", filter->ngram,
+		filter->n, filter->distinct);
+	while ((e = HashNext(filter, &i))) {
+		fprintf(dumpfile, "%u: ", e->count);
+		for (j=filter->ngram-1; j >= 0; --j) {
+			byte = (e->key >> (8*j)) & 0xff;
+			if (isprint(byte))
+				fprintf(dumpfile, " %c", byte);
+			else
+				fprintf(dumpfile, " (%d)", byte);
+		}
+		fprintf(dumpfile, "\n");
+	}
+}
+
+void
+DumpHashNgramFilterSet(FILE *dumpfile, NgramFilterSet *vfilter)
+{
+	int ng;
+
+	if (!dumpfile) return;
+	for (ng=vfilter->ngramsize.min; ng <= vfilter->ngramsize.max; ++ng)
+		DumpHashNgramFilter(dumpfile,
+			(HashNgramFilter *)vfilter->filter[ng]);
+}
+
+/* Add one set into another, entry by entry. The entries come out in home
+ * slot order, which in a smaller table would all land together at the
+ * bottom end; so we grow it to fit first (all at once, since there's no
+ * point in spreading that out here).
+ */
+void
+MergeHashNgramFilterSet(NgramFilterSet *into, NgramFilterSet *from)
+{
+	HashNgramFilter *to, *fr;
+	HashEntry *e;
+	size_t i, want;
+	int ng;
+
+	for (ng=into->ngramsize.min; ng <= into->ngramsize.max; ++ng) {
+		to = (HashNgramFilter *)into->filter[ng];
+		fr = (HashNgramFilter *)from->filter[ng];
+		if (!to || !fr) continue;
+		want = to->distinct + fr->distinct;
+		while (want >= to->cur.size - to->cur.size/8 &&
+				HashGrow(to) == 0)
+			;
+		if (to->old.slot)
+			HashMigrate(to, to->old.size);
+		for (i=0; (e = HashNext(fr, &i)); )
+			(void) HashAdd(to, e->key, e->count);
+		to->overflows += fr->overflows;
+		to->lost += fr->lost;
+	}
+	if (into == ngram->f)
+		HashLabel(into);
+}
+
+#ifdef TEST
+/* Check the counts against a brute force count (sorting all the ngrams
+ * of each size and counting the runs), with the text split in two, into
+ * two sets, which are then merged.
+ */
+FILE *dumpfile=NULL;
+int dumplevel;
+
+static int sortsize;
+
+static int
+ngramcmp(const void *a, const void *b)
+{
+	return memcmp(*(u_int8_t **)a, *(u_int8_t **)b, sortsize);
+}
+
+int
+main(int argc, char **argv)
+{
+	Range r = {1, 8};
+	size_t length = 400000, half, i, j, n, distinct;
+	int c, ng, alphabet = 6, found, errors=0;
+	u_int8_t *text, **grams;
+	NgramFilterSet *set[2];
+	HashNgramFilter *filter;
+
+	while ((c = getopt(argc, argv, "n:l:a:")) >= 0) {
+		switch (c) {
+		case 'n':
+			(void) sscanf(optarg, "%d-%d", &r.min, &r.max);
+			break;
+		case 'l':
+			length = atol(optarg);
+			break;
+		case 'a':
+			alphabet = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr,
+				"Usage: hashtest [-n min-max] [-l length] [-a alphabet]\n");
+			exit(1);
+		}
+	}
+	half = length/2;
+	text = (u_int8_t *)malloc(length);
+	grams = (u_int8_t **)malloc(length*sizeof(u_int8_t *));
+	set[0] = NewHashNgramFilterSet(r);
+	set[1] = NewHashNgramFilterSet(r);
+	if (!text || !grams || !set[0] || !set[1])
+		exit(2);
+	srandom(1);
+	for (i=0; i < length; ++i)
+		text[i] = 'a' + random()%alphabet;
+	AddHashNgramFilterSet(text, half, set[0]);
+	AddHashNgramFilterSet(text+half, length-half, set[1]);
+	MergeHashNgramFilterSet(set[0], set[1]);
+
+	for (ng=r.min; ng <= r.max; ++ng) {
+		filter = (HashNgramFilter *)set[0]->filter[ng];
+		n = 0;
+		for (i=0; i+ng <= half; ++i)
+			grams[n++] = text+i;
+		for (i=half; i+ng <= length; ++i)
+			grams[n++] = text+i;
+		sortsize = ng;
+		qsort(grams, n, sizeof(u_int8_t *), ngramcmp);
+		distinct = 0;
+		for (i=0; i < n; i = j) {
+			for (j=i+1; j < n && !memcmp(grams[i], grams[j], ng); ++j)
+				;
+			++distinct;
+			found = FindHashFilter(grams[i], ng, filter);
+			if (found != j-i && errors++ < 10)
+				fprintf(stderr, "ngram %d: %.*s found %d, not %ld\n",
+					ng, ng, grams[i], found, j-i);
+		}
+		if ((filter->distinct != distinct || filter->n != n) &&
+				errors++ < 10)
+			fprintf(stderr, "ngram %d: %ld/%ld total/distinct, not %ld/%ld\n",
+				ng, filter->n, filter->distinct, n, distinct);
+		printf("ngram %d total %ld distinct %ld, %ld slots\n", ng, n,
+			distinct, filter->cur.size);
+	}
+	printf("%s\n", errors ? "FAILED" : "ok");
+	exit(errors != 0);
+}
+#endif
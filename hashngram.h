@@ -0,0 +1,76 @@
+/* Exact ngram counts in a hash table, for n up to 8.
+ *
+ * Up to 8 bytes, an ngram packs into a u_int64_t just as it does for the
+ * array (first byte highest), so there's no need to hash it down and
+ * live with collisions: the packed ngram is the key. Memory goes with the
+ * number of distinct ngrams actually seen, rather than 256^n (array) or
+ * the bloomsizes table (Bloom filter).
+ *
+ * The table is open addressed, Robin Hood style: an entry being inserted
+ * takes the slot of any entry that's closer to its home slot, and moves
+ * that one on instead. That keeps probe lengths short and even, so
+ * lookups are usually one cache line, at 7/8 full.
+ *
+ * It grows incrementally: when it fills up, a table twice the size is
+ * started, and each insert moves a few slots' worth of the old one over,
+ * so there's never one long pause to copy everything.
+ */
+
+#ifndef _HASHNGRAM_H
+#define _HASHNGRAM_H
+
+#define HASHNGRAM_MAX	8	/* bytes in a u_int64_t */
+#define HASHNGRAM_SLOTBITS	16	/* starting size */
+#define HASHNGRAM_MIGRATE	16	/* old slots moved per insert */
+
+typedef struct _hashEntry {
+	u_int64_t key;		/* the packed ngram */
+	u_int32_t count;	/* 0 if deleted (or moved, in an old table) */
+	u_int32_t dist;		/* 1 + distance from home; 0 for empty */
+} HashEntry;
+
+typedef struct _hashTable {
+	HashEntry *slot;
+	size_t size;		/* a power of 2 */
+	int shift;		/* 64 - log2(size), for the hash */
+	size_t used;		/* slots in use */
+} HashTable;
+
+typedef struct _HashNgramFilter {
+	/* cur - the table
+	 * old - the one before, while it's being moved over (slot NULL if
+	 *	not); slots below moved are done.
+	 * n - total number of items inserted
+	 * distinct - number with nonzero counts
+	 * overflows - counts that hit 2^32-1
+	 * lost - items we couldn't get memory for
+	 */
+	int ngram;
+	HashTable cur, old;
+	size_t moved;
+	size_t n, distinct;
+	size_t overflows, lost;
+} HashNgramFilter;
+
+HashNgramFilter *NewHashNgramFilter(int ngram);
+
+NgramFilterSet *
+#ifdef SHMALLOC
+NewHashNgramFilterSet(Range ngram, char *shmfilename, int mode);
+#else
+NewHashNgramFilterSet(Range ngram);
+#endif
+
+int AddHashNgramFilterSet(void *item, size_t length, NgramFilterSet *vfilter);
+int DeleteHashNgramFilterSet(void *item, size_t length, NgramFilterSet *vfilter);
+int FindHashFilter(void *item, int ngram, void *vfilter);
+int FindHashNgramFilterSet(void *item, size_t length, NgramFilterSet *vfilter);
+int FindHashNgramDistFilter(void *item, size_t length, int ngram, double *mu, double *sigma, double *rho, NgramFilterSet *vfilter);
+void DistHashNgramFilter(int ngram, double *mu, double *sigma, u_int64_t *max, u_int64_t *min, NgramFilterSet *vfilter);
+void DumpHashNgramFilter(FILE *file, HashNgramFilter *filter);
+void DumpHashNgramFilterSet(FILE *file, NgramFilterSet *vfilter);
+void CloseHashNgramFilter(HashNgramFilter *filter);
+void CloseHashNgramFilterSet(NgramFilterSet *vfilter);
+void MergeHashNgramFilterSet(NgramFilterSet *into, NgramFilterSet *from);
+
+#endif /* _HASHNGRAM_H */
@@ -0,0 +1,39 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <getopt.h>
+#include <pcap/pcap.h>
+#include "pcapindex.h"
+
+/* Write time indexes for capture files, for -T (see pcapindex.h) */
+
+int
+main(int argc, char **argv)
+{
+	int i, c;
+	int seconds=0;
+	size_t bytes=0;
+	int ret=0;
+
+	while ((c = getopt(argc, argv, "s:m:"))>=0) {
+		switch (c) {
+		case 's':
+			seconds = atoi(optarg);
+			break;
+		case 'm':
+			bytes = (size_t)atoi(optarg) * 1024*1024;
+			break;
+		default:
+			fprintf(stderr,
+				"Usage: indexpcap [-s seconds] [-m megabytes] pcap files ...\n");
+			exit(1);
+		}
+	}
+	for (i = optind; i < argc; ++i) {
+		if (pcapindexbuild(argv[i], seconds, bytes) < 0)
+			ret = 1;
+	}
+	return ret;
+}
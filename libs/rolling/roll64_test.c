@@ -0,0 +1,65 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/types.h>
+#include <time.h>
+#include "rolling.h"
+
+#define	MAXLEN	2048
+#define min(a,b)	((a)<=(b) ? (a) : (b))
+
+/* Check the rolled hashes against the one-shot ones, for random buffers
+ * and ranges of sizes.
+ */
+main(int argc, char **argv)
+{
+	int i, j, n, count;
+	int low, high, len;
+	u_int8_t buffer[MAXLEN];
+	u_int64_t hvalout[ROLL_MAXN+1];
+	u_int64_t hval;
+	Roll64 roll;
+	long long int hashcount=0;
+
+	srandom(time(NULL));
+	for (j=0; j < 20000; ++j) {
+		len = random()%MAXLEN;
+		for (i=0; i < len; ++i)
+			buffer[i] = (random() & 0xff);
+		low = 1 + random()%ROLL_MAXN;
+		high = 1 + random()%ROLL_MAXN;
+		if (low > high) {
+			int flip = low;
+
+			low = high;
+			high = flip;
+		}
+		roll_64_init(&roll, buffer, len, low, high);
+		for (i=0; (count = roll_64_next(&roll, hvalout)) > 0; ++i) {
+			if (count != min(high, len-i) - low + 1) {
+				fprintf(stderr, "len %d low %d high %d offset %d: count %d\n",
+					len, low, high, i, count);
+				abort();
+			}
+			for (n=low; n < low+count; ++n) {
+				hval = roll_64_buf(buffer+i, n);
+				if (hval != hvalout[n-low]) {
+					fprintf(stderr, "offset %d size %d error\n",
+						i, n);
+					fprintf(stderr, "%llx vs %llx\n",
+						hvalout[n-low], hval);
+					abort();
+				}
+			}
+			hashcount += count;
+		}
+		if (i != (len >= low ? len-low+1 : 0)) {
+			fprintf(stderr, "len %d low %d: %d offsets\n",
+				len, low, i);
+			abort();
+		}
+	}
+	printf("%lld hashes checked\n", hashcount);
+	exit(0);
+}
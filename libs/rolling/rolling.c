@@ -0,0 +1,238 @@
+/* rolling.c - rolling (cyclic polynomial, aka "buzhash") 64-bit hashes
+ *
+ * See rolling.h for the idea. The table below is just 256 random 64-bit
+ * values (from splitmix64 with a fixed seed); any other random table would
+ * do as well, but it must never change once filters have been built with
+ * it, or lookups in existing filters will fail.
+ */
+#include <stdio.h>
+#include <sys/types.h>
+#include "rolling.h"
+
+static const u_int64_t rolltable[256] = {
+	0x5fc4690518699f57ULL, 0x63bf9cf8ddccf724ULL,
+	0x50aa6c676a47edc4ULL, 0x0a78cfcb326ef113ULL,
+	0x9370cb93665ec345ULL, 0xf516d0e522ecedc7ULL,
+	0xb391310c1ff5f7fcULL, 0x5a7a5d3c5ddc101cULL,
+	0xa4a09b6c22a84c75ULL, 0x56878e16bcb01fdcULL,
+	0xb4b22498b82903b5ULL, 0x7d8a05b674895956ULL,
+	0x5c2b57eb3264e3a0ULL, 0xf4d3b2cf9e46a1dfULL,
+	0x077b9ba14c1a3e17ULL, 0xb19a81703f6a66c7ULL,
+	0x20576cec0757c66dULL, 0xcd2bb8f65dbcbb79ULL,
+	0xd67503f696d1e878ULL, 0x7de3830e5075ab63ULL,
+	0x87329daa9fefe661ULL, 0x76092864f943954dULL,
+	0xc04fbfe5e44818d0ULL, 0x599ecd7b7beb28c7ULL,
+	0xe76fc5295316e572ULL, 0x4d676b369ecd6c7eULL,
+	0x36201e740cda9d2cULL, 0xbe39427fe78c864eULL,
+	0x0afb8f08d41cb575ULL, 0xa08beed9e2f5a651ULL,
+	0x93aae816866cbdb6ULL, 0x98844c509f8b0b84ULL,
+	0xae0d2607ce77286dULL, 0x72cefdccd0eb4238ULL,
+	0x56f5091bd337a709ULL, 0x75d6c1f0d3be2284ULL,
+	0xc055da0e7d903b66ULL, 0xf4a454f7fe9cd75dULL,
+	0x91f1e1f3a2657046ULL, 0x45c28cd43723eb42ULL,
+	0x5d9211d1a28c2092ULL, 0x441f3897f54e595aULL,
+	0xfdde92bc7d03ec00ULL, 0xc85c00a789351cc1ULL,
+	0x8682e21d7346beb0ULL, 0x741818b5d6b1fb89ULL,
+	0x9f63160da25b1b4fULL, 0xebc7958474020fcbULL,
+	0x4d7778ba357bf5cfULL, 0x2512ca77937eed4fULL,
+	0x0e10e6f00764f64dULL, 0xc39b6a5623428f4bULL,
+	0x932dc1930afed6c4ULL, 0x671d6d802d2f1acdULL,
+	0x36058fe15f88c269ULL, 0x295d685626583dc5ULL,
+	0x9dfa096e6f53b00bULL, 0x207a4ba88e83b0ffULL,
+	0x2102c93d9c29a9d2ULL, 0x6320d5346a34d0caULL,
+	0x9d894e96ba0e32f4ULL, 0x35d74946e291abd1ULL,
+	0xa6e8291d9767c7b4ULL, 0xb0167f440eec4387ULL,
+	0xe0ba65c6d2a14c7dULL, 0xeeeb90ccbe529aaaULL,
+	0x281e81e1bbf09d60ULL, 0xc18cf9a4041a95beULL,
+	0xdbcd20492d53e590ULL, 0x6b37009525ff2143ULL,
+	0x1686bb6fc780ee5dULL, 0x7595d24a51c146deULL,
+	0x3bc9c3a66225fcefULL, 0xf905b9d6e47834d5ULL,
+	0x24635307dcdd513eULL, 0x3f2a5500c5b3b0afULL,
+	0xb6c35784867b9b94ULL, 0x75f675791cfc39ccULL,
+	0x87a37551c578de27ULL, 0x4624a879b8104e0bULL,
+	0xd6fe703933b0b5b5ULL, 0xc68f466c9ce4a37dULL,
+	0x4b5bca68cae58a12ULL, 0x03da216725d6f6cfULL,
+	0x73ee64141cc72658ULL, 0x439bf05b4836fe1eULL,
+	0x411cf92f49c1fb28ULL, 0x9b56ff865e520798ULL,
+	0x8d710f0eda259563ULL, 0xb6b2d4f5066975e6ULL,
+	0xfbbf7fd61453d667ULL, 0xe17b65bd5661f194ULL,
+	0x4822fa153303b173ULL, 0x67e26d8a0af03d23ULL,
+	0xddd730bfb4a20551ULL, 0xe38530ed1dca4c50ULL,
+	0xd929a6464f1c42e8ULL, 0x14d537f8f4af5f30ULL,
+	0xef485229004e5031ULL, 0x43ce64d8314712feULL,
+	0xbda6db23979a95d8ULL, 0xda0a406446657258ULL,
+	0x18d06147414e0378ULL, 0xfe31fd419c5a230cULL,
+	0x8b87d8640091e550ULL, 0xc935e87e4f663a9cULL,
+	0xab17c3c042688292ULL, 0x75385832a4758a4bULL,
+	0x1d2d5d18370686c6ULL, 0x6a4d0d3be0a78b17ULL,
+	0xae33f424045124a5ULL, 0x4a331642ad8623f7ULL,
+	0xcd369318f7c2750eULL, 0xc88d5c87097047ceULL,
+	0x31510a7dac441ed3ULL, 0xd436e7582db3670aULL,
+	0xb6e1bb6430e6b00cULL, 0xec89833ec9588262ULL,
+	0x38423b6be89b0d3dULL, 0xb11690fd118df513ULL,
+	0x6b185517986284daULL, 0xaffbd9f2f40306bdULL,
+	0x7e909366f0121683ULL, 0xf5e666c3d38d3859ULL,
+	0x3e28dc16e15ceaaeULL, 0xc5f444f4ea130c79ULL,
+	0x398a1de05b531288ULL, 0xb84fcdd5bb7508b4ULL,
+	0x3fc4ac703275fc72ULL, 0x3f7208721e8d311dULL,
+	0x856598d0b2397a4bULL, 0xdefc4e3152b9e0b5ULL,
+	0x3bfc370e7d3da26dULL, 0x7683667917eaa8e9ULL,
+	0xa6c66548dc6064c8ULL, 0xd982358b6794f6ffULL,
+	0xbc3042c9385299b1ULL, 0xc97ac101d61a276fULL,
+	0x3b172460ad689d8aULL, 0x68b612e72af130cdULL,
+	0xeffb05fad9c6fe44ULL, 0x4c49cb4122cfde24ULL,
+	0x38dad7a49324f08fULL, 0xa10e60bca82fcccaULL,
+	0xe4ff47182459ef74ULL, 0x05bb8f8a4bdd66e2ULL,
+	0x109a8c6f34e70f30ULL, 0xff312904cbfeb9aaULL,
+	0x0ea4d9c0a88baa73ULL, 0x34f75daacf65ca04ULL,
+	0xf4c7242dd9d7312dULL, 0x40a78bfcc3a67ff1ULL,
+	0x5da7b2344033c867ULL, 0xa548de850a091a62ULL,
+	0x267b41064ed105baULL, 0xc0add303486a39b6ULL,
+	0xb66c05a615bda860ULL, 0xe36cb62d1ffea3b6ULL,
+	0x7e86ef553f0cc5a1ULL, 0x7547325e5c5153c9ULL,
+	0x3dc27ff51a3710e3ULL, 0xa84793ad96df15cfULL,
+	0x0fe93a131faddb26ULL, 0xbb2f83dc3936f5c1ULL,
+	0x0fd3a84e20d6c52dULL, 0x805b72488281f8cdULL,
+	0x2452283973d90098ULL, 0x883638e9651c9ef1ULL,
+	0xd7364b99bd8db88fULL, 0x4eb4de159850ddc5ULL,
+	0x880b16ad7a4e0addULL, 0x5cca4d313ab5e128ULL,
+	0x14b2cb96a365e87cULL, 0x51aba491df0a6375ULL,
+	0x5b964717df443817ULL, 0xef6e164e2e2dc0c4ULL,
+	0xe94a4d5853cd2addULL, 0xe0cba7940e2497aeULL,
+	0xffa3911e1e05c033ULL, 0xe69077cbdadb84f4ULL,
+	0x03937aa2ec83b9ccULL, 0xfb21fdc01de86337ULL,
+	0x670e7fb670d4256dULL, 0xed0e3977944e69ccULL,
+	0xcd673f4ad081042bULL, 0xcf3fb660836c4febULL,
+	0x969da6a0112c7316ULL, 0x6559232d941c09daULL,
+	0x48308f931c44caebULL, 0xe4a89f918064f05dULL,
+	0x33aa550eef3c68a6ULL, 0x41f0d5bc9f8ec319ULL,
+	0xfa397bdeb0b81647ULL, 0xaba9307658ad0f07ULL,
+	0xb7da5f77d8be566cULL, 0x9f08bbd18ec9ae3dULL,
+	0xbec224377e15b5c5ULL, 0x85cca722325d94dfULL,
+	0x2a506a6c7bb28799ULL, 0x4ffc3640f72d928dULL,
+	0x2fd1881f746d8618ULL, 0x44f8b215186f70c2ULL,
+	0xf3457d66c9aa18edULL, 0xf14c4fb9a3dd6f53ULL,
+	0x18eee13bc052a803ULL, 0xa7c9a52532706b20ULL,
+	0xb9966e5ee44b96d9ULL, 0xbf55fd6ca9e6ad79ULL,
+	0x7cd5d5170a1d99f2ULL, 0x49ec7e64e6a0de93ULL,
+	0xf0729447cbe2cfd2ULL, 0x39f9ca0a2bfb96d6ULL,
+	0xf35d13a42d6d2457ULL, 0xfe21f9048cdcf238ULL,
+	0x8fcb842aa888a1f5ULL, 0x7be34c0103643234ULL,
+	0x7718cb9955612ae1ULL, 0x193c95b50cacf08bULL,
+	0xbf2020cb25a04808ULL, 0xd92aef9a15ce97d8ULL,
+	0x314687d35d7a9372ULL, 0x3484584ff5f023c8ULL,
+	0x54f88067cf8a1c08ULL, 0xee96dd1dbbbe860bULL,
+	0x809873bcbd14ecc0ULL, 0x55240730aa4f8344ULL,
+	0xcdc16d0ce3685f3fULL, 0x58d576d7c3d85055ULL,
+	0xc0e10e8a996e8f43ULL, 0x0bd0c9c6914e576eULL,
+	0x809c25fe455df3e2ULL, 0x9764ad9c11a94b25ULL,
+	0x823f701cbee049efULL, 0x2aee748aa1f76f05ULL,
+	0x630a3d693540cf34ULL, 0x1d4297860dd57206ULL,
+	0x8d0cc91845d53975ULL, 0x7b4a38d8ba03fd44ULL,
+	0x6742cbb024b78164ULL, 0xf8c3c4e48dca39afULL,
+	0xf7d700aa90741918ULL, 0x3487b1bdb7b82fa4ULL,
+	0xe03937fa3598c906ULL, 0x73a0421333ec8d3bULL,
+	0x0c9d6e82a99d7d74ULL, 0xc190aaa003277eabULL,
+	0x6184eebc3cbf3b33ULL, 0x975e136d948ab806ULL,
+	0xf011467c172c93f5ULL, 0x7b63db1829cc3fbcULL,
+	0xde2f94587820969cULL, 0x0a7e1dff7f5bd76dULL,
+	0xcefed7d88c925776ULL, 0x8ed6be52de0c0322ULL,
+	0xa9b2b613efa8f3adULL, 0x7e6d47d9dfcf56bcULL,
+};
+
+static inline u_int64_t
+rotl64(u_int64_t x, int r)
+{
+	return (x << (r & 63)) | (x >> (-r & 63));
+}
+
+/* The raw cyclic polynomial is linear (in XOR), so its low and high halves
+ * aren't really independent, and we want to use them as two separate
+ * hashes. One round of xorshift-multiply-xorshift is enough to break that
+ * up (the full murmur3 finalizer measured no better in the Bloom filter
+ * false positive tests, and costs twice as much). The length is thrown in
+ * so equal content of different lengths doesn't land together.
+ */
+static inline u_int64_t
+rollmix64(u_int64_t h, int n)
+{
+	h ^= (u_int64_t)n;
+	h ^= h >> 32;
+	h *= 0xd6e8feb86659fd93ULL;
+	h ^= h >> 32;
+	return h;
+}
+
+/* Fold in one more byte of the prefix */
+#define ROLLSTEP(p, c)	(rotl64((p), 1) ^ rolltable[(c)])
+
+/* One-shot hash of a whole buffer. Same value roll_64_next gives for
+ * the same bytes at any offset.
+ */
+u_int64_t
+roll_64_buf(void *buf, size_t len)
+{
+	u_int8_t *bp = (u_int8_t *)buf;
+	u_int64_t p = 0;
+	size_t i;
+
+	for (i=0; i < len; ++i)
+		p = ROLLSTEP(p, bp[i]);
+	return rollmix64(p, (int)len);
+}
+
+void
+roll_64_init(Roll64 *roll, void *buf, size_t len, int low, int high)
+{
+	if (low < 1) low = 1;
+	if (high > ROLL_MAXN) high = ROLL_MAXN;
+	roll->buf = (u_int8_t *)buf;
+	roll->len = len;
+	roll->offset = 0;
+	roll->low = low;
+	roll->high = high;
+	roll->done = 0;
+	roll->p[0] = 0;
+}
+
+/* Produce hashes of sizes low..high starting at the current offset,
+ * and advance. The window of size n at offset i is
+ *	H(i,n) = P(i+n) ^ rotl(P(i), n)
+ * where P is the running prefix, so each hash costs one step of the
+ * prefix (shared by all sizes) plus a rotate and an xor.
+ *
+ * Returns the number of hashes produced - fewer than high-low+1 as we
+ * run up against the end of the buffer, and 0 once there's nothing left.
+ */
+int
+roll_64_next(Roll64 *roll, u_int64_t *hvalout)
+{
+	size_t i = roll->offset;
+	size_t done = roll->done;
+	u_int64_t *p = roll->p;
+	u_int64_t base, prefix;
+	int n, low, high;
+
+	low = roll->low;
+	if (i + low > roll->len)
+		return 0;
+	high = roll->high;
+	if (i + high > roll->len)
+		high = (int)(roll->len - i);
+	/* Bring the prefix up to i+high */
+	prefix = p[done & ROLL_RINGMASK];
+	while (done < i + high) {
+		prefix = ROLLSTEP(prefix, roll->buf[done]);
+		p[++done & ROLL_RINGMASK] = prefix;
+	}
+	roll->done = done;
+	roll->offset = i+1;
+	/* Work in locals - hvalout could (as far as the compiler knows)
+	 * point into roll, which would mean a reload every time around.
+	 */
+	base = p[i & ROLL_RINGMASK];
+	for (n=low; n <= high; ++n)
+		hvalout[n-low] = rollmix64(
+			p[(i+n) & ROLL_RINGMASK] ^ rotl64(base, n), n);
+	return high - low + 1;
+}
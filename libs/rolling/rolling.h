@@ -0,0 +1,37 @@
+/* rolling.h - rolling hashes over all the ngrams in a buffer
+ *
+ * fnv_64_buf_range hashes every size in a range at one offset, but has to
+ * start over again at the next offset, so adding all the ngrams of sizes
+ * low..high in a buffer of length L costs about L*high byte steps. A
+ * cyclic polynomial ("buzhash") can instead be slid along the buffer,
+ * and with a running prefix, every (offset, size) pair costs O(1).
+ *
+ * The hashes aren't the same as FNV's, of course, so a filter has to be
+ * built and searched with the same family. See the -F flag in ngram.
+ */
+
+#ifndef _ROLLING_H
+#define _ROLLING_H
+
+/* Largest ngram we can roll over; the ring below must hold high+1 prefixes */
+#define ROLL_MAXN	63
+#define ROLL_RING	64
+#define ROLL_RINGMASK	(ROLL_RING-1)
+
+typedef struct _roll64 {
+	u_int8_t *buf;
+	size_t len;
+	size_t offset;		/* where the next set of hashes starts */
+	size_t done;		/* how far we've taken the prefix */
+	int low, high;		/* range of sizes */
+	u_int64_t p[ROLL_RING];	/* recent prefix values, by position */
+} Roll64;
+
+/* Set up to walk through buf, hashing ngrams of sizes low to high */
+void roll_64_init(Roll64 *roll, void *buf, size_t len, int low, int high);
+/* Hashes for sizes low.. at the next offset; returns how many, 0 at end */
+int roll_64_next(Roll64 *roll, u_int64_t *hvalout);
+/* One-shot version, for lookups */
+u_int64_t roll_64_buf(void *buf, size_t len);
+
+#endif /* _ROLLING_H */
@@ -10,16 +10,22 @@
 #include <netinet/ip.h>
 #include <string.h>
 #include <getopt.h>
+#include <pthread.h>
 #include "ngram.h"
 #include "snortcheck.h"
 #include "snorthostcheck.h"
 #include "taggedhostcheck.h"
 #include "parse.h"
 #include "ymd.h"
+#include "pcapbpf.h"
+#include "select.h"
+#include "entropy.h"
 
 /* entropy related */
 int entropyflag = -1;	/* -1 ignore entropy; 0 out of range; 1 in range */
 DRange entropyrange;
+double entropymargin = -1.0;	/* -1 only stop early when we're sure */
+int entropywindow = 0;	/* 0 take or leave the whole payload */
 
 /* protocol/port related */
 int inprotocols=1;	/* default select */
@@ -43,6 +49,9 @@ struct timeval starttime, endtime;	/* range of packets to look at */
 FILE *dumpfile;
 int dumplevel = 1;
 
+int nthreads = 0;	/* worker threads requested */
+int nupdaters = 0;	/* and updater threads */
+
 #ifdef SHMALLOC
 char *shmfilename;
 int shmmode = (O_CREAT|O_TRUNC);
@@ -72,6 +81,114 @@ readerswitch(int type, struct protoreader *readers)
 	return readers[i].handler;
 }
 
+/* The same, a lookup at a time - see ngram.h */
+static ReaderTable *readertablelist[] = {
+	&ethertable, &transporttable, &porttable, &typetable, &type6table,
+	NULL
+};
+static int nreaderhits;		/* counters per thread */
+
+typedef struct _readerHits {
+	struct _readerHits *next;
+	u_int64_t hits[0];
+} ReaderHits;
+
+static __thread u_int64_t *readerhits;
+static ReaderHits *allreaderhits;
+static pthread_mutex_t readerhitslock = PTHREAD_MUTEX_INITIALIZER;
+
+int
+readertables(void)
+{
+	ReaderTable *t;
+	int i, j;
+
+	nreaderhits = 0;
+	for (i=0; (t = readertablelist[i]); ++i) {
+		for (t->nreaders=0; t->readers[t->nreaders].type != -1;
+				++t->nreaders)
+			;
+		t->base = nreaderhits;
+		nreaderhits += t->nreaders + 1;
+		/* Too many to index with a byte; stick with the walk */
+		if (t->nreaders > 255)
+			continue;
+		if (!(t->index = (u_int8_t *)malloc(t->size)))
+			return -1;
+		memset(t->index, t->nreaders, t->size);
+		/* Backwards, so the first of any duplicates wins, as in
+		 * readerswitch
+		 */
+		for (j = t->nreaders-1; j >= 0; --j) {
+			if (t->readers[j].type >= 0 &&
+					t->readers[j].type < t->size)
+				t->index[t->readers[j].type] = j;
+		}
+	}
+	return 0;
+}
+
+static u_int64_t *
+newreaderhits(void)
+{
+	ReaderHits *rh;
+
+	if (!(rh = (ReaderHits *)calloc(1, sizeof(ReaderHits) +
+			nreaderhits * sizeof(u_int64_t))))
+		return NULL;
+	pthread_mutex_lock(&readerhitslock);
+	rh->next = allreaderhits;
+	allreaderhits = rh;
+	pthread_mutex_unlock(&readerhitslock);
+	return readerhits = rh->hits;
+}
+
+protohandler
+readerdispatch(int type, ReaderTable *t)
+{
+	u_int64_t *hits;
+	int i;
+
+	if (!t->index || type < 0 || type >= t->size)
+		return readerswitch(type, t->readers);
+	i = t->index[type];
+	if ((hits = readerhits) || (hits = newreaderhits()))
+		++hits[t->base + i];
+	return t->readers[i].handler;
+}
+
+/* One line a table, of the readers that got anything */
+void
+readerstats(void)
+{
+	ReaderTable *t;
+	ReaderHits *rh;
+	u_int64_t hits;
+	int i, j, any;
+
+	pthread_mutex_lock(&readerhitslock);
+	for (i=0; (t = readertablelist[i]); ++i) {
+		for (any=0, j=0; t->index && j <= t->nreaders; ++j) {
+			for (hits=0, rh = allreaderhits; rh; rh = rh->next)
+				hits += rh->hits[t->base + j];
+			if (!hits)
+				continue;
+			if (!any++)
+				fprintf(stderr, "Readers by %s:", t->name);
+			if (j < t->nreaders)
+				fprintf(stderr, t == &ethertable ? " %#x %lu" :
+					" %d %lu", t->readers[j].type,
+					(unsigned long)hits);
+			else
+				fprintf(stderr, " other %lu",
+					(unsigned long)hits);
+		}
+		if (any)
+			fprintf(stderr, "\n");
+	}
+	pthread_mutex_unlock(&readerhitslock);
+}
+
 void
 Usage(void)
 {
@@ -86,6 +203,10 @@ fprintf(stderr,
 "\n"
 "-E yes/no	- select/deselect based on entropy\n"
 "-e entropy	- range of entropy to select/deselect\n"
+"-c margin	- decide on part of a payload once its entropy so far is\n"
+"		  this many bits outside the range (a guess, but quicker)\n"
+"-w window	- take only the parts of a payload whose entropy over\n"
+"		  this many bytes is selected\n"
 "\n"
 "-S yes/no	- select packets tagged/not tagged by snort\n"
 "-s d1,d2,...	- directories and/or files of snort alerts to use\n"
@@ -99,8 +220,12 @@ fprintf(stderr,
 "\n"
 "\tlists may also be given as file=<file with list info>\n"
 "\n"
-"-N filter	- which ngram filter to use (bloom, array ...)\n"
+"-N filter	- which ngram filter to use (bloom, blocked, countmin[:rows],\n"
+"		  quotient, array, hash, trie)\n"
 "-n low-high	- range of length of ngrams\n"
+"-F hash		- hash family for hashed filters (rolling, fnv)\n"
+"		- use fnv for filters built before rolling hashes\n"
+"-C bits		- counter width for array and Bloom filters (16, 8, 4)\n"
 "\n"
 "-D dumpfile    - dump filter contents to this file\n"
 "-d dumplevel	- debug level\n"
@@ -108,6 +233,12 @@ fprintf(stderr,
 "-A shmfile	- allocate filter in this (permanent) shared memory region\n"
 "\n"
 "-T start,end	- start and end time of packets to select\n"
+"\n"
+"-j threads	- number of worker threads (each with its own copy\n"
+"		  of the filters, merged at the end)\n"
+"-J updaters	- number of threads to add the ngrams to the filters;\n"
+"		  the -j threads then only read and select packets\n"
+"		- neither works with countmin, whose counts can't be merged\n"
 );
 
 	exit(1);
@@ -139,7 +270,7 @@ handle_arguments(int argc, char **argv)
 	Range ngramsize={0,0};
 
 	while ((c = getopt(argc, argv,
-			"I:P:i:p:S:s:t:H:h:L:l:N:n:E:e:D:d:A:a:T:")) >= 0) {
+			"I:P:i:p:S:s:t:H:h:L:l:N:n:F:C:E:e:c:w:D:d:A:a:T:j:J:")) >= 0) {
 		switch (c) {
 		case 'I':
 			inprotocols = yesno(optarg);
@@ -185,16 +316,25 @@ handle_arguments(int argc, char **argv)
 				ngramtype = NGRAM_BLOOM;
 			} else if (!strncasecmp(optarg, "array", 5)) {
 				ngramtype = NGRAM_ARRAY;
+			} else if (!strncasecmp(optarg, "blocked", 7)) {
+				ngramtype = NGRAM_BLOCKEDBLOOM;
+			} else if (!strncasecmp(optarg, "countmin", 8)) {
+				ngramtype = NGRAM_COUNTMIN;
+				/* countmin:d for d rows */
+				if (optarg[8] == ':')
+					countminrows = atoi(optarg+9);
+				if (countminrows < 1 ||
+						countminrows > COUNTMIN_MAXROWS) {
+					fprintf(stderr, "Count-min rows from 1 to %d\n",
+						COUNTMIN_MAXROWS);
+					Usage();
+				}
+			} else if (!strncasecmp(optarg, "hash", 4)) {
+				ngramtype = NGRAM_HASH;
 			} else if (!strncasecmp(optarg, "quotient", 8)) {
 				ngramtype = NGRAM_QUOTIENT;
-				/*@@*/
-				fprintf(stderr, "Quotient not implemented\n");
-				exit(1);
 			} else if (!strncasecmp(optarg, "trie", 4)) {
 				ngramtype = NGRAM_TRIE;
-				/*@@*/
-				fprintf(stderr, "Trie not implemented\n");
-				exit(1);
 			} else {
 				fprintf(stderr, "Unknown filter %s\n",
 					optarg);
@@ -212,12 +352,37 @@ handle_arguments(int argc, char **argv)
 			}
 			setngramlabel(ngramtype, &ngramsize, 0, 0, 0, 0);
 			break;
+		case 'F':
+			if (!strncasecmp(optarg, "fnv", 3)) {
+				ngramlabel.hashfamily = HASH_FNV;
+			} else if (!strncasecmp(optarg, "rolling", 4)) {
+				ngramlabel.hashfamily = HASH_ROLLING;
+			} else {
+				fprintf(stderr, "Unknown hash %s\n", optarg);
+				Usage();
+			}
+			break;
+		case 'C':
+			ngramlabel.counterbits = atoi(optarg);
+			if (ngramlabel.counterbits != 4 &&
+					ngramlabel.counterbits != 8 &&
+					ngramlabel.counterbits != 16) {
+				fprintf(stderr, "Counters are 4, 8 or 16 bits\n");
+				Usage();
+			}
+			break;
 		case 'E':
 			entropyflag = yesno(optarg);
 			break;
 		case 'e':
 			(void) readdoublerange(optarg, &entropyrange);
 			break;
+		case 'c':
+			entropymargin = atof(optarg);
+			break;
+		case 'w':
+			entropywindow = atoi(optarg);
+			break;
 		case 'D':
 			dumpfile = fopen(optarg, "w");
 			if (!dumpfile) perror(optarg);
@@ -240,12 +405,25 @@ handle_arguments(int argc, char **argv)
 			datemskinit();
 			(void) readtimerange(optarg, &starttime, &endtime);
 			break;
+		case 'j':
+			nthreads = atoi(optarg);
+			break;
+		case 'J':
+			nupdaters = atoi(optarg);
+			break;
 		case '?':
 		default:
 			Usage();
 			break;
 		}
 	}
+	/* Conservative update can't be merged (see countmin.c), so the
+	 * counts would depend on how the packets were split among threads
+	 */
+	if (ngram == &countmin && (nthreads > 0 || nupdaters > 0)) {
+		fprintf(stderr, "Count-min can't be used with -j or -J\n");
+		Usage();
+	}
 	return optind;
 }
 
@@ -253,11 +431,11 @@ void
 main(int argc, char **argv)
 {
 	pcap_t *readp;
-	FILE *fp;
 	int i;
 	char errbuf[PCAP_ERRBUF_SIZE];
 	long int totalcount = 0L;
 	int readpcap(pcap_t *readp, int *flag);
+	int readpcapfile(char *filename, int *flag);
 	void flushpackets(void);
 	double mu, sigma;
 	u_int64_t max, min;
@@ -293,6 +471,22 @@ main(int argc, char **argv)
 		if (taggedhosts)
 			(void) readtaggedhosts(taggedhosts);
 	}
+	/* What of that we can check before decoding (see pcapbpf.h and
+	 * select.h)
+	 */
+	if (selectbpf(&selectfilter) < 0)
+		fprintf(stderr, "Couldn't compile the selection filter\n");
+	else if (dumplevel > 1)
+		fprintf(stderr, "Selection filter: %d instructions\n",
+			selectfilter.bf_len);
+	if (selectcompile() < 0) {
+		perror("Compiling the selection");
+		exit(1);
+	}
+	if (readertables() < 0) {
+		perror("Building the reader tables");
+		exit(1);
+	}
 
 	if (!(ngram->f =
 #ifdef SHMALLOC
@@ -305,24 +499,18 @@ main(int argc, char **argv)
 		perror("Allocating ngram filters");
 		exit(1);
 	}
+	(void) ngramthreadstart(nthreads, nupdaters);
 
 
 	/* Read and process all the capture files */
 	if (i < argc) {
+		/* With threads, enough files go to the workers whole;
+		 * fewer get split up between them as they're read.
+		 */
+		if (argc-i > 1 && ngramthreadfiles(argc-i, argv+i, &atend) == 0)
+			i = argc;
 		for (; i < argc; ++i) {
-			fp = fopen(argv[i], "r");
-			if (!fp) {
-				perror(argv[i]);
-				continue;
-			}
-			readp = pcap_fopen_offline(fp, errbuf);
-			if (!readp) {
-				perror(errbuf);
-				continue;
-			}
-			totalcount += readpcap(readp, &atend);
-			pcap_close(readp);
-			/* Note - pcap_close includes an fclose, somehow */
+			totalcount += readpcapfile(argv[i], &atend);
 			/* We'll do one more file after the first ending,
 			 * in case a few packets are out of sequence.
 			 */
@@ -338,6 +526,15 @@ main(int argc, char **argv)
 		}
 	}
 
+	/* Collect what the threads did, if any */
+	ngramthreadfinish();
+	if (dumplevel > 1) {
+		selectstats();
+		readerstats();
+		if (entropyflag >= 0)
+			entropystats();
+	}
+
 	/* Now go through the accumulated results, dumping ngram info */
 	{
 	int n;
@@ -348,6 +545,8 @@ main(int argc, char **argv)
 			n, mu, sigma, max, min, (sigma*sigma)/mu);
 	}
 	}
+	if (dumpfile)
+		(*ngram->op->dumpset)(dumpfile, ngram->f);
 #ifdef TEST
 	/* Simple mini-tester */
 	while (1) {
@@ -357,10 +556,10 @@ main(int argc, char **argv)
 		int i;
 
 		printf("Lookup? "); gets(line);
-		for (i=ngram->f.ngramsize.min; i <= ngram->f.ngramsize.max; ++i) {
+		for (i=ngram->f->ngramsize.min; i <= ngram->f->ngramsize.max; ++i) {
 			if (strlen(line) < i) continue;
 			count = (*ngram->op->finddist)((void *)line, strlen(line),
-					i, &mu, &sigma, &rho, ngram->f->filter);
+					i, &mu, &sigma, &rho, ngram->f);
 			printf("%d-grams found %d times: ", i, count);
 			printf("Mu %10.8lf sigma %10.8lf rho %10.8lf\n",
 				mu, sigma, rho);
@@ -10,6 +10,8 @@
 
 /* Simple structures and routines for ranges of integers, doubles, etc. */
 #include "range.h"
+/* and entropy, for selecting parts of a packet */
+#include "entropy.h"
 
 /* For now, we'll restrict ngram sizes to < 20 */
 #define NGRAM_RANGEMAX	20
@@ -28,9 +30,12 @@
 
 /* convenience */
 #define min(a,b)	((a)<=(b) ? (a) : (b))
+#define max(a,b)	((a)>=(b) ? (a) : (b))
 
 extern int entropyflag;
 extern DRange entropyrange;
+extern double entropymargin;
+extern int entropywindow;
 /* Evaluators */
 double entropy(u_int8_t *packet, int size);
 
@@ -149,6 +154,19 @@ typedef struct _ngramOps {
 	void	(*diststats)(int ngram, double *mu, double *sigma, u_int64_t *max, u_int64_t *min, NgramFilterSet *filterset);
 	void	(*dumpset)(FILE *file, NgramFilterSet *filterset);
 	void	(*closefilterset)(NgramFilterSet *filterset);
+	/* mergefilterset adds the counts in one filter set into another of
+	 * the same type and size, as if the items that went into "from"
+	 * had gone into "into" instead - counters saturate at COUNTER_MAX,
+	 * and overflows are counted just as they would have been. Used to
+	 * combine the private filters of threads (see V below).
+	 */
+	void	(*mergefilterset)(NgramFilterSet *into, NgramFilterSet *from);
+	/* addcounts is additemset for an item whose byte counts we already
+	 * have (see PacketContext), so the 1-grams needn't be counted
+	 * again. Optional - NULL if the filter can't make use of them.
+	 */
+	int	(*addcounts)(void *item, size_t length, u_int32_t *bytes,
+		NgramFilterSet *filterset);
 } NgramOps;
 
 typedef struct _ngram {
@@ -169,19 +187,26 @@ void ngram_peek(char *filename);
 #endif
 void ngramreadfile(FILE *fp, Ngram *ngram);
 
-/* Our two types for now */
-extern Ngram array, bloom;
-/* Future ones ... */
-extern Ngram quotient, trie;
+/* Our types for now */
+extern Ngram array, bloom, blockedbloom, countmin, hashngram, quotient, trie;
+extern int countminrows;	/* rows in new count-min sketches */
+#define COUNTMIN_ROWS		4	/* default */
+#define COUNTMIN_MAXROWS	16
 /* The one we're using */
 extern Ngram *ngram;
 
 /* For use in labeling the filter */
 #define NGRAM_ARRAY	1
 #define NGRAM_BLOOM	2
-/* @@ future ... */
 #define NGRAM_QUOTIENT	3
 #define NGRAM_TRIE	4
+#define NGRAM_BLOCKEDBLOOM	5
+#define NGRAM_COUNTMIN	6
+#define NGRAM_HASH	7
+
+/* Hash families for the hashed filters (Bloom and relatives) */
+#define HASH_FNV	0	/* FNV-1 64, rehashed at every offset */
+#define HASH_ROLLING	1	/* cyclic polynomial, rolled along the item */
 
 /* When we save to disk or shared memory, we label what we've got for use
  * by other programs (including other instances of this program).
@@ -192,6 +217,13 @@ typedef struct _nGramLabel {
 /* Size is the range of ngram sizes - 1 to 4 for array, up to about 20
  * for Bloom filter */
 	Range ngramsize;
+/* Which hash family the (hashed) filters were built with, and the counter
+ * width (-C; see counter.h). These sit in what used to be padding, so
+ * labels written before they existed read as 0, i.e. FNV and 16 bits,
+ * which is what they were built with.
+ */
+	short hashfamily;
+	short counterbits;	/* 4, 8 or 16; 0 means 16 */
 /* Length is the length (in bytes) of the filters proper */
 	size_t length[NGRAM_RANGEMAX];
 /* Minimal stats */
@@ -204,7 +236,49 @@ extern NgramLabel ngramlabel;
 /* This sets whatever information we have about the filter being used */
 extern void setngramlabel(int type, Range *ngramsize, int ngram, size_t length, size_t total, size_t distinct);
 
-/* @@ not doing threaded version ... */
+/* V. Threads - with -j, the packets are handed off in batches to worker
+ * threads, each of which adds ngrams to its own private filter set (a
+ * "shard"), so no locking or atomics are needed on the counters. At the
+ * end, the shards are merged into the real filters (ngram->f). Since the
+ * merge gives the same counters and overflow counts whatever the order,
+ * the results don't depend on the number of threads. The one exception
+ * is the approximate distinct count for the hashed filters, which can't
+ * be merged, so it's estimated from the final counters instead. (And the
+ * count-min sketch, whose conservative update doesn't merge exactly -
+ * see countmin.c.)
+ *
+ * Memory goes up accordingly - each shard is a full-sized filter set.
+ *
+ * Given several capture files, the workers don't wait for packets, but
+ * take whole files and read them themselves, into their shards. Given
+ * fewer files than workers, the reading thread hands them out in ranges
+ * of records instead of packet by packet.
+ *
+ * With updaters (-J) as well, the workers have no shards: they pass the
+ * items they select on to the updaters, which do the adding.
+ */
+extern int ngramthreads;	/* number of workers; 0 for none */
+extern int ngramupdaters;	/* number of updaters; 0 for none */
+/* How the workers pass items on to them (ngrampipeitem); set when the
+ * pipeline starts, so ngramcommon.c doesn't need ngramthread.c
+ */
+extern int (*ngrampipe)(void *item, size_t length);
+/* The filter set this thread adds to, if not ngram->f */
+extern __thread NgramFilterSet *threadset;
+/* Set in a worker that passes its items on to the updaters */
+extern __thread int threadpipe;
+/* The readers add their items through this, to get the right set */
+int ngramadditem(void *item, size_t length);
+struct _packetContext;
+int ngramaddpacket(struct _packetContext *pc);
+int ngrampipeitem(void *item, size_t length);
+int ngramthreadstart(int nthreads, int nupdaters);
+void ngramthreadpacket(int len, u_int8_t *data);
+struct _pcapMap;
+void ngramthreadrange(struct _pcapMap *pm, size_t start, size_t end);
+void ngramthreadclose(struct _pcapMap *pm);
+int ngramthreadfiles(int nfiles, char **names, int *atend);
+void ngramthreadfinish(void);
 
 /* VI. Protocol readers - There are all kinds of existing structures
  * out there; for now, we'll just use something fairly generic -
@@ -219,8 +293,34 @@ struct readproto {
 	u_int8_t *outheader;
 	u_int8_t *header;
 	int len;
+	struct _packetContext *context;	/* from the transport level up */
 };
 
+/* What's been worked out about a packet's payload, so that everything
+ * that needs it can share one pass over the bytes: the transport readers
+ * set one up, the entropy selection (packetentropy) fills in the byte
+ * counts or the parts to take, and ngramaddpacket gives them to the
+ * filters.
+ *
+ * counted - bytes[] has the counts of all length bytes
+ * nsegments - if not 0, only these parts of the payload are selected
+ *	(-w); PACKET_SEGMENTS at most
+ */
+#define PACKET_SEGMENTS	16
+
+typedef struct _packetContext {
+	u_int8_t *payload;
+	int length;
+	int counted;
+	u_int32_t bytes[OCTETSIZE];
+	int nsegments;
+	EntropySegment segment[PACKET_SEGMENTS];
+} PacketContext;
+
+void packetcontext(PacketContext *pc, u_int8_t *payload, int length);
+/* 0 if the entropy selection (-E) throws the packet out */
+int packetentropy(PacketContext *pc);
+
 /* Handlers are: int (*handler)(struct readproto *, void *src, void *dest) */
 typedef int (*protohandler)(struct readproto *, void *, void *);
 
@@ -231,6 +331,33 @@ struct protoreader {
 
 extern protohandler readerswitch(int type, struct protoreader *readers);
 
+/* readerswitch walks the list every time; for the levels every packet
+ * goes through, readertables turns each list into a table indexed
+ * directly by type, and readerdispatch looks in that instead (or falls
+ * back to readerswitch, if there isn't one). The lists stay the way
+ * readers are added. Each thread counts what it sent where, which
+ * readerstats prints.
+ *
+ * index[type] - which of readers handles it
+ * nreaders - how many there are, up to the -1 entry for the rest
+ * base - where our hit counters start
+ */
+typedef struct _readerTable {
+	char *name;
+	struct protoreader *readers;
+	int size;		/* types go from 0 to size-1 */
+	u_int8_t *index;
+	int nreaders;
+	int base;
+} ReaderTable;
+
+extern ReaderTable ethertable, transporttable, porttable, typetable,
+	type6table;
+
+int readertables(void);
+protohandler readerdispatch(int type, ReaderTable *table);
+void readerstats(void);
+
 /*
  * 1. Application level
  *
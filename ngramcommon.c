@@ -23,12 +23,59 @@
 Ngram *ngram=&bloom;            /* which counter we're using */
 int ngramsize=4;
 
-Ngram quotient, trie;		/* stub types until code is written */
+/* Private filter set of a worker thread - see ngramthread.c */
+__thread NgramFilterSet *threadset;
+/* The updaters, if any, and how to get items to them (ditto) */
+int ngramupdaters = 0;
+int (*ngrampipe)(void *item, size_t length);
 
+/* Add an item's ngrams to this thread's filter set - or, in a pipeline,
+ * have an updater do it.
+ */
+int
+ngramadditem(void *item, size_t length)
+{
+	if (ngramupdaters && !threadset)
+		return (*ngrampipe)(item, length);
+	return (*ngram->op->additemset)(item, length,
+		threadset ? threadset : ngram->f);
+}
+
+void
+packetcontext(PacketContext *pc, u_int8_t *payload, int length)
+{
+	pc->payload = payload;
+	pc->length = length;
+	pc->counted = 0;
+	pc->nsegments = 0;
+}
+
+/* ngramadditem for a packet's payload, with whatever we know about it
+ * (see PacketContext). The updaters in a pipeline only get the bytes.
+ */
+int
+ngramaddpacket(PacketContext *pc)
+{
+	int i, ret=0;
+
+	if (pc->nsegments) {
+		for (i=0; i < pc->nsegments; ++i)
+			ret += ngramadditem(pc->payload + pc->segment[i].start,
+				pc->segment[i].length);
+		return ret;
+	}
+	if (!pc->counted || !ngram->op->addcounts ||
+			(ngramupdaters && !threadset))
+		return ngramadditem(pc->payload, pc->length);
+	return (*ngram->op->addcounts)(pc->payload, pc->length, pc->bytes,
+		threadset ? threadset : ngram->f);
+}
 
 NgramLabel ngramlabel = {
 	NGRAM_BLOOM,
 	{4,4},
+	HASH_ROLLING,	/* new filters roll; old ones say FNV */
+	16,
 	0
 };
 
@@ -61,7 +108,8 @@ ngram_shmalloc(size_t length, char *filename, int mode)
 
 	if (!filename) {
 		shmfile = NULL;
-		return malloc(length);
+		/* Callers expect this zeroed, like a fresh shm file */
+		return calloc(1, length);
 	}
 	mode |= O_RDWR;
 
@@ -107,6 +155,9 @@ ngram_peek(char *filename)
 	/* If we have an ngram label, grab it */
 	if (shf->shfDisk.shdStatic >= sizeof(NgramLabel)) {
 		memcpy(&disklabel, shf->shfStatic, sizeof(NgramLabel));
+		/* Have to search it the way it was built */
+		ngramlabel.hashfamily = disklabel.hashfamily;
+		ngramlabel.counterbits = disklabel.counterbits;
 		/* Import any valid information from it */
 		for (n = disklabel.ngramsize.min;
 				n <= disklabel.ngramsize.max; ++n) {
@@ -124,6 +175,11 @@ ngram_peek(char *filename)
 void
 setngramlabel(int type, Range *ngramsize, int n, size_t length, size_t total, size_t distinct)
 {
+	/* Worker threads' private filters don't get labeled; the label is
+	 * brought up to date when they're merged into the real ones.
+	 */
+	if (threadset)
+		return;
 
 	switch (type) {
 	case 0:
@@ -145,6 +201,18 @@ setngramlabel(int type, Range *ngramsize, int n, size_t length, size_t total, si
 		ngramlabel.type = type;
 		ngram = &trie;
 		break;
+	case NGRAM_BLOCKEDBLOOM:
+		ngramlabel.type = type;
+		ngram = &blockedbloom;
+		break;
+	case NGRAM_COUNTMIN:
+		ngramlabel.type = type;
+		ngram = &countmin;
+		break;
+	case NGRAM_HASH:
+		ngramlabel.type = type;
+		ngram = &hashngram;
+		break;
 	default:
 		fprintf(stderr, "Uhh... what's %d?\n", type);
 		break;
@@ -0,0 +1,800 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <pthread.h>
+#include <sched.h>
+#include <pcap/pcap.h>
+#include "ngram.h"
+#include "pcapmap.h"
+
+/* Threaded ingest (-j). The main thread reads the capture files and does
+ * the time and snort selection, as before, but instead of processing
+ * each packet, it copies it into a batch. Full batches go on a queue,
+ * and worker threads take them off and run them through the usual
+ * readers, adding ngrams to their own private filter set (threadset).
+ *
+ * With more than one file, that leaves the main thread doing all the
+ * reading, so instead the workers each take the next file on the list
+ * and read (and select, and process) it themselves - see
+ * ngramthreadfiles. With fewer files than workers, a file that we can
+ * map (see pcapmap.h) isn't copied out packet by packet: a "batch" is
+ * just a range of its records, which the worker reads in place.
+ *
+ * With -J, it's a pipeline instead: the workers above only read, decode
+ * and select, and the items they would have added (ngramadditem) are
+ * copied into batches of their own and handed on to a second set of
+ * threads, the updaters, which have the shards. The hashing then isn't
+ * held up by the decoding, or vice versa, and the per-stage queue
+ * statistics (-d 2) show which is the bottleneck.
+ *
+ * When the files are done, the shards are merged - pairwise, in parallel,
+ * then the last one into the real filters. See ngram.h for why the order
+ * doesn't matter.
+ */
+
+int ngramthreads = 0;
+__thread int threadpipe;
+
+/* A batch of packets, stored back to back - or, if pm is set, the
+ * records from start to end of that file.
+ */
+#define PKTBATCH	256		/* packets */
+#define PKTBATCHBYTES	(1024*1024)	/* data */
+
+typedef struct _pktBatch {
+	struct _pktBatch *next;
+	PcapMap *pm;
+	size_t start, end;
+	int count;
+	size_t used;
+	int len[PKTBATCH];
+	size_t offset[PKTBATCH];
+	u_int8_t data[PKTBATCHBYTES];
+} PktBatch;
+
+/* The queue - full batches from the reader to the workers, and empty
+ * ones back again. We keep a couple of batches per worker going, so
+ * the reader doesn't get too far ahead.
+ */
+static pthread_mutex_t queuelock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queuefull = PTHREAD_COND_INITIALIZER;	/* work */
+static pthread_cond_t queuefree = PTHREAD_COND_INITIALIZER;	/* space */
+static PktBatch *queuehead, *queuetail;
+static PktBatch *freebatches;
+static int nbatches, maxbatches;
+static int queuedone;
+
+static PktBatch *current;	/* the one the reader is filling */
+
+/* The files, for ngramthreadfiles. These go under the queue lock too.
+ * fileatend[i] is set if file i ran past the end of the time range; we
+ * don't hand out files after stopfile.
+ */
+static pthread_cond_t filefinished = PTHREAD_COND_INITIALIZER;
+static char **files;
+static char *fileatend;
+static int nfiles, nextfile, stopfile, filesdone;
+
+static pthread_t *workers;
+static NgramFilterSet **shards;
+static int nshards;
+
+/* How full the queues were, to see which stage is holding things up.
+ * depth is the total of what each put found already queued, so over puts
+ * it's the mean. full counts the times a producer had to wait for a free
+ * batch (the stage after it is slow), and empty the times a consumer had
+ * to wait for work (the stage before it is).
+ */
+typedef struct _queueStats {
+	size_t puts;
+	size_t depth, maxdepth;
+	size_t full, empty;
+} QueueStats;
+
+static QueueStats readstats;	/* reader to workers, under queuelock */
+static int queued;
+
+/* The pipeline (-J). Batches of items go from the workers to the
+ * updaters through pipering, and back through poolring; they're all
+ * allocated up front, and the rings are big enough to hold all of them,
+ * so a put never finds a ring full, and nothing is allocated after
+ * the start.
+ *
+ * The rings are bounded, lock free, and safe with any number of threads
+ * at each end (after Vyukov): each cell has a sequence number saying
+ * whether it's ready to be filled or emptied on this lap, and a thread
+ * claims the next cell at its end with a compare and swap. The batches
+ * being big, waiting is rare, and we just yield.
+ */
+typedef struct _ringCell {
+	size_t seq;
+	PktBatch *batch;
+} RingCell;
+
+typedef struct _batchRing {
+	RingCell *cell;
+	size_t mask;
+	size_t head __attribute__((aligned(64)));	/* next to take */
+	size_t tail __attribute__((aligned(64)));	/* next to fill */
+} BatchRing;
+
+#define PIPESPIN	64	/* yields before we start sleeping */
+#define PIPESLEEP	100	/* usec */
+
+static BatchRing pipering, poolring;
+static PktBatch *pipebatches;
+static int npipebatches;
+static pthread_t *updaters;
+static int pipedone;
+static QueueStats pipestats;	/* workers to updaters, atomically */
+static pthread_mutex_t biglock = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread PktBatch *pipeout;	/* the one this thread is filling */
+
+/* Shards are always in ordinary memory, even if the real filters are in
+ * a shared memory file. ngram_shmalloc and ngram_shmfree keep track of
+ * the file in shmfile, so we have to keep them from losing it.
+ */
+static NgramFilterSet *
+newshard(void)
+{
+	NgramFilterSet *shard;
+#ifdef SHMALLOC
+	ShmFile *saveshm = shmfile;
+
+	shard = (*ngram->op->newfilterset)(ngramlabel.ngramsize, NULL, 0);
+	shmfile = saveshm;
+#else
+	shard = (*ngram->op->newfilterset)(ngramlabel.ngramsize);
+#endif
+	return shard;
+}
+
+static void
+closeshard(NgramFilterSet *shard)
+{
+#ifdef SHMALLOC
+	ShmFile *saveshm = shmfile;
+
+	shmfile = NULL;
+	(*ngram->op->closefilterset)(shard);
+	shmfile = saveshm;
+#else
+	(*ngram->op->closefilterset)(shard);
+#endif
+}
+
+static int
+ringinit(BatchRing *ring, int n)
+{
+	size_t i, size;
+
+	for (size=1; size < n; size <<= 1)
+		;
+	if (!(ring->cell = (RingCell *)calloc(size, sizeof(RingCell))))
+		return -1;
+	for (i=0; i < size; ++i)
+		ring->cell[i].seq = i;
+	ring->mask = size-1;
+	ring->head = ring->tail = 0;
+	return 0;
+}
+
+/* 0 if it's full */
+static int
+ringput(BatchRing *ring, PktBatch *batch)
+{
+	RingCell *cell;
+	size_t pos, seq;
+
+	pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+	while (1) {
+		cell = &ring->cell[pos & ring->mask];
+		seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+		if (seq == pos) {
+			/* On failure, this picks up the new tail */
+			if (__atomic_compare_exchange_n(&ring->tail, &pos,
+					pos+1, 1, __ATOMIC_RELAXED,
+					__ATOMIC_RELAXED))
+				break;
+		} else if ((long)(seq - pos) < 0)
+			return 0;	/* last lap's, not taken yet */
+		else
+			pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+	}
+	cell->batch = batch;
+	__atomic_store_n(&cell->seq, pos+1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+/* NULL if it's empty */
+static PktBatch *
+ringget(BatchRing *ring)
+{
+	RingCell *cell;
+	PktBatch *batch;
+	size_t pos, seq;
+
+	pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+	while (1) {
+		cell = &ring->cell[pos & ring->mask];
+		seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+		if (seq == pos+1) {
+			if (__atomic_compare_exchange_n(&ring->head, &pos,
+					pos+1, 1, __ATOMIC_RELAXED,
+					__ATOMIC_RELAXED))
+				break;
+		} else if ((long)(seq - (pos+1)) < 0)
+			return NULL;	/* not filled yet */
+		else
+			pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+	}
+	batch = cell->batch;
+	__atomic_store_n(&cell->seq, pos+ring->mask+1, __ATOMIC_RELEASE);
+	return batch;
+}
+
+static size_t
+ringdepth(BatchRing *ring)
+{
+	return __atomic_load_n(&ring->tail, __ATOMIC_RELAXED) -
+		__atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+}
+
+static void
+pipewait(int *spins)
+{
+	if (++*spins < PIPESPIN)
+		sched_yield();
+	else
+		usleep(PIPESLEEP);
+}
+
+/* A free batch for pipeout */
+static PktBatch *
+pipeget(void)
+{
+	PktBatch *batch;
+	int spins=0;
+
+	while (!(batch = ringget(&poolring))) {
+		if (!spins)
+			(void) __atomic_add_fetch(&pipestats.full, 1,
+				__ATOMIC_RELAXED);
+		pipewait(&spins);
+	}
+	batch->count = 0;
+	batch->used = 0;
+	return batch;
+}
+
+/* Hand pipeout to the updaters */
+static void
+pipeput(void)
+{
+	size_t depth, max;
+	int spins=0;
+
+	depth = ringdepth(&pipering);
+	(void) __atomic_add_fetch(&pipestats.puts, 1, __ATOMIC_RELAXED);
+	(void) __atomic_add_fetch(&pipestats.depth, depth, __ATOMIC_RELAXED);
+	max = __atomic_load_n(&pipestats.maxdepth, __ATOMIC_RELAXED);
+	while (depth > max && !__atomic_compare_exchange_n(&pipestats.maxdepth,
+			&max, depth, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+	while (!ringput(&pipering, pipeout))
+		pipewait(&spins);
+	pipeout = NULL;
+}
+
+/* Pass an item on to the updaters (see ngramadditem) */
+int
+ngrampipeitem(void *item, size_t length)
+{
+	int ret;
+
+	/* Anything too big for a batch goes straight into the real
+	 * filters, which the updaters don't touch till the merge.
+	 */
+	if (length > PKTBATCHBYTES) {
+		pthread_mutex_lock(&biglock);
+		ret = (*ngram->op->additemset)(item, length, ngram->f);
+		pthread_mutex_unlock(&biglock);
+		return ret;
+	}
+	if (pipeout && (pipeout->count >= PKTBATCH ||
+			pipeout->used + length > PKTBATCHBYTES))
+		pipeput();
+	if (!pipeout)
+		pipeout = pipeget();
+	pipeout->len[pipeout->count] = length;
+	pipeout->offset[pipeout->count] = pipeout->used;
+	memcpy(pipeout->data + pipeout->used, item, length);
+	pipeout->used += length;
+	++pipeout->count;
+	return 0;
+}
+
+/* Pass on whatever this thread has left */
+static void
+pipeflush(void)
+{
+	int spins=0;
+
+	if (!pipeout)
+		return;
+	if (pipeout->count)
+		pipeput();
+	else {
+		while (!ringput(&poolring, pipeout))
+			pipewait(&spins);
+		pipeout = NULL;
+	}
+}
+
+static void *
+ngramupdater(void *arg)
+{
+	PktBatch *batch;
+	int i, spins=0;
+
+	threadset = (NgramFilterSet *)arg;
+	while (1) {
+		if (!(batch = ringget(&pipering))) {
+			/* Nothing more is coming once it's done, but
+			 * something may have come just before.
+			 */
+			if (__atomic_load_n(&pipedone, __ATOMIC_ACQUIRE) &&
+					!(batch = ringget(&pipering)))
+				break;
+			if (!batch) {
+				if (!spins)
+					(void) __atomic_add_fetch(
+						&pipestats.empty, 1,
+						__ATOMIC_RELAXED);
+				pipewait(&spins);
+				continue;
+			}
+		}
+		spins = 0;
+		for (i=0; i < batch->count; ++i)
+			(void) (*ngram->op->additemset)(
+				batch->data + batch->offset[i],
+				batch->len[i], threadset);
+		while (!ringput(&poolring, batch))
+			pipewait(&spins);
+		spins = 0;
+	}
+	return NULL;
+}
+
+/* The main loop does one file after another, and stops one file after
+ * the first that runs past the end of the time range (see readpcap).
+ * The files finish in any order here, so the best we can do is stop
+ * handing them out after the second that has run past the end so far;
+ * if there's an earlier one still going that also does, a file or two
+ * past the real stopping point may get read. That only makes any
+ * difference if the files are out of time order, and then the atend
+ * business is dubious anyway.
+ */
+/* Called, and returns, with the queue lock held */
+static void
+readfile(int i)
+{
+	int atend=0, ends, j;
+	int readpcapfile(char *filename, int *atend);
+
+	pthread_mutex_unlock(&queuelock);
+	(void) readpcapfile(files[i], &atend);
+	pthread_mutex_lock(&queuelock);
+	fileatend[i] = (atend > 0);
+	for (j=0, ends=0; j < nfiles; ++j) {
+		if (fileatend[j] && ++ends == 2) {
+			stopfile = min(stopfile, j+1);
+			break;
+		}
+	}
+	++filesdone;
+	pthread_cond_signal(&filefinished);
+}
+
+static void *
+ngramworker(void *arg)
+{
+	PktBatch *batch;
+	int i;
+	int process_packet(int len, u_int8_t *data);
+	int readpcaprange(PcapMap *pm, size_t start, size_t end);
+
+	threadset = (NgramFilterSet *)arg;
+	threadpipe = (ngramupdaters > 0);
+	while (1) {
+		pthread_mutex_lock(&queuelock);
+		if (!queuehead && !queuedone && nextfile >= stopfile)
+			++readstats.empty;
+		while (!queuehead && !queuedone && nextfile >= stopfile)
+			pthread_cond_wait(&queuefull, &queuelock);
+		if (nextfile < stopfile) {
+			readfile(nextfile++);
+			pthread_mutex_unlock(&queuelock);
+			continue;
+		}
+		batch = queuehead;
+		if (batch) {
+			queuehead = batch->next;
+			if (!queuehead)
+				queuetail = NULL;
+			--queued;
+		}
+		pthread_mutex_unlock(&queuelock);
+		if (!batch)
+			break;		/* done, and nothing left */
+
+		if (batch->pm)
+			(void) readpcaprange(batch->pm, batch->start,
+				batch->end);
+		for (i=0; i < batch->count; ++i)
+			(void) process_packet(batch->len[i],
+				batch->data + batch->offset[i]);
+
+		pthread_mutex_lock(&queuelock);
+		if (batch->pm && !--batch->pm->refs && batch->pm->closing)
+			pcapmapclose(batch->pm);
+		batch->next = freebatches;
+		freebatches = batch;
+		pthread_cond_signal(&queuefree);
+		pthread_mutex_unlock(&queuelock);
+	}
+	pipeflush();
+	return NULL;
+}
+
+/* Get an empty batch, waiting for one if we have to */
+static PktBatch *
+getbatch(void)
+{
+	PktBatch *batch = NULL;
+
+	pthread_mutex_lock(&queuelock);
+	if (!freebatches && nbatches >= maxbatches)
+		++readstats.full;
+	while (!freebatches && nbatches >= maxbatches)
+		pthread_cond_wait(&queuefree, &queuelock);
+	if (freebatches) {
+		batch = freebatches;
+		freebatches = batch->next;
+	} else {
+		batch = (PktBatch *)malloc(sizeof(PktBatch));
+		if (batch)
+			++nbatches;
+	}
+	pthread_mutex_unlock(&queuelock);
+	if (batch) {
+		batch->next = NULL;
+		batch->pm = NULL;
+		batch->count = 0;
+		batch->used = 0;
+	}
+	return batch;
+}
+
+static void
+putbatch(PktBatch *batch)
+{
+	pthread_mutex_lock(&queuelock);
+	if (queuetail)
+		queuetail->next = batch;
+	else
+		queuehead = batch;
+	queuetail = batch;
+	++readstats.puts;
+	readstats.depth += queued;
+	readstats.maxdepth = max(readstats.maxdepth, queued);
+	++queued;
+	pthread_cond_signal(&queuefull);
+	pthread_mutex_unlock(&queuelock);
+}
+
+/* Start the updaters, and the pipeline for them. Returns the number
+ * started.
+ */
+static int
+pipestart(int nupdaters, int nthreads)
+{
+	int i;
+
+	/* Two each, and one for each thread filling one */
+	npipebatches = 2*nupdaters + 2*nthreads + 1;
+	updaters = (pthread_t *)calloc(nupdaters, sizeof(pthread_t));
+	pipebatches = (PktBatch *)calloc(npipebatches, sizeof(PktBatch));
+	if (!updaters || !pipebatches || ringinit(&pipering, npipebatches) ||
+			ringinit(&poolring, npipebatches)) {
+		perror("pipestart");
+		return 0;
+	}
+	for (i=0; i < npipebatches; ++i)
+		(void) ringput(&poolring, &pipebatches[i]);
+	pipedone = 0;
+	for (i=0; i < nupdaters; ++i) {
+		if (!(shards[i] = newshard())) {
+			fprintf(stderr, "Couldn't allocate filters for updater %d\n",
+				i);
+			break;
+		}
+		if (pthread_create(&updaters[i], NULL, ngramupdater,
+				(void *)shards[i])) {
+			perror("pthread_create");
+			closeshard(shards[i]);
+			shards[i] = NULL;
+			break;
+		}
+	}
+	if (i < nupdaters && dumplevel > 0)
+		fprintf(stderr, "Running with %d updaters\n", i);
+	return i;
+}
+
+/* Set up shards and start the workers, and the updaters if there are to
+ * be any. Returns the number of workers started, which is 0 if we
+ * couldn't get going (and will just do things unthreaded), or if there
+ * are only updaters.
+ */
+int
+ngramthreadstart(int nthreads, int nupdaters)
+{
+	int i;
+
+	if (nthreads < 0)
+		nthreads = 0;
+	if (nupdaters < 0)
+		nupdaters = 0;
+	if (!nthreads && !nupdaters)
+		return 0;
+	workers = (pthread_t *)calloc(nthreads+1, sizeof(pthread_t));
+	shards = (NgramFilterSet **)calloc(max(nthreads, nupdaters),
+		sizeof(NgramFilterSet *));
+	if (!workers || !shards) {
+		perror("ngramthreadstart");
+		return 0;
+	}
+	/* Without the updaters, the workers have the shards */
+	if (nupdaters) {
+		nshards = ngramupdaters = pipestart(nupdaters, nthreads);
+		ngrampipe = ngrampipeitem;
+	}
+	maxbatches = 2*nthreads;
+	queuedone = 0;
+	for (i=0; i < nthreads; ++i) {
+		if (!ngramupdaters && !(shards[i] = newshard())) {
+			fprintf(stderr, "Couldn't allocate filters for thread %d\n",
+				i);
+			break;
+		}
+		if (pthread_create(&workers[i], NULL, ngramworker,
+				ngramupdaters ? NULL : (void *)shards[i])) {
+			perror("pthread_create");
+			if (!ngramupdaters) {
+				closeshard(shards[i]);
+				shards[i] = NULL;
+			}
+			break;
+		}
+	}
+	if (i < nthreads && dumplevel > 0)
+		fprintf(stderr, "Running with %d threads\n", i);
+	if (!ngramupdaters)
+		nshards = i;
+	ngramthreads = i;
+	return i;
+}
+
+/* Hand a packet off to the workers */
+void
+ngramthreadpacket(int len, u_int8_t *data)
+{
+	int process_packet(int len, u_int8_t *data);
+
+	if (len <= 0)
+		return;
+	/* Anything too big for a batch we just do here; the real filters
+	 * are fair game until the merge.
+	 */
+	if (len > PKTBATCHBYTES) {
+		(void) process_packet(len, data);
+		return;
+	}
+	if (current && (current->count >= PKTBATCH ||
+			current->used + len > PKTBATCHBYTES)) {
+		putbatch(current);
+		current = NULL;
+	}
+	if (!current && !(current = getbatch())) {
+		(void) process_packet(len, data);
+		return;
+	}
+	current->len[current->count] = len;
+	current->offset[current->count] = current->used;
+	memcpy(current->data + current->used, data, len);
+	current->used += len;
+	++current->count;
+}
+
+/* Have the workers read a list of files, and wait till they're done.
+ * atend is as the main loop would leave it. Returns -1 if we couldn't,
+ * or there aren't enough files to keep the workers busy, so the caller
+ * can do them itself.
+ */
+int
+ngramthreadfiles(int n, char **names, int *atend)
+{
+	int i, ends=0;
+
+	/* Too few to go round; better to split them up */
+	if (n < ngramthreads)
+		return -1;
+	if (!ngramthreads || !(fileatend = (char *)calloc(n, 1)))
+		return -1;
+	pthread_mutex_lock(&queuelock);
+	files = names;
+	nfiles = stopfile = n;
+	nextfile = filesdone = 0;
+	pthread_cond_broadcast(&queuefull);
+	while (nextfile < stopfile || filesdone < nextfile)
+		pthread_cond_wait(&filefinished, &queuelock);
+	for (i=0; i < stopfile; ++i)
+		ends += fileatend[i];
+	*atend += ends;
+	nfiles = nextfile = stopfile = 0;
+	files = NULL;
+	pthread_mutex_unlock(&queuelock);
+	free(fileatend);
+	fileatend = NULL;
+	return 0;
+}
+
+/* Hand a range of a mapped file's records off to the workers */
+void
+ngramthreadrange(PcapMap *pm, size_t start, size_t end)
+{
+	PktBatch *batch;
+	int readpcaprange(PcapMap *pm, size_t start, size_t end);
+
+	if (!(batch = getbatch())) {
+		(void) readpcaprange(pm, start, end);
+		return;
+	}
+	batch->pm = pm;
+	batch->start = start;
+	batch->end = end;
+	pthread_mutex_lock(&queuelock);
+	++pm->refs;
+	pthread_mutex_unlock(&queuelock);
+	putbatch(batch);
+}
+
+/* Close a file that we've been handing out, once the workers are done */
+void
+ngramthreadclose(PcapMap *pm)
+{
+	pthread_mutex_lock(&queuelock);
+	if (pm->refs)
+		pm->closing = 1;
+	else
+		pcapmapclose(pm);
+	pthread_mutex_unlock(&queuelock);
+}
+
+/* Merge shards[i+step] into shards[i] */
+typedef struct _mergeJob {
+	NgramFilterSet *into, *from;
+} MergeJob;
+
+static void *
+mergeworker(void *arg)
+{
+	MergeJob *job = (MergeJob *)arg;
+
+	(*ngram->op->mergefilterset)(job->into, job->from);
+	return NULL;
+}
+
+static void
+queuestats(char *name, QueueStats *qs, char *producer, char *consumer)
+{
+	fprintf(stderr, "%s queue: %lu batches, depth mean %.2f max %lu; "
+		"%s waited %lu times, %s %lu\n", name,
+		(unsigned long)qs->puts,
+		qs->puts ? (double)qs->depth/qs->puts : 0.0,
+		(unsigned long)qs->maxdepth, producer, (unsigned long)qs->full,
+		consumer, (unsigned long)qs->empty);
+}
+
+/* Finish off the queue, wait for the workers, and merge everything into
+ * the real filters.
+ */
+void
+ngramthreadfinish(void)
+{
+	int i, step, njobs;
+	PktBatch *batch;
+	pthread_t *mergers;
+	MergeJob *jobs;
+
+	if (!nshards)
+		return;
+	if (current && current->count)
+		putbatch(current);
+	else if (current)
+		free(current);
+	current = NULL;
+	pthread_mutex_lock(&queuelock);
+	queuedone = 1;
+	pthread_cond_broadcast(&queuefull);
+	pthread_mutex_unlock(&queuelock);
+	for (i=0; i < ngramthreads; ++i)
+		pthread_join(workers[i], NULL);
+	while ((batch = freebatches)) {
+		freebatches = batch->next;
+		free(batch);
+	}
+	nbatches = 0;
+	if (ngramthreads && dumplevel > 1)
+		queuestats("Read", &readstats, "reader", "workers");
+
+	/* Then the updaters, once everything's been passed on (including
+	 * anything we did here)
+	 */
+	if (ngramupdaters) {
+		pipeflush();
+		__atomic_store_n(&pipedone, 1, __ATOMIC_RELEASE);
+		for (i=0; i < ngramupdaters; ++i)
+			pthread_join(updaters[i], NULL);
+		if (dumplevel > 1)
+			queuestats("Update", &pipestats, "workers",
+				"updaters");
+		free(pipering.cell);
+		free(poolring.cell);
+		free(pipebatches);
+		free(updaters);
+		pipebatches = NULL;
+		updaters = NULL;
+		ngramupdaters = 0;
+	}
+
+	/* Merge pairwise, each round in parallel, down to shards[0] */
+	mergers = (pthread_t *)calloc(nshards, sizeof(pthread_t));
+	jobs = (MergeJob *)calloc(nshards, sizeof(MergeJob));
+	for (step=1; mergers && jobs && step < nshards; step *= 2) {
+		njobs = 0;
+		for (i=0; i+step < nshards; i += 2*step) {
+			jobs[njobs].into = shards[i];
+			jobs[njobs].from = shards[i+step];
+			if (pthread_create(&mergers[njobs], NULL, mergeworker,
+					(void *)&jobs[njobs]))
+				mergeworker((void *)&jobs[njobs]);
+			else
+				++njobs;
+		}
+		for (i=0; i < njobs; ++i)
+			pthread_join(mergers[i], NULL);
+		for (i=0; i+step < nshards; i += 2*step) {
+			closeshard(shards[i+step]);
+			shards[i+step] = NULL;
+		}
+	}
+	/* Any left (if we couldn't get the memory above) go in directly */
+	for (i=0; i < nshards; ++i) {
+		if (!shards[i]) continue;
+		(*ngram->op->mergefilterset)(ngram->f, shards[i]);
+		closeshard(shards[i]);
+	}
+	free(mergers);
+	free(jobs);
+	free(shards);
+	free(workers);
+	shards = NULL;
+	workers = NULL;
+	ngramthreads = nshards = 0;
+}
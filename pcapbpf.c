@@ -0,0 +1,303 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <pcap/pcap.h>
+#include <net/ethernet.h>
+#include <arpa/inet.h>
+#include <netinet/ip.h>
+#include "ngram.h"
+#include "protocols.h"
+#include "taggedhostcheck.h"
+#include "pcapbpf.h"
+
+/* The selection as a BPF program - see pcapbpf.h */
+
+struct bpf_program selectfilter;
+
+/* Where things are, with an ethernet header and (for the transport
+ * header) whatever IP header length the packet says
+ */
+#define BPF_ETHERTYPE	12
+#define BPF_IP		ETHER_HDR_LEN
+#define BPF_PROTOCOL	(BPF_IP + 9)
+#define BPF_SADDR	(BPF_IP + 12)
+#define BPF_DADDR	(BPF_IP + 16)
+
+/* We generate every conditional jump as a skip over a ja, so we never
+ * have to worry about jt and jf only reaching 255 instructions; the ja
+ * gets a label, which is fixed up at the end.
+ */
+typedef struct _bpfCode {
+	/* fix[i] - insn[i] is a ja with a label in k
+	 * label[l] - where label l is, or -1 till we know
+	 */
+	struct bpf_insn *insn;
+	char *fix;
+	int n, size;
+	int *label;
+	int nlabels, labelsize;
+	int failed;
+} BpfCode;
+
+static void
+emit(BpfCode *c, int code, int jt, int jf, u_int32_t k)
+{
+	struct bpf_insn *insn;
+	char *fix;
+
+	if (c->n >= c->size) {
+		c->size = c->size ? 2*c->size : 256;
+		insn = (struct bpf_insn *)realloc(c->insn,
+			c->size * sizeof(struct bpf_insn));
+		fix = (char *)realloc(c->fix, c->size);
+		if (insn) c->insn = insn;
+		if (fix) c->fix = fix;
+		if (!insn || !fix) {
+			c->failed = 1;
+			c->n = 0;
+			return;
+		}
+	}
+	c->insn[c->n].code = code;
+	c->insn[c->n].jt = jt;
+	c->insn[c->n].jf = jf;
+	c->insn[c->n].k = k;
+	c->fix[c->n] = 0;
+	++c->n;
+}
+
+static int
+newlabel(BpfCode *c)
+{
+	int *label;
+
+	if (c->nlabels >= c->labelsize) {
+		c->labelsize = c->labelsize ? 2*c->labelsize : 64;
+		label = (int *)realloc(c->label, c->labelsize * sizeof(int));
+		if (!label) {
+			c->failed = 1;
+			return 0;
+		}
+		c->label = label;
+	}
+	c->label[c->nlabels] = -1;
+	return c->nlabels++;
+}
+
+static void
+setlabel(BpfCode *c, int l)
+{
+	if (!c->failed)
+		c->label[l] = c->n;
+}
+
+static void
+jump(BpfCode *c, int l)
+{
+	emit(c, BPF_JMP|BPF_JA, 0, 0, l);
+	if (!c->failed)
+		c->fix[c->n-1] = 1;
+}
+
+/* Go to l if the test is true, or false */
+static void
+jumpif(BpfCode *c, int code, u_int32_t k, int l)
+{
+	emit(c, BPF_JMP|code, 0, 1, k);
+	jump(c, l);
+}
+
+static void
+jumpunless(BpfCode *c, int code, u_int32_t k, int l)
+{
+	emit(c, BPF_JMP|code, 1, 0, k);
+	jump(c, l);
+}
+
+/* Go to match if A is in the list (as in inrangelist) */
+static void
+bpfrangelist(BpfCode *c, Rangelist *list, int match)
+{
+	Range *r;
+	int i, next;
+
+	if (!list) {
+		jump(c, match);
+		return;
+	}
+	for (i=0; i < list->nranges; ++i) {
+		r = &list->ranges[i];
+		if (r->max == 0) {		/* open ended */
+			jumpif(c, BPF_JGE|BPF_K, max(r->min, 0), match);
+			continue;
+		}
+		if (r->max < 0 || r->max < r->min)
+			continue;		/* never */
+		next = newlabel(c);
+		if (r->min > 0)
+			jumpunless(c, BPF_JGE|BPF_K, r->min, next);
+		jumpunless(c, BPF_JGT|BPF_K, r->max, match);
+		setlabel(c, next);
+	}
+}
+
+/* Carry on if inrangelist(A, list) == in, else go to reject */
+static void
+bpfselect(BpfCode *c, Rangelist *list, int in, int reject)
+{
+	int match = newlabel(c), next = newlabel(c);
+
+	bpfrangelist(c, list, match);
+	jump(c, in ? reject : next);
+	setlabel(c, match);
+	if (!in)
+		jump(c, reject);
+	setlabel(c, next);
+}
+
+/* Binary search for A among hosts[lo..hi) */
+static void
+bpfhosts(BpfCode *c, u_int32_t *hosts, int lo, int hi, int found,
+	int notfound)
+{
+	int mid, right;
+
+	if (lo >= hi) {
+		jump(c, notfound);
+		return;
+	}
+	mid = lo + (hi-lo)/2;
+	right = newlabel(c);
+	jumpif(c, BPF_JEQ|BPF_K, hosts[mid], found);
+	jumpif(c, BPF_JGT|BPF_K, hosts[mid], right);
+	bpfhosts(c, hosts, lo, mid, found, notfound);
+	setlabel(c, right);
+	bpfhosts(c, hosts, mid+1, hi, found, notfound);
+}
+
+static int
+hostcmp(const void *a, const void *b)
+{
+	u_int32_t ha = *(u_int32_t *)a, hb = *(u_int32_t *)b;
+
+	return ha < hb ? -1 : ha > hb;
+}
+
+/* The tagged hosts (see readipv4), if there aren't too many */
+static void
+bpftagged(BpfCode *c, int reject)
+{
+	extern struct in_addr taggedhosts[];
+	extern int maxhosts;
+	u_int32_t *hosts;
+	int i, dst, tagged, untagged, ok;
+
+	if (taggedhostflag < 0 || maxhosts > BPF_MAXHOSTS)
+		return;
+	if (!(hosts = (u_int32_t *)malloc((maxhosts+1) * sizeof(u_int32_t))))
+		return;
+	/* BPF loads are in host order */
+	for (i=0; i < maxhosts; ++i)
+		hosts[i] = ntohl(taggedhosts[i].s_addr);
+	qsort(hosts, maxhosts, sizeof(u_int32_t), hostcmp);
+	dst = newlabel(c);
+	tagged = newlabel(c);
+	untagged = newlabel(c);
+	ok = newlabel(c);
+	emit(c, BPF_LD|BPF_W|BPF_ABS, 0, 0, BPF_SADDR);
+	bpfhosts(c, hosts, 0, maxhosts, tagged, dst);
+	setlabel(c, dst);
+	emit(c, BPF_LD|BPF_W|BPF_ABS, 0, 0, BPF_DADDR);
+	bpfhosts(c, hosts, 0, maxhosts, tagged, untagged);
+	setlabel(c, tagged);
+	jump(c, taggedhostflag ? ok : reject);
+	setlabel(c, untagged);
+	jump(c, taggedhostflag ? reject : ok);
+	setlabel(c, ok);
+	free(hosts);
+}
+
+/* Compile the selection into prog. -1 (and an empty program) if we
+ * couldn't.
+ */
+int
+selectbpf(struct bpf_program *prog)
+{
+	BpfCode code, *c = &code;
+	int reject, accept, tcpudp, icmp, port;
+	int i;
+
+	memset(c, 0, sizeof(code));
+	reject = newlabel(c);
+	accept = newlabel(c);
+	tcpudp = newlabel(c);
+	icmp = newlabel(c);
+	port = newlabel(c);
+
+	/* IPv4 is all the readers look at */
+	emit(c, BPF_LD|BPF_H|BPF_ABS, 0, 0, BPF_ETHERTYPE);
+	jumpunless(c, BPF_JEQ|BPF_K, ETHERTYPE_IP, reject);
+
+	/* Then in readipv4's order: protocol, hosts */
+	emit(c, BPF_LD|BPF_B|BPF_ABS, 0, 0, BPF_PROTOCOL);
+	bpfselect(c, protocols, inprotocols, reject);
+	bpftagged(c, reject);
+
+	/* Only these go on to add anything (IP in IP goes round again, so
+	 * we leave it to readipv4)
+	 */
+	emit(c, BPF_LD|BPF_B|BPF_ABS, 0, 0, BPF_PROTOCOL);
+	jumpif(c, BPF_JEQ|BPF_K, TCP_PROTO, tcpudp);
+	jumpif(c, BPF_JEQ|BPF_K, UDP_PROTO, tcpudp);
+	jumpif(c, BPF_JEQ|BPF_K, ICMP_PROTO, icmp);
+	jumpif(c, BPF_JEQ|BPF_K, IPV4_PROTO, accept);
+	jump(c, reject);
+
+	/* tcp and udp: the lower numbered port (as in readtcp) */
+	setlabel(c, tcpudp);
+	if (!ports && inports)
+		jump(c, accept);
+	emit(c, BPF_LDX|BPF_B|BPF_MSH, 0, 0, BPF_IP);
+	emit(c, BPF_LD|BPF_H|BPF_IND, 0, 0, BPF_IP);
+	emit(c, BPF_ST, 0, 0, 0);
+	emit(c, BPF_LD|BPF_H|BPF_IND, 0, 0, BPF_IP + 2);
+	emit(c, BPF_MISC|BPF_TAX, 0, 0, 0);
+	emit(c, BPF_LD|BPF_MEM, 0, 0, 0);
+	jumpunless(c, BPF_JGT|BPF_X, 0, port);
+	emit(c, BPF_MISC|BPF_TXA, 0, 0, 0);
+	setlabel(c, port);
+	bpfselect(c, ports, inports, reject);
+	jump(c, accept);
+
+	/* icmp: the type, as a "port" */
+	setlabel(c, icmp);
+	emit(c, BPF_LDX|BPF_B|BPF_MSH, 0, 0, BPF_IP);
+	emit(c, BPF_LD|BPF_B|BPF_IND, 0, 0, BPF_IP);
+	bpfselect(c, ports, inports, reject);
+	jump(c, accept);
+
+	setlabel(c, reject);
+	emit(c, BPF_RET|BPF_K, 0, 0, 0);
+	setlabel(c, accept);
+	emit(c, BPF_RET|BPF_K, 0, 0, BPF_ACCEPT);
+
+	/* Point the jumps at their labels */
+	for (i=0; !c->failed && i < c->n; ++i) {
+		if (c->fix[i])
+			c->insn[i].k = c->label[c->insn[i].k] - (i+1);
+	}
+	free(c->fix);
+	free(c->label);
+	if (c->failed) {
+		free(c->insn);
+		prog->bf_len = 0;
+		prog->bf_insns = NULL;
+		return -1;
+	}
+	prog->bf_len = c->n;
+	prog->bf_insns = c->insn;
+	return 0;
+}
@@ -0,0 +1,31 @@
+/* Packet selection as a BPF program.
+ *
+ * The protocol and port selections (-P/-p, -I/-i) and the listed hosts
+ * (-L/-l) are otherwise only checked once a packet has been decoded
+ * down to the transport layer, so a packet that's going to be thrown
+ * away pays for the whole walk first. Instead, we compile them into a
+ * classic BPF program that looks at just the few header fields they
+ * need, and it goes in with pcap_setfilter. (selectpacket, in select.h,
+ * does the same for every packet we see, without libpcap's help.)
+ *
+ * The program only ever throws away packets the readers would have, so
+ * they still check everything; it just gets the obvious ones out of the
+ * way first. Anything it can't say for sure gets through: IP options or
+ * a short header, say, and host lists longer than BPF_MAXHOSTS, which
+ * would make too big a program.
+ */
+
+#ifndef _PCAPBPF_H
+#define _PCAPBPF_H
+
+#define BPF_MAXHOSTS	512
+#define BPF_ACCEPT	0x40000	/* snap length to return: all of it */
+
+/* The program for the current selection; bf_len is 0 if we couldn't
+ * make one.
+ */
+extern struct bpf_program selectfilter;
+
+int selectbpf(struct bpf_program *prog);
+
+#endif /* _PCAPBPF_H */
@@ -0,0 +1,262 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <sys/time.h>
+#include <pcap/pcap.h>
+#include "pcapmap.h"
+#include "pcapzip.h"
+#include "pcapindex.h"
+#include "ymd.h"
+
+/* Time indexes for capture files - see pcapindex.h */
+
+static char *
+indexname(char *filename)
+{
+	char *name;
+
+	if (!(name = (char *)malloc(strlen(filename) +
+			sizeof(PCAPINDEX_SUFFIX))))
+		return NULL;
+	strcpy(name, filename);
+	strcat(name, PCAPINDEX_SUFFIX);
+	return name;
+}
+
+struct timeval
+pcapindextime(PcapIndexTime *t)
+{
+	struct timeval answer;
+
+	answer.tv_sec = t->sec;
+	answer.tv_usec = t->usec;
+	return answer;
+}
+
+static void
+settime(PcapIndexTime *t, struct timeval *tv)
+{
+	t->sec = tv->tv_sec;
+	t->usec = tv->tv_usec;
+}
+
+/* Take note of another packet's time */
+static void
+indexpacket(PcapIndex *pi, struct timeval *ts, struct timeval *latest)
+{
+	if (!pi->packets++) {
+		*latest = *ts;
+		settime(&pi->first, ts);
+		settime(&pi->last, ts);
+		return;
+	}
+	if (timevalcmp(ts, latest) > 0) {
+		*latest = *ts;
+		settime(&pi->last, ts);
+	} else {
+		struct timeval first = pcapindextime(&pi->first);
+
+		if (timevalcmp(ts, &first) < 0)
+			settime(&pi->first, ts);
+	}
+}
+
+static int
+indexentry(PcapIndex *pi, size_t *nalloc, struct timeval *latest,
+	size_t offset)
+{
+	PcapIndexEntry *entry;
+
+	if (pi->count >= *nalloc) {
+		*nalloc = *nalloc ? 2 * *nalloc : 64;
+		entry = (PcapIndexEntry *)realloc(pi->entry,
+			*nalloc * sizeof(PcapIndexEntry));
+		if (!entry)
+			return -1;
+		pi->entry = entry;
+	}
+	settime(&pi->entry[pi->count].before, latest);
+	pi->entry[pi->count].offset = offset;
+	++pi->count;
+	return 0;
+}
+
+int
+pcapindexbuild(char *filename, int seconds, size_t bytes)
+{
+	PcapIndex pi;
+	PcapMap *pm;
+	pcap_t *readp;
+	FILE *fp;
+	char errbuf[PCAP_ERRBUF_SIZE];
+	struct pcap_pkthdr pkt_header, *phdr;
+	u_int8_t *pkt_data;
+	struct timeval latest;
+	struct stat st;
+	size_t nalloc=0, here, lastoffset=0;
+	time_t lastsec=0;
+	char *name, *tmpname;
+	int kind, ret=0;
+
+	if (seconds <= 0)
+		seconds = PCAPINDEX_SECONDS;
+	if (!bytes)
+		bytes = PCAPINDEX_BYTES;
+	if (stat(filename, &st) < 0) {
+		perror(filename);
+		return -1;
+	}
+	memset(&pi, 0, sizeof(pi));
+	pi.magic = PCAPINDEX_MAGIC;
+	pi.version = PCAPINDEX_VERSION;
+	pi.size = st.st_size;
+	pi.mtime = st.st_mtime;
+
+	if ((pm = pcapmapopen(filename))) {
+		while ((here = pm->offset),
+				pcapmapnext(pm, &pkt_header, &pkt_data) > 0) {
+			/* Entries go before the record that's far enough on */
+			if (pi.packets && (pkt_header.ts.tv_sec >=
+					lastsec + seconds ||
+					here - lastoffset >= bytes)) {
+				if (indexentry(&pi, &nalloc, &latest, here) < 0) {
+					perror(filename);
+					ret = -1;
+					break;
+				}
+				lastsec = pkt_header.ts.tv_sec;
+				lastoffset = here;
+			}
+			if (!pi.packets) {
+				lastsec = pkt_header.ts.tv_sec;
+				lastoffset = here;
+			}
+			indexpacket(&pi, &pkt_header.ts, &latest);
+		}
+		pcapmapclose(pm);
+	} else {
+		/* Just the times, then */
+		fp = pcapzipopen(filename, &kind);
+		if (!fp && kind != PCAPZIP_NONE)
+			return -1;
+		readp = fp ? pcap_fopen_offline(fp, errbuf) :
+			pcap_open_offline(filename, errbuf);
+		if (!readp) {
+			fprintf(stderr, "%s: %s\n", filename, errbuf);
+			if (fp)
+				fclose(fp);
+			return -1;
+		}
+		while (pcap_next_ex(readp, &phdr,
+				(const u_char **)&pkt_data) > 0)
+			indexpacket(&pi, &phdr->ts, &latest);
+		pcap_close(readp);
+	}
+
+	/* Written under another name, then renamed, so nobody sees half */
+	name = indexname(filename);
+	tmpname = name ? (char *)malloc(strlen(name) + 2) : NULL;
+	if (!ret && tmpname) {
+		sprintf(tmpname, "%s~", name);
+		if (!(fp = fopen(tmpname, "w")) ||
+				fwrite(&pi, PCAPINDEX_HEADER, 1, fp) != 1 ||
+				(pi.count && fwrite(pi.entry, sizeof(PcapIndexEntry),
+					pi.count, fp) != pi.count) ||
+				fclose(fp) || rename(tmpname, name) < 0) {
+			perror(tmpname);
+			(void) unlink(tmpname);
+			ret = -1;
+		}
+	} else
+		ret = -1;
+	free(tmpname);
+	free(name);
+	free(pi.entry);
+	return ret;
+}
+
+PcapIndex *
+pcapindexopen(char *filename)
+{
+	PcapIndex *pi;
+	FILE *fp;
+	struct stat st;
+	char *name;
+
+	if (!(name = indexname(filename)))
+		return NULL;
+	fp = fopen(name, "r");
+	free(name);
+	if (!fp)
+		return NULL;
+	if (!(pi = (PcapIndex *)calloc(1, sizeof(PcapIndex))) ||
+			fread(pi, PCAPINDEX_HEADER, 1, fp) != 1 ||
+			pi->magic != PCAPINDEX_MAGIC ||
+			pi->version != PCAPINDEX_VERSION)
+		goto bad;
+	/* Has the file changed since? */
+	if (stat(filename, &st) < 0 || st.st_size != pi->size ||
+			st.st_mtime != pi->mtime)
+		goto bad;
+	pi->entry = NULL;
+	if (pi->count && (!(pi->entry = (PcapIndexEntry *)malloc(pi->count *
+			sizeof(PcapIndexEntry))) ||
+			fread(pi->entry, sizeof(PcapIndexEntry), pi->count, fp) !=
+			pi->count))
+		goto bad;
+	fclose(fp);
+	return pi;
+bad:
+	fclose(fp);
+	pcapindexclose(pi);
+	return NULL;
+}
+
+int
+pcapindexrange(PcapIndex *pi, struct timeval *start, struct timeval *end)
+{
+	struct timeval first, last;
+
+	if (!pi->packets)
+		return -1;	/* nothing to see at all */
+	first = pcapindextime(&pi->first);
+	last = pcapindextime(&pi->last);
+	if (intimerange(&last, start, end) < 0)
+		return -1;
+	if (intimerange(&first, start, end) > 0)
+		return 1;
+	return 0;
+}
+
+size_t
+pcapindexseek(PcapIndex *pi, struct timeval *start)
+{
+	struct timeval before;
+	size_t lo=0, hi=pi->count, mid;
+
+	/* The entries' times never go down; find the last that's before
+	 * the start.
+	 */
+	while (lo < hi) {
+		mid = lo + (hi-lo)/2;
+		before = pcapindextime(&pi->entry[mid].before);
+		if (timevalcmp(&before, start) < 0)
+			lo = mid+1;
+		else
+			hi = mid;
+	}
+	return lo ? pi->entry[lo-1].offset : PCAP_FILEHEADER;
+}
+
+void
+pcapindexclose(PcapIndex *pi)
+{
+	if (!pi) return;
+	free(pi->entry);
+	free(pi);
+}
@@ -0,0 +1,70 @@
+/* Time indexes for capture files.
+ *
+ * With -T, we'd otherwise read every packet before the start time just
+ * to throw it away, and read files that are entirely outside the range
+ * to find that out. An index is a small sidecar file (the capture's
+ * name plus PCAPINDEX_SUFFIX, made by indexpcap) with the earliest and
+ * latest times in the capture, and every so often (PCAPINDEX_SECONDS or
+ * PCAPINDEX_BYTES, whichever comes first) the offset of a record and the
+ * latest time of any record before it. Everything before that offset is
+ * earlier than that time, even if the packets are a little out of order,
+ * so if it's before the start of the range we can skip straight there.
+ *
+ * Offsets only mean anything for files we can map (see pcapmap.h); for
+ * others, say compressed ones, the index just has the times, which is
+ * still enough to skip the whole file.
+ *
+ * The index records the capture's size and modification time, and isn't
+ * used if they've changed.
+ */
+
+#ifndef _PCAPINDEX_H
+#define _PCAPINDEX_H
+
+#define PCAPINDEX_SUFFIX	".idx"
+#define PCAPINDEX_MAGIC		0x7864696e	/* "nidx" */
+#define PCAPINDEX_VERSION	1
+#define PCAPINDEX_SECONDS	60
+#define PCAPINDEX_BYTES		(16*1024*1024)
+
+typedef struct _pcapIndexTime {
+	u_int64_t sec, usec;
+} PcapIndexTime;
+
+typedef struct _pcapIndexEntry {
+	PcapIndexTime before;	/* latest time of the records before offset */
+	u_int64_t offset;
+} PcapIndexEntry;
+
+typedef struct _pcapIndex {
+	/* Written as is, up to entry, then the entries:
+	 * size, mtime - of the capture file, when it was indexed
+	 * first, last - earliest and latest times in it
+	 * packets - how many there were
+	 * count - how many entries
+	 */
+	u_int32_t magic, version;
+	u_int64_t size, mtime;
+	PcapIndexTime first, last;
+	u_int64_t packets, count;
+	PcapIndexEntry *entry;
+} PcapIndex;
+
+#define PCAPINDEX_HEADER	offsetof(PcapIndex, entry)
+
+/* Write filename's index; seconds and bytes are how often to make an
+ * entry (0 for the defaults). -1 if we couldn't.
+ */
+int pcapindexbuild(char *filename, int seconds, size_t bytes);
+/* NULL if there's no index, or it's out of date */
+PcapIndex *pcapindexopen(char *filename);
+/* -1 if everything in the file is before start, 1 if after end, 0 if
+ * some of it might be in range (as for intimerange)
+ */
+int pcapindexrange(PcapIndex *pi, struct timeval *start, struct timeval *end);
+/* Where to start reading a mapped file to get everything from start on */
+size_t pcapindexseek(PcapIndex *pi, struct timeval *start);
+struct timeval pcapindextime(PcapIndexTime *t);
+void pcapindexclose(PcapIndex *pi);
+
+#endif /* _PCAPINDEX_H */
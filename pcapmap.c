@@ -0,0 +1,98 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <byteswap.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <pcap/pcap.h>
+#include "pcapmap.h"
+
+/* Classic pcap files, mapped - see pcapmap.h */
+
+PcapMap *
+pcapmapopen(char *filename)
+{
+	PcapMap *pm;
+	struct stat st;
+	u_int32_t header[PCAP_FILEHEADER/4];
+	void *base;
+	int fd;
+
+	if ((fd = open(filename, O_RDONLY)) < 0)
+		return NULL;
+	if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) ||
+			st.st_size < PCAP_FILEHEADER) {
+		close(fd);
+		return NULL;
+	}
+	base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED)
+		return NULL;
+	pm = (PcapMap *)calloc(1, sizeof(PcapMap));
+	if (!pm) {
+		munmap(base, st.st_size);
+		return NULL;
+	}
+	pm->base = (u_int8_t *)base;
+	pm->size = st.st_size;
+	memcpy(header, pm->base, PCAP_FILEHEADER);
+	switch (header[0]) {
+	case PCAP_MAGIC:
+		break;
+	case PCAP_MAGIC_NSEC:
+		pm->nsec = 1;
+		break;
+	case PCAP_MAGIC_SWAPPED:
+		pm->swapped = 1;
+		break;
+	case PCAP_MAGIC_NSEC_SWAPPED:
+		pm->swapped = pm->nsec = 1;
+		break;
+	default:
+		/* pcapng, or who knows what */
+		pcapmapclose(pm);
+		return NULL;
+	}
+	pm->snaplen = pm->swapped ? bswap_32(header[4]) : header[4];
+	pm->linktype = pm->swapped ? bswap_32(header[5]) : header[5];
+	pm->offset = PCAP_FILEHEADER;
+	pm->end = pm->size;
+	(void) madvise(pm->base, pm->size, MADV_SEQUENTIAL);
+	return pm;
+}
+
+int
+pcapmapnext(PcapMap *pm, struct pcap_pkthdr *hdr, u_int8_t **data)
+{
+	u_int32_t rec[PCAP_RECORDHEADER/4];
+	int i;
+
+	if (pm->offset + PCAP_RECORDHEADER > pm->end)
+		return pm->offset < pm->end ? -1 : 0;
+	/* Records needn't be aligned */
+	memcpy(rec, pm->base + pm->offset, PCAP_RECORDHEADER);
+	if (pm->swapped)
+		for (i=0; i < PCAP_RECORDHEADER/4; ++i)
+			rec[i] = bswap_32(rec[i]);
+	if (rec[2] > pm->end - pm->offset - PCAP_RECORDHEADER)
+		return -1;
+	hdr->ts.tv_sec = rec[0];
+	hdr->ts.tv_usec = pm->nsec ? rec[1]/1000 : rec[1];
+	hdr->caplen = rec[2];
+	hdr->len = rec[3];
+	*data = pm->base + pm->offset + PCAP_RECORDHEADER;
+	pm->offset += PCAP_RECORDHEADER + rec[2];
+	return 1;
+}
+
+void
+pcapmapclose(PcapMap *pm)
+{
+	if (!pm) return;
+	munmap(pm->base, pm->size);
+	free(pm);
+}
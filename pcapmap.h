@@ -0,0 +1,56 @@
+/* Reading classic pcap files in place.
+ *
+ * libpcap's pcap_next_ex reads each record into its own buffer, so every
+ * packet gets copied once before we even look at it, and the file comes
+ * in through a read() per buffer load. A classic pcap file is just a
+ * 24 byte header and then records back to back (a 16 byte header and
+ * the packet), so instead we map the whole file and walk the records
+ * where they lie, handing out pointers into the mapping.
+ *
+ * Both the microsecond and nanosecond formats are handled, in either
+ * byte order; anything else (pcapng, say, or a pipe) is left to libpcap.
+ */
+
+#ifndef _PCAPMAP_H
+#define _PCAPMAP_H
+
+#define PCAP_MAGIC		0xa1b2c3d4	/* microseconds */
+#define PCAP_MAGIC_NSEC		0xa1b23c4d	/* nanoseconds */
+#define PCAP_MAGIC_SWAPPED	0xd4c3b2a1	/* and the other byte order */
+#define PCAP_MAGIC_NSEC_SWAPPED	0x4d3cb2a1
+#define PCAP_FILEHEADER		24		/* bytes */
+#define PCAP_RECORDHEADER	16
+
+/* Ranges of records handed to worker threads at a time (see readlink.c) */
+#define PCAP_CHUNKMIN		(1024*1024)
+#define PCAP_CHUNKMAX		(64*1024*1024)
+
+typedef struct _pcapMap {
+	/* base - the mapping
+	 * size - bytes in the file
+	 * offset - where the next record starts
+	 * end - where the records stop
+	 * swapped - headers are in the other byte order
+	 * nsec - timestamps are in nanoseconds
+	 * refs - ranges of it that worker threads are still reading
+	 * closing - close it when they're done (see ngramthread.c)
+	 */
+	u_int8_t *base;
+	size_t size;
+	size_t offset, end;
+	int swapped;
+	int nsec;
+	int refs, closing;
+	u_int32_t snaplen;
+	u_int32_t linktype;
+} PcapMap;
+
+/* NULL if the file isn't one we can do, in which case libpcap gets a go
+ * (and reports any error)
+ */
+PcapMap *pcapmapopen(char *filename);
+/* 1 for a packet, 0 at the end, -1 for a truncated record */
+int pcapmapnext(PcapMap *pm, struct pcap_pkthdr *hdr, u_int8_t **data);
+void pcapmapclose(PcapMap *pm);
+
+#endif /* _PCAPMAP_H */
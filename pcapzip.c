@@ -0,0 +1,503 @@
+#define _GNU_SOURCE	/* fopencookie */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <zlib.h>
+#ifdef ZSTD
+#include <zstd.h>
+#endif
+#ifdef LZ4
+#include <lz4frame.h>
+#endif
+#include "pcapzip.h"
+
+/* Compressed capture files, decompressed on the fly - see pcapzip.h */
+
+typedef struct _zipStream {
+	/* in - the compressed file
+	 * input - what we've read of it, inlen bytes, used up to inpos
+	 * buf - the two decompressed buffers; len[i] is 0 if buf[i] is
+	 *	empty (waiting to be filled)
+	 * fill - the one the thread fills next; read, the one being read,
+	 *	up to pos. They take turns, so the stream stays in order.
+	 * eof - the thread has finished (or given up)
+	 * closing - the reader has, so the thread should stop
+	 */
+	char *filename;
+	FILE *in;
+	int kind;
+	u_int8_t *input;
+	size_t inlen, inpos;
+	u_int8_t *buf[2];
+	size_t len[2];
+	int fill, read;
+	size_t pos;
+	int eof, closing;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t filled, emptied;
+	z_stream z;
+#ifdef ZSTD
+	ZSTD_DStream *zd;
+#endif
+#ifdef LZ4
+	LZ4F_dctx *lz;
+#endif
+} ZipStream;
+
+static char *kindnames[] = { "uncompressed", "gzip", "zstd", "lz4" };
+
+int
+pcapzipkind(char *filename)
+{
+	u_int8_t magic[4];
+	struct stat st;
+	FILE *fp;
+	int n;
+
+	/* Reading the magic from a pipe would use it up, so anything but
+	 * a plain file goes to libpcap as it is
+	 */
+	if (stat(filename, &st) < 0 || !S_ISREG(st.st_mode))
+		return PCAPZIP_NONE;
+	if (!(fp = fopen(filename, "r")))
+		return PCAPZIP_NONE;
+	n = fread(magic, 1, sizeof(magic), fp);
+	fclose(fp);
+	if (n >= 2 && magic[0] == 0x1f && magic[1] == 0x8b)
+		return PCAPZIP_GZIP;
+	if (n < 4)
+		return PCAPZIP_NONE;
+	if (magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f &&
+			magic[3] == 0xfd)
+		return PCAPZIP_ZSTD;
+	if (magic[0] == 0x04 && magic[1] == 0x22 && magic[2] == 0x4d &&
+			magic[3] == 0x18)
+		return PCAPZIP_LZ4;
+	return PCAPZIP_NONE;
+}
+
+/* More compressed data, if we've used up what we had; 0 at the end */
+static size_t
+zipinput(ZipStream *zs)
+{
+	if (zs->inpos < zs->inlen)
+		return zs->inlen - zs->inpos;
+	zs->inpos = 0;
+	zs->inlen = fread(zs->input, 1, PCAPZIP_INPUT, zs->in);
+	return zs->inlen;
+}
+
+static void
+ziperror(ZipStream *zs, const char *what)
+{
+	fprintf(stderr, "%s: bad %s data (%s)\n", zs->filename,
+		kindnames[zs->kind], what ? what : "?");
+}
+
+/* Decompress up to size bytes into out, returning how many we got;
+ * short only at the end of the file, or an error.
+ */
+static size_t
+gunzip(ZipStream *zs, u_int8_t *out, size_t size)
+{
+	z_stream *z = &zs->z;
+	int ret;
+
+	z->next_out = out;
+	z->avail_out = size;
+	while (z->avail_out && zipinput(zs)) {
+		z->next_in = zs->input + zs->inpos;
+		z->avail_in = zs->inlen - zs->inpos;
+		ret = inflate(z, Z_NO_FLUSH);
+		zs->inpos = zs->inlen - z->avail_in;
+		/* gzip files can be several members end to end */
+		if (ret == Z_STREAM_END)
+			ret = inflateReset(z);
+		if (ret != Z_OK) {
+			ziperror(zs, z->msg);
+			break;
+		}
+	}
+	return size - z->avail_out;
+}
+
+#ifdef ZSTD
+static size_t
+unzstd(ZipStream *zs, u_int8_t *out, size_t size)
+{
+	ZSTD_outBuffer zout;
+	ZSTD_inBuffer zin;
+	size_t ret;
+
+	zout.dst = out;
+	zout.size = size;
+	zout.pos = 0;
+	while (zout.pos < zout.size && zipinput(zs)) {
+		zin.src = zs->input;
+		zin.size = zs->inlen;
+		zin.pos = zs->inpos;
+		ret = ZSTD_decompressStream(zs->zd, &zout, &zin);
+		zs->inpos = zin.pos;
+		if (ZSTD_isError(ret)) {
+			ziperror(zs, ZSTD_getErrorName(ret));
+			break;
+		}
+	}
+	return zout.pos;
+}
+#endif
+
+#ifdef LZ4
+static size_t
+unlz4(ZipStream *zs, u_int8_t *out, size_t size)
+{
+	size_t done=0, outlen, inlen, ret;
+
+	while (done < size && zipinput(zs)) {
+		outlen = size - done;
+		inlen = zs->inlen - zs->inpos;
+		ret = LZ4F_decompress(zs->lz, out + done, &outlen,
+			zs->input + zs->inpos, &inlen, NULL);
+		zs->inpos += inlen;
+		done += outlen;
+		if (LZ4F_isError(ret)) {
+			ziperror(zs, LZ4F_getErrorName(ret));
+			break;
+		}
+	}
+	return done;
+}
+#endif
+
+static size_t
+zipfill(ZipStream *zs, u_int8_t *out, size_t size)
+{
+	switch (zs->kind) {
+	case PCAPZIP_GZIP:
+		return gunzip(zs, out, size);
+#ifdef ZSTD
+	case PCAPZIP_ZSTD:
+		return unzstd(zs, out, size);
+#endif
+#ifdef LZ4
+	case PCAPZIP_LZ4:
+		return unlz4(zs, out, size);
+#endif
+	}
+	return 0;
+}
+
+/* The decompressing thread: fill whichever buffer is next, as soon as
+ * it's been read.
+ */
+static void *
+zipthread(void *arg)
+{
+	ZipStream *zs = (ZipStream *)arg;
+	size_t n;
+	int fill;
+
+	while (1) {
+		pthread_mutex_lock(&zs->lock);
+		while (zs->len[zs->fill] && !zs->closing)
+			pthread_cond_wait(&zs->emptied, &zs->lock);
+		fill = zs->fill;
+		if (zs->closing) {
+			pthread_mutex_unlock(&zs->lock);
+			break;
+		}
+		pthread_mutex_unlock(&zs->lock);
+
+		n = zipfill(zs, zs->buf[fill], PCAPZIP_BUFFER);
+
+		pthread_mutex_lock(&zs->lock);
+		if (n) {
+			zs->len[fill] = n;
+			zs->fill = !fill;
+		}
+		if (n < PCAPZIP_BUFFER)
+			zs->eof = 1;
+		pthread_cond_signal(&zs->filled);
+		pthread_mutex_unlock(&zs->lock);
+		if (n < PCAPZIP_BUFFER)
+			break;
+	}
+	return NULL;
+}
+
+/* The FILE's side (see fopencookie) */
+static ssize_t
+zipread(void *cookie, char *buf, size_t size)
+{
+	ZipStream *zs = (ZipStream *)cookie;
+	size_t got=0, n;
+
+	while (got < size) {
+		if (!zs->pos) {
+			pthread_mutex_lock(&zs->lock);
+			while (!zs->len[zs->read] && !zs->eof)
+				pthread_cond_wait(&zs->filled, &zs->lock);
+			pthread_mutex_unlock(&zs->lock);
+			if (!zs->len[zs->read])
+				break;		/* that's all */
+		}
+		n = zs->len[zs->read] - zs->pos;
+		if (n > size - got)
+			n = size - got;
+		memcpy(buf + got, zs->buf[zs->read] + zs->pos, n);
+		got += n;
+		zs->pos += n;
+		if (zs->pos == zs->len[zs->read]) {
+			pthread_mutex_lock(&zs->lock);
+			zs->len[zs->read] = 0;
+			pthread_cond_signal(&zs->emptied);
+			pthread_mutex_unlock(&zs->lock);
+			zs->read = !zs->read;
+			zs->pos = 0;
+		}
+	}
+	return got;
+}
+
+static void
+zipfree(ZipStream *zs)
+{
+	if (zs->in)
+		fclose(zs->in);
+	switch (zs->kind) {
+	case PCAPZIP_GZIP:
+		(void) inflateEnd(&zs->z);
+		break;
+#ifdef ZSTD
+	case PCAPZIP_ZSTD:
+		if (zs->zd)
+			(void) ZSTD_freeDStream(zs->zd);
+		break;
+#endif
+#ifdef LZ4
+	case PCAPZIP_LZ4:
+		if (zs->lz)
+			(void) LZ4F_freeDecompressionContext(zs->lz);
+		break;
+#endif
+	}
+	pthread_mutex_destroy(&zs->lock);
+	pthread_cond_destroy(&zs->filled);
+	pthread_cond_destroy(&zs->emptied);
+	free(zs->input);
+	free(zs->buf[0]);
+	free(zs->buf[1]);
+	free(zs->filename);
+	free(zs);
+}
+
+static int
+zipclose(void *cookie)
+{
+	ZipStream *zs = (ZipStream *)cookie;
+
+	pthread_mutex_lock(&zs->lock);
+	zs->closing = 1;
+	pthread_cond_signal(&zs->emptied);
+	pthread_mutex_unlock(&zs->lock);
+	pthread_join(zs->thread, NULL);
+	zipfree(zs);
+	return 0;
+}
+
+FILE *
+pcapzipopen(char *filename, int *kind)
+{
+	ZipStream *zs;
+	FILE *fp;
+	cookie_io_functions_t io = { zipread, NULL, NULL, zipclose };
+
+	switch ((*kind = pcapzipkind(filename))) {
+	case PCAPZIP_NONE:
+		return NULL;
+	case PCAPZIP_GZIP:
+#ifdef ZSTD
+	case PCAPZIP_ZSTD:
+#endif
+#ifdef LZ4
+	case PCAPZIP_LZ4:
+#endif
+		break;
+	default:
+		fprintf(stderr, "%s: %s compressed, which we weren't built for\n",
+			filename, kindnames[*kind]);
+		return NULL;
+	}
+	if (!(zs = (ZipStream *)calloc(1, sizeof(ZipStream))))
+		return NULL;
+	zs->kind = *kind;
+	pthread_mutex_init(&zs->lock, NULL);
+	pthread_cond_init(&zs->filled, NULL);
+	pthread_cond_init(&zs->emptied, NULL);
+	zs->filename = strdup(filename);
+	zs->in = fopen(filename, "r");
+	zs->input = (u_int8_t *)malloc(PCAPZIP_INPUT);
+	zs->buf[0] = (u_int8_t *)malloc(PCAPZIP_BUFFER);
+	zs->buf[1] = (u_int8_t *)malloc(PCAPZIP_BUFFER);
+	if (!zs->filename || !zs->in || !zs->input || !zs->buf[0] ||
+			!zs->buf[1]) {
+		perror(filename);
+		zipfree(zs);
+		return NULL;
+	}
+	switch (zs->kind) {
+	case PCAPZIP_GZIP:
+		/* 16 - gzip header, not zlib */
+		if (inflateInit2(&zs->z, 16+MAX_WBITS) != Z_OK) {
+			zipfree(zs);
+			return NULL;
+		}
+		break;
+#ifdef ZSTD
+	case PCAPZIP_ZSTD:
+		if (!(zs->zd = ZSTD_createDStream()) ||
+				ZSTD_isError(ZSTD_initDStream(zs->zd))) {
+			zipfree(zs);
+			return NULL;
+		}
+		break;
+#endif
+#ifdef LZ4
+	case PCAPZIP_LZ4:
+		if (LZ4F_isError(LZ4F_createDecompressionContext(&zs->lz,
+				LZ4F_VERSION))) {
+			zipfree(zs);
+			return NULL;
+		}
+		break;
+#endif
+	}
+	if (pthread_create(&zs->thread, NULL, zipthread, (void *)zs)) {
+		perror("pthread_create");
+		zipfree(zs);
+		return NULL;
+	}
+	if (!(fp = fopencookie((void *)zs, "r", io))) {
+		perror(filename);
+		(void) zipclose((void *)zs);
+		return NULL;
+	}
+	/* libpcap reads whole records; no need to copy them twice */
+	setvbuf(fp, NULL, _IONBF, 0);
+	return fp;
+}
+
+#ifdef TEST
+#include <sys/wait.h>
+#include <signal.h>
+#include <pcap/pcap.h>
+
+/* A capture read plain, gzipped, and through a pipe (as with
+ * ngram <(cat file)) should have the same packets every time.
+ */
+#define TESTPACKETS	1000
+
+static int
+countpackets(char *filename)
+{
+	char errbuf[PCAP_ERRBUF_SIZE];
+	struct pcap_pkthdr *h;
+	const u_char *data;
+	pcap_t *readp;
+	FILE *fp;
+	int kind, n=0;
+
+	if ((fp = pcapzipopen(filename, &kind)))
+		readp = pcap_fopen_offline(fp, errbuf);
+	else if (kind != PCAPZIP_NONE)
+		return -1;
+	else
+		readp = pcap_open_offline(filename, errbuf);
+	if (!readp) {
+		fprintf(stderr, "%s: %s\n", filename, errbuf);
+		return -1;
+	}
+	while (pcap_next_ex(readp, &h, &data) > 0)
+		++n;
+	pcap_close(readp);
+	return n;
+}
+
+int
+main(int argc, char **argv)
+{
+	char plain[] = "/tmp/pcapziptestXXXXXX", zipped[sizeof(plain)+3];
+	char piped[32];
+	u_int32_t header[6] = { 0xa1b2c3d4, 0x00040002, 0, 0, 65535, 1 };
+	u_int32_t record[4];
+	u_int8_t packet[64];
+	int fd, pipefd[2], i, n, errors=0;
+	FILE *fp;
+	gzFile gz;
+	pid_t pid;
+
+	if ((fd = mkstemp(plain)) < 0 || !(fp = fdopen(fd, "w"))) {
+		perror(plain);
+		exit(2);
+	}
+	sprintf(zipped, "%s.gz", plain);
+	gz = gzopen(zipped, "w");
+	fwrite(header, sizeof(header), 1, fp);
+	gzwrite(gz, header, sizeof(header));
+	for (i=0; i < TESTPACKETS; ++i) {
+		record[0] = i;
+		record[1] = 0;
+		record[2] = record[3] = sizeof(packet);
+		memset(packet, i, sizeof(packet));
+		fwrite(record, sizeof(record), 1, fp);
+		fwrite(packet, sizeof(packet), 1, fp);
+		gzwrite(gz, record, sizeof(record));
+		gzwrite(gz, packet, sizeof(packet));
+	}
+	fclose(fp);
+	gzclose(gz);
+
+	if ((n = countpackets(plain)) != TESTPACKETS) {
+		fprintf(stderr, "plain: %d packets, not %d\n", n, TESTPACKETS);
+		++errors;
+	}
+	if ((n = countpackets(zipped)) != TESTPACKETS) {
+		fprintf(stderr, "gzip: %d packets, not %d\n", n, TESTPACKETS);
+		++errors;
+	}
+	/* The magic mustn't be read off the pipe before libpcap sees it */
+	if (pipe(pipefd) < 0 || (pid = fork()) < 0) {
+		perror("pipe");
+		exit(2);
+	}
+	if (!pid) {
+		char buf[BUFSIZ];
+
+		close(pipefd[0]);
+		fp = fopen(plain, "r");
+		while (fp && (n = fread(buf, 1, sizeof(buf), fp)) > 0)
+			if (write(pipefd[1], buf, n) != n)
+				break;
+		_exit(0);
+	}
+	close(pipefd[1]);
+	sprintf(piped, "/dev/fd/%d", pipefd[0]);
+	if ((n = countpackets(piped)) != TESTPACKETS) {
+		fprintf(stderr, "pipe: %d packets, not %d\n", n, TESTPACKETS);
+		++errors;
+		kill(pid, SIGKILL);	/* it may be stuck on a full pipe */
+	}
+	close(pipefd[0]);
+	waitpid(pid, NULL, 0);
+
+	unlink(plain);
+	unlink(zipped);
+	printf("%s\n", errors ? "FAILED" : "ok");
+	return errors != 0;
+}
+#endif
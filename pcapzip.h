@@ -0,0 +1,34 @@
+/* Reading compressed capture files.
+ *
+ * Archived captures are usually kept compressed, and rather than
+ * decompress them to disk first (or pipe them in on stdin, and lose the
+ * other files' parallelism - see ngramthread.c), we recognise them by
+ * their magic number and decompress them as we go, on a thread of
+ * their own. That thread fills one buffer while libpcap reads the
+ * other, so decompression overlaps with everything else; libpcap just
+ * sees a FILE.
+ *
+ * gzip is always there (zlib); zstd and lz4 need ZSTD and LZ4 defined,
+ * and their libraries (see the Makefile).
+ */
+
+#ifndef _PCAPZIP_H
+#define _PCAPZIP_H
+
+#define PCAPZIP_BUFFER	(1024*1024)	/* each of the two */
+#define PCAPZIP_INPUT	(256*1024)	/* compressed data read at a time */
+
+/* What's at the front of the file */
+#define PCAPZIP_NONE	0
+#define PCAPZIP_GZIP	1	/* 1f 8b */
+#define PCAPZIP_ZSTD	2	/* 28 b5 2f fd */
+#define PCAPZIP_LZ4	3	/* 04 22 4d 18 */
+
+/* Only plain files are looked at; pipes and the like are PCAPZIP_NONE */
+int pcapzipkind(char *filename);
+/* NULL if it isn't compressed, or we can't do that kind (which is
+ * reported); *kind says which.
+ */
+FILE *pcapzipopen(char *filename, int *kind);
+
+#endif /* _PCAPZIP_H */
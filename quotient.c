@@ -0,0 +1,867 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <memory.h>
+#include <malloc.h>
+#include <math.h>
+#include "libstats.h"
+/* For the "generic" ngram structure */
+#include "ngram.h"
+#include <stdint.h>
+#include "fnv.h"
+#include "fnvrange.h"
+#include "rolling.h"
+
+#include "bloom.h"
+#include "quotient.h"
+
+NgramFilterSet quotientset = {
+	{0,0},
+	NULL
+};
+NgramOps quotientops = {
+	NewQuotientNgramFilterSet,
+	AddQuotientNgramFilterSet,
+	DeleteQuotientNgramFilterSet,
+	FindQuotientFilter,
+	FindQuotientNgramFilterSet,
+	FindQuotientNgramDistFilter,
+	DistQuotientNgramFilter,
+	DumpQuotientNgramFilterSet,
+	CloseQuotientNgramFilterSet,
+	MergeQuotientNgramFilterSet
+};
+
+Ngram quotient = {
+	&quotientset,
+	&quotientops
+};
+
+/* Slots that take part in a run (the occupied bit belongs to the slot's
+ * position, not to what's in it, so it stays put when things move).
+ */
+#define QF_MOVING	(~QF_OCCUPIED)
+#define QF_EMPTY(s)	(!((s) & (QF_OCCUPIED|QF_CONTINUATION|QF_SHIFTED)))
+/* A count digit is always part of a run, and never where it "belongs" */
+#define QF_DIGIT	(QF_COUNTER|QF_CONTINUATION|QF_SHIFTED)
+
+/* Room for runs pushed off the end; there's no wraparound. One more
+ * past that is always empty, to stop the scans.
+ */
+#define QF_XSLOTS(nslots)	((nslots)/64 + 64)
+
+/* Grow at 7/8 full */
+#define QF_FULL(qf)	((qf)->used + 4 >= (qf)->nslots - (qf)->nslots/8)
+
+#define QF_BYTES(nslots)	\
+	(sizeof(QuotientFilter) + ((nslots)+QF_XSLOTS(nslots)+1)*sizeof(u_int32_t))
+
+/* Most of the hash, mixed so the top bits (the quotient) depend on all of
+ * it.
+ */
+static inline u_int64_t
+QuotientFingerprint(u_int64_t hash)
+{
+	return (hash*0x9e3779b97f4a7c15ULL) >> (64-QUOTIENT_FPBITS);
+}
+
+static QuotientFilter *
+QuotientAlloc(int qbits)
+{
+	QuotientFilter *answer;
+	size_t nslots = (size_t)1<<qbits;
+
+	answer = (QuotientFilter *)calloc(1, QF_BYTES(nslots));
+	if (!answer)
+		return NULL;
+	answer->qbits = qbits;
+	answer->rbits = QUOTIENT_FPBITS-qbits;
+	answer->nslots = nslots;
+	answer->xslots = QF_XSLOTS(nslots);
+	return answer;
+}
+
+/* Unshared filters start small and grow; shared ones start at the
+ * Bloom filter's guess at the number of entries.
+ */
+QuotientFilter *
+#ifdef SHMALLOC
+NewQuotientNgramFilter(int ngram, char *shmfilename, int mode)
+#else
+NewQuotientNgramFilter(int ngram)
+#endif
+{
+	QuotientFilter *answer;
+	size_t nslots, bytesize;
+	int qbits = QUOTIENT_MINQBITS;
+
+#ifdef SHMALLOC
+	if (shmfilename) {
+		for (nslots = BloomSize(ngram)/32;
+				((size_t)1<<qbits) < nslots &&
+				QUOTIENT_FPBITS-qbits > QUOTIENT_MINRBITS; ++qbits)
+			;
+	}
+#endif
+	nslots = (size_t)1<<qbits;
+	bytesize = QF_BYTES(nslots);
+	setngramlabel(NGRAM_QUOTIENT, NULL, ngram, bytesize, 0, 0);
+#ifdef SHMALLOC
+	answer = (QuotientFilter *)ngram_shmalloc(bytesize,
+		shmfilename, mode);
+	/* A shared memory file may already have one */
+	if (answer && answer->nslots)
+		return answer;
+#else
+	answer = (QuotientFilter *)malloc(bytesize);
+	if (answer)
+		memset((void *)answer, 0, bytesize);
+#endif
+	if (!answer) {
+		fprintf(stderr, "Couldn't allocate %ld\n", bytesize);
+		perror("malloc");
+		return NULL;
+	}
+	answer->qbits = qbits;
+	answer->rbits = QUOTIENT_FPBITS-qbits;
+	answer->nslots = nslots;
+	answer->xslots = QF_XSLOTS(nslots);
+#ifdef SHMALLOC
+	answer->shared = (shmfilename != NULL);
+#endif
+	return answer;
+}
+
+int
+QuotientFilterSetSize(Range ngram)
+{
+	return sizeof(NgramFilterSet) + (ngram.max-ngram.min+1)*sizeof(QuotientFilter *);
+}
+
+NgramFilterSet *
+#ifdef SHMALLOC
+NewQuotientNgramFilterSet(Range ngram, char *shmfilename, int mode)
+#else
+NewQuotientNgramFilterSet(Range ngram)
+#endif
+{
+	NgramFilterSet *answer;
+	int ng;
+	size_t bytesize = QuotientFilterSetSize(ngram);
+
+#ifdef SHMALLOC
+	answer = (NgramFilterSet *)ngram_shmalloc(bytesize,
+		shmfilename, mode);
+#else
+	answer = (NgramFilterSet *)malloc(bytesize);
+	if (answer)
+		memset((void *)answer, 0, bytesize);
+#endif
+	if (!answer) return NULL;
+	answer->ngramsize = ngram;
+	for (ng=ngram.min; ng <= ngram.max; ++ng) {
+		answer->filter[ng] =
+#ifdef SHMALLOC
+			(NgramFilter)NewQuotientNgramFilter(ng, shmfilename, mode);
+#else
+			(NgramFilter)NewQuotientNgramFilter(ng);
+#endif
+	}
+	return answer;
+}
+
+void
+CloseQuotientNgramFilter(QuotientFilter *qf)
+{
+	if (!qf) return;
+#ifdef SHMALLOC
+	if (qf->shared) {
+		ngram_shmfree((void *)qf);
+		return;
+	}
+#endif
+	free((void *)qf);
+}
+
+void
+CloseQuotientNgramFilterSet(NgramFilterSet *set)
+{
+	int ng;
+
+	if (!set) return;
+	for (ng=set->ngramsize.min; ng <= set->ngramsize.max; ++ng) {
+		if (set->filter[ng]) {
+			CloseQuotientNgramFilter((QuotientFilter *)set->filter[ng]);
+		}
+	}
+#ifdef SHMALLOC
+	ngram_shmfree(set);
+#else
+	free(set);
+#endif
+}
+
+/* The start of quotient q's run, which must be occupied: back up to the
+ * start of the cluster (where nothing's shifted), then step forward a run
+ * for each occupied quotient until we get to q.
+ */
+static inline size_t
+QuotientRunStart(QuotientFilter *qf, size_t q)
+{
+	u_int32_t *slot = qf->slot;
+	size_t b = q, s;
+
+	while (b > 0 && (slot[b] & QF_SHIFTED))
+		--b;
+	for (s=b; b < q; ) {
+		do ++s; while (slot[s] & QF_CONTINUATION);
+		do ++b; while (!(slot[b] & QF_OCCUPIED));
+	}
+	return s;
+}
+
+/* Read the count after the remainder at s; leaves *next at the next
+ * remainder (or whatever comes after the run).
+ */
+static inline u_int64_t
+QuotientCount(QuotientFilter *qf, size_t s, size_t *next)
+{
+	u_int32_t *slot = qf->slot;
+	u_int64_t extra = 0;
+	int shift = 0;
+
+	for (++s; slot[s] & QF_COUNTER; ++s, shift += QUOTIENT_VALUEBITS)
+		extra |= (u_int64_t)(slot[s] & QF_VALUE) << shift;
+	*next = s;
+	return extra+1;
+}
+
+/* Look for remainder r in quotient q's run. Returns its slot, or where
+ * it would go (*found 0); *start is the start of the run.
+ */
+static inline size_t
+QuotientSearch(QuotientFilter *qf, size_t q, u_int32_t r, size_t *start, int *found)
+{
+	u_int32_t *slot = qf->slot;
+	size_t s, next;
+	u_int32_t v;
+
+	*found = 0;
+	s = *start = QuotientRunStart(qf, q);
+	for (;;) {
+		v = slot[s] & QF_VALUE;
+		if (v >= r) {
+			*found = (v == r);
+			return s;
+		}
+		(void) QuotientCount(qf, s, &next);
+		s = next;
+		if (!(slot[s] & QF_CONTINUATION))
+			return s;
+	}
+}
+
+/* Are there k empty slots at or after s? */
+static inline int
+QuotientRoom(QuotientFilter *qf, size_t s, int k)
+{
+	size_t end = qf->nslots+qf->xslots;
+
+	for (; k > 0 && s < end; ++s)
+		if (QF_EMPTY(qf->slot[s]))
+			--k;
+	return k == 0;
+}
+
+/* Open up slot s, shifting everything up to the next empty slot one to
+ * the right; check for room (QuotientRoom) first.
+ */
+static inline void
+QuotientInsertSlot(QuotientFilter *qf, size_t s, u_int32_t moving)
+{
+	u_int32_t *slot = qf->slot;
+	size_t e;
+
+	for (e=s; !QF_EMPTY(slot[e]); ++e)
+		;
+	for (; e > s; --e)
+		slot[e] = (slot[e] & QF_OCCUPIED) |
+			(slot[e-1] & QF_MOVING) | QF_SHIFTED;
+	slot[s] = (slot[s] & QF_OCCUPIED) | (moving & QF_MOVING);
+	++qf->used;
+}
+
+/* Count slots needed for a count */
+static inline int
+QuotientDigits(u_int64_t count)
+{
+	int d;
+
+	for (d=0, --count; count; ++d)
+		count >>= QUOTIENT_VALUEBITS;
+	return d;
+}
+
+/* Write the count for the remainder at s, which has room for it */
+static inline void
+QuotientSetCount(QuotientFilter *qf, size_t s, u_int64_t count)
+{
+	u_int32_t *slot = qf->slot;
+	size_t t;
+
+	for (t=s+1, --count; count; ++t, count >>= QUOTIENT_VALUEBITS)
+		slot[t] = (slot[t] & QF_OCCUPIED) | QF_COUNTER |
+			QF_CONTINUATION | QF_SHIFTED |
+			(u_int32_t)(count & QF_VALUE);
+}
+
+/* Add count to a fingerprint. Returns -1 if there's no room, and then
+ * nothing has changed.
+ */
+static int
+QuotientInsert(QuotientFilter *qf, u_int64_t fp, u_int64_t count)
+{
+	u_int32_t *slot = qf->slot;
+	size_t q = fp >> qf->rbits;
+	u_int32_t r = fp & (((u_int64_t)1<<qf->rbits)-1);
+	size_t s, next, start;
+	u_int64_t old;
+	int found, have, need, i;
+
+	need = 1+QuotientDigits(count);
+	if (!(slot[q] & QF_OCCUPIED)) {
+		if (QF_EMPTY(slot[q])) {
+			/* A new run, right where it belongs */
+			if (!QuotientRoom(qf, q+1, need-1))
+				return -1;
+			slot[q] = QF_OCCUPIED | r;
+			++qf->used;
+			s = q;
+		} else {
+			/* A new run, where the next one would start */
+			slot[q] |= QF_OCCUPIED;
+			s = QuotientRunStart(qf, q);
+			if (!QuotientRoom(qf, s, need)) {
+				slot[q] &= ~QF_OCCUPIED;
+				return -1;
+			}
+			QuotientInsertSlot(qf, s, r | (s != q ? QF_SHIFTED : 0));
+		}
+	} else {
+		s = QuotientSearch(qf, q, r, &start, &found);
+		if (found) {
+			old = QuotientCount(qf, s, &next);
+			have = QuotientDigits(old);
+			need = QuotientDigits(old+count);
+			if (need > have && !QuotientRoom(qf, next, need-have))
+				return -1;
+			for (i=have; i < need; ++i)
+				QuotientInsertSlot(qf, next, QF_DIGIT);
+			QuotientSetCount(qf, s, old+count);
+			qf->n += count;
+			return 0;
+		}
+		if (!QuotientRoom(qf, s, need))
+			return -1;
+		QuotientInsertSlot(qf, s, r | (s != q ? QF_SHIFTED : 0) |
+			(s != start ? QF_CONTINUATION : 0));
+		/* The old head of the run is now second */
+		if (s == start)
+			slot[s+1] |= QF_CONTINUATION;
+	}
+	for (i=1; i < need; ++i)
+		QuotientInsertSlot(qf, s+1, QF_DIGIT);
+	QuotientSetCount(qf, s, count);
+	++qf->distinct;
+	qf->n += count;
+	return 0;
+}
+
+/* Walking the whole filter in fingerprint order: each cluster starts in
+ * its canonical slot, and each new run after that belongs to the next
+ * occupied quotient.
+ */
+typedef struct _QuotientCursor {
+	size_t s;	/* next slot to look at */
+	size_t b;	/* quotient of the current run */
+} QuotientCursor;
+
+static int
+QuotientNext(QuotientFilter *qf, QuotientCursor *c, u_int64_t *fp, u_int64_t *count)
+{
+	u_int32_t *slot = qf->slot;
+	size_t end = qf->nslots+qf->xslots;
+
+	while (c->s < end && QF_EMPTY(slot[c->s]))
+		++c->s;
+	if (c->s >= end)
+		return 0;
+	if (!(slot[c->s] & QF_SHIFTED))
+		c->b = c->s;
+	else if (!(slot[c->s] & QF_CONTINUATION))
+		do ++c->b; while (!(slot[c->b] & QF_OCCUPIED));
+	*fp = ((u_int64_t)c->b << qf->rbits) | (slot[c->s] & QF_VALUE);
+	*count = QuotientCount(qf, c->s, &c->s);
+	return 1;
+}
+
+/* Take count off a fingerprint. Taking things out of the middle of a
+ * cluster means moving things back towards (and maybe into) their
+ * canonical slots, which is fiddly, so we just read the cluster out and
+ * lay it back down again. Deletes are rare, so the cluster gets copied
+ * into space of its own each time, which keeps threads out of each
+ * other's way.
+ */
+static int
+QuotientRemove(QuotientFilter *qf, u_int64_t fp, u_int64_t count)
+{
+	u_int32_t *slot = qf->slot;
+	size_t q = fp >> qf->rbits;
+	u_int32_t r = fp & (((u_int64_t)1<<qf->rbits)-1);
+	size_t b0, end, n, i, s, prevq;
+	u_int64_t *fps, *counts;
+	QuotientCursor c;
+	int found;
+
+	if (!(slot[q] & QF_OCCUPIED))
+		return -1;
+	(void) QuotientSearch(qf, q, r, &s, &found);
+	if (!found)
+		return -1;
+	for (b0=q; b0 > 0 && (slot[b0] & QF_SHIFTED); --b0)
+		;
+	/* The cluster runs to the next slot that's empty or unshifted */
+	for (end=b0+1; end < qf->nslots+qf->xslots &&
+			(slot[end] & QF_SHIFTED); ++end)
+		;
+	/* No more entries than slots */
+	fps = (u_int64_t *)malloc((end-b0)*sizeof(u_int64_t));
+	counts = (u_int64_t *)malloc((end-b0)*sizeof(u_int64_t));
+	if (!fps || !counts) {
+		fprintf(stderr, "No memory for quotient filter delete\n");
+		exit(1);
+	}
+	c.s = c.b = b0;
+	for (n=0; c.s < end; ++n) {
+		(void) QuotientNext(qf, &c, fps+n, counts+n);
+		if (fps[n] == fp) {
+			if (count > counts[n])
+				count = counts[n];
+			counts[n] -= count;
+		}
+	}
+	/* Clear it out, and put it back */
+	for (s=b0; s < end; ++s)
+		slot[s] = 0;
+	prevq = (size_t)-1;
+	for (i=0, s=b0; i < n; ++i) {
+		if (!counts[i]) {
+			--qf->distinct;
+			continue;
+		}
+		q = fps[i] >> qf->rbits;
+		r = fps[i] & (((u_int64_t)1<<qf->rbits)-1);
+		if (q != prevq) {
+			if (s < q)
+				s = q;
+			slot[q] |= QF_OCCUPIED;
+			slot[s] = (slot[s] & QF_OCCUPIED) | r |
+				(s != q ? QF_SHIFTED : 0);
+			prevq = q;
+		} else {
+			slot[s] = (slot[s] & QF_OCCUPIED) | r |
+				QF_CONTINUATION | QF_SHIFTED;
+		}
+		QuotientSetCount(qf, s, counts[i]);
+		s += 1+QuotientDigits(counts[i]);
+	}
+	for (qf->used -= end-b0; b0 < end; ++b0)
+		if (!QF_EMPTY(slot[b0]))
+			++qf->used;
+	qf->n -= count;
+	free(fps);
+	free(counts);
+	return 0;
+}
+
+/* Double a filter, moving everything over. The quotient gets the top bit
+ * of the remainder, so the fingerprints don't change. Returns the new
+ * filter (the old one's gone), or NULL if it can't grow, and then the old
+ * one is still there.
+ */
+static QuotientFilter *
+QuotientGrow(QuotientFilter *qf)
+{
+	QuotientFilter *answer;
+	QuotientCursor c;
+	u_int64_t fp, count;
+
+	if (qf->shared || qf->rbits <= QUOTIENT_MINRBITS)
+		return NULL;
+	if (!(answer = QuotientAlloc(qf->qbits+1)))
+		return NULL;
+	c.s = c.b = 0;
+	while (QuotientNext(qf, &c, &fp, &count)) {
+		/* Can't fail - it's half full at most */
+		(void) QuotientInsert(answer, fp, count);
+	}
+	answer->lost = qf->lost;
+	CloseQuotientNgramFilter(qf);
+	return answer;
+}
+
+/* Add to one size's filter, growing it as need be */
+static int
+AddQuotientFingerprint(u_int64_t fp, u_int64_t count, NgramFilterSet *set, int ng)
+{
+	QuotientFilter *qf = (QuotientFilter *)set->filter[ng];
+	QuotientFilter *bigger;
+
+	for (;;) {
+		if (!QF_FULL(qf) && QuotientInsert(qf, fp, count) == 0)
+			return 0;
+		if (!(bigger = QuotientGrow(qf))) {
+			/* Full up - the space beyond 7/8 is still useable */
+			if (QuotientInsert(qf, fp, count) == 0)
+				return 0;
+			if (!qf->lost && dumplevel > 0)
+				fprintf(stderr, "ngram %d: quotient filter full at %ld slots\n",
+					ng, qf->nslots);
+			qf->lost += count;
+			return 1;
+		}
+		set->filter[ng] = (NgramFilter)(qf = bigger);
+	}
+}
+
+static void
+QuotientLabel(NgramFilterSet *set)
+{
+	QuotientFilter *qf;
+	int ng;
+
+	for (ng=set->ngramsize.min; ng <= set->ngramsize.max; ++ng) {
+		qf = (QuotientFilter *)set->filter[ng];
+		setngramlabel(NGRAM_QUOTIENT, NULL, ng, QF_BYTES(qf->nslots),
+			qf->n, qf->distinct);
+	}
+}
+
+/* Hash a range of ngram sizes at one spot, and add them to the set */
+static int
+AddQuotientFilterRange(void *item, int length, Range range, NgramFilterSet *filter)
+{
+	int i;
+	int ret=0;
+	Fnv64_t hvals[NGRAM_RANGEMAX+1];
+
+	if (range.min > length) return 0;
+	if (range.max > length) range.max = length;
+	fnv_64_buf_range(item, length, FNV1_64_INIT,
+		range.min, range.max, hvals);
+	for (i=range.min; i <= range.max; ++i) {
+		ret += AddQuotientFingerprint(
+			QuotientFingerprint(hvals[i-range.min]), 1, filter, i);
+	}
+	return ret;
+}
+
+/* Same approach as AddBloomNgramFilterSet - the full range of sizes
+ * at each offset, ramping down at the end, either rolled or rehashed.
+ * Returns the number of ngrams we had no room for.
+ */
+int
+AddQuotientNgramFilterSet(void *item, size_t length, NgramFilterSet *vfilter)
+{
+	int i, count;
+	int ret=0;
+	Range r = vfilter->ngramsize;
+	Roll64 roll;
+	u_int64_t hvals[ROLL_MAXN+1];
+
+	if (ngramlabel.hashfamily == HASH_ROLLING) {
+		roll_64_init(&roll, item, length, r.min, r.max);
+		while ((count = roll_64_next(&roll, hvals)) > 0) {
+			for (i=0; i < count; ++i)
+				ret += AddQuotientFingerprint(
+					QuotientFingerprint(hvals[i]), 1,
+					vfilter, r.min+i);
+		}
+	} else {
+		for (i=0; i+r.max <= length; ++i) {
+			ret += AddQuotientFilterRange(item+i, length-i, r, vfilter);
+		}
+		for (--r.max; r.max >= r.min && i+r.max <= length;
+				++i, --r.max) {
+			ret += AddQuotientFilterRange(item+i, length-i, r, vfilter);
+		}
+	}
+	QuotientLabel(vfilter);
+	return ret;
+}
+
+/* Unlike the Bloom filter and count-min sketch, this one's exact (up to
+ * fingerprint collisions). Returns the number not found.
+ */
+int
+DeleteQuotientNgramFilterSet(void *item, size_t length, NgramFilterSet *vfilter)
+{
+	int i, ng;
+	int ret=0;
+	QuotientFilter *qf;
+
+	for (ng=vfilter->ngramsize.min; ng <= vfilter->ngramsize.max; ++ng) {
+		qf = (QuotientFilter *)vfilter->filter[ng];
+		for (i=0; i+ng <= length; ++i) {
+			if (QuotientRemove(qf, QuotientFingerprint(
+					BloomHashItem((u_int8_t *)item + i, ng)), 1) < 0)
+				++ret;
+		}
+	}
+	QuotientLabel(vfilter);
+	return ret;
+}
+
+/* Look up a hashed item, returning its frequency */
+u_int64_t
+FindQuotientHash64(u_int64_t hash, QuotientFilter *qf)
+{
+	u_int64_t fp = QuotientFingerprint(hash);
+	size_t q = fp >> qf->rbits, next;
+	u_int32_t r = fp & (((u_int64_t)1<<qf->rbits)-1);
+	size_t s, start;
+	int found;
+
+	if (!(qf->slot[q] & QF_OCCUPIED))
+		return 0;
+	s = QuotientSearch(qf, q, r, &start, &found);
+	return found ? QuotientCount(qf, s, &next) : 0;
+}
+
+/* Find a single ngram */
+int
+FindQuotientFilter(void *item, int ngram, void *vfilter)
+{
+	u_int64_t count;
+
+	count = FindQuotientHash64(BloomHashItem(item, (size_t)ngram),
+		(QuotientFilter *)vfilter);
+	return count > 0x7fffffff ? 0x7fffffff : (int)count;
+}
+
+/* Chop an item into ngrams, and total up their frequencies */
+int
+FindQuotientNgramFilterSet(void *item, size_t length, NgramFilterSet *vfilter)
+{
+	int i, ng;
+	int ret=0;
+
+	for (ng=vfilter->ngramsize.min; ng <= vfilter->ngramsize.max; ++ng) {
+		for (i=0; i+ng <= length; ++i) {
+			ret += FindQuotientFilter((u_int8_t *)item + i,
+				ng, vfilter->filter[ng]);
+		}
+	}
+	return ret;
+}
+
+int
+FindQuotientNgramDistFilter(void *item, size_t length, int ngram, double *mu, double *sigma, double *rho, NgramFilterSet *vfilter)
+{
+	int i;
+	int total=0;
+	static int frequencies[NGRAM_MAX];
+
+	for (i=0; i+ngram <= length && i < NGRAM_MAX; ++i) {
+		frequencies[i] =
+			FindQuotientFilter((u_int8_t *)item + i, ngram,
+				vfilter->filter[ngram]);
+		total += frequencies[i];
+	}
+	intarraystats(frequencies, i, mu, sigma, rho);
+	return total;
+}
+
+/* Statistics of the counts of the distinct fingerprints. As with the
+ * trie, there are no empty counters in here to average in.
+ */
+void
+DistQuotientNgramFilter(int ngram, double *mu, double *sigma,
+	u_int64_t *max, u_int64_t *min, NgramFilterSet *vfilter)
+{
+	QuotientFilter *qf = (QuotientFilter *)vfilter->filter[ngram];
+	QuotientCursor c;
+	u_int64_t fp, count;
+	size_t n=0;
+	double sum=0.0, sumsquare=0.0;
+
+	*mu = *sigma = 0.0;
+	*max = 0;
+	*min = 0xffffffff;
+	c.s = c.b = 0;
+	while (QuotientNext(qf, &c, &fp, &count)) {
+		sum += (double)count;
+		sumsquare += (double)count*count;
+		if (count > *max) *max = count;
+		if (count < *min) *min = count;
+		++n;
+	}
+	if (!n) {
+		*min = 0;
+		return;
+	}
+	*mu = sum/(double)n;
+	if (n > 1)
+		*sigma = sqrt((sumsquare - (double)n*(*mu)*(*mu))/(double)(n-1));
+	if (dumplevel > 0)
+		fprintf(stderr, "ngram %d: quotient filter 2^%d slots, %.1lf%% full, %d bit remainders, %ld lost\n",
+			ngram, qf->qbits, 100.0*qf->used/qf->nslots, qf->rbits,
+			qf->lost);
+}
+
+void
+DumpQuotientNgramFilter(FILE *dumpfile, int ngram, QuotientFilter *qf)
+{
+	QuotientCursor c;
+	u_int64_t fp, count;
+
+	if (!dumpfile) return;
+	fprintf(dumpfile, "ngram %d: qbits %d rbits %d used %ld n %ld distinct %ld lost %ld\n",
+		ngram, qf->qbits, qf->rbits, qf->used, qf->n, qf->distinct,
+		qf->lost);
+	c.s = c.b = 0;
+	while (QuotientNext(qf, &c, &fp, &count))
+		fprintf(dumpfile, "%011lx %ld\n", fp, count);
+}
+
+void
+DumpQuotientNgramFilterSet(FILE *dumpfile, NgramFilterSet *vfilter)
+{
+	int ng;
+
+	if (!dumpfile) return;
+	for (ng=vfilter->ngramsize.min; ng <= vfilter->ngramsize.max; ++ng)
+		DumpQuotientNgramFilter(dumpfile, ng,
+			(QuotientFilter *)vfilter->filter[ng]);
+}
+
+/* Merge one set into another, fingerprint by fingerprint. The
+ * fingerprints are the same size whatever the filter size, so this comes
+ * out just as if everything had gone into the one filter.
+ *
+ * They come out in order, though, so if the filter we're adding to is
+ * much smaller, they'd all pile up at the bottom end of it until it grew
+ * - one huge cluster. So we grow it to fit first.
+ */
+void
+MergeQuotientNgramFilterSet(NgramFilterSet *into, NgramFilterSet *from)
+{
+	int ng;
+	QuotientFilter *to, *fr, *bigger;
+	QuotientCursor c;
+	u_int64_t fp, count;
+
+	for (ng=into->ngramsize.min; ng <= into->ngramsize.max; ++ng) {
+		to = (QuotientFilter *)into->filter[ng];
+		fr = (QuotientFilter *)from->filter[ng];
+		if (!to || !fr) continue;
+		while (to->used + fr->used + 4 >= to->nslots - to->nslots/8 &&
+				(bigger = QuotientGrow(to)))
+			into->filter[ng] = (NgramFilter)(to = bigger);
+		c.s = c.b = 0;
+		while (QuotientNext(fr, &c, &fp, &count))
+			(void) AddQuotientFingerprint(fp, count, into, ng);
+		((QuotientFilter *)into->filter[ng])->lost += fr->lost;
+	}
+	if (into == ngram->f)
+		QuotientLabel(into);
+}
+
+#ifdef TEST
+/* Check counts against the truth, as in countmintest: a skewed stream of
+ * items into two filters, which are then merged, then some taken back out.
+ * The only errors should be fingerprint collisions, which are rare.
+ */
+FILE *dumpfile=NULL;
+int dumplevel;
+
+static void
+itemof(u_int8_t *item, long int id)
+{
+	memcpy(item, &id, 8);
+}
+
+int
+main(int argc, char **argv)
+{
+	long int items = 1000000, count = 0;
+	long int i, id, found, errors=0;
+	int c;
+	double r;
+	u_int8_t item[8];
+	int *truth;
+	NgramFilterSet *set[2];
+	Range range = {8, 8};
+	QuotientFilter *qf;
+
+	while ((c = getopt(argc, argv, "i:c:d:")) >= 0) {
+		switch (c) {
+		case 'i':
+			items = atol(optarg);
+			break;
+		case 'c':
+			count = atol(optarg);
+			break;
+		case 'd':
+			dumplevel = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr,
+				"Usage: quotienttest [-i distinct items] [-c stream length] [-d dumplevel]\n");
+			exit(1);
+		}
+	}
+	if (!count)
+		count = 10*items;
+	set[0] = NewQuotientNgramFilterSet(range);
+	set[1] = NewQuotientNgramFilterSet(range);
+	truth = (int *)calloc(items, sizeof(int));
+	if (!set[0] || !set[1] || !truth)
+		exit(2);
+
+	srandom(1);
+	for (i=0; i < count; ++i) {
+		/* Cubing a uniform variable piles things up near 0 */
+		r = (double)random()/((double)RAND_MAX+1.0);
+		id = (long int)(r*r*r*items);
+		++truth[id];
+		itemof(item, id);
+		AddQuotientNgramFilterSet(item, 8, set[i&1]);
+	}
+	MergeQuotientNgramFilterSet(set[0], set[1]);
+	qf = (QuotientFilter *)set[0]->filter[8];
+	printf("merged: 2^%d slots, %ld used, n %ld distinct %ld\n",
+		qf->qbits, qf->used, qf->n, qf->distinct);
+	/* Take every third item out once */
+	for (id=0; id < items; id += 3) {
+		if (!truth[id]) continue;
+		itemof(item, id);
+		if (DeleteQuotientNgramFilterSet(item, 8, set[0]) == 0)
+			--truth[id];
+		else if (errors++ < 10)
+			fprintf(stderr, "item %ld: delete failed\n", id);
+	}
+	qf = (QuotientFilter *)set[0]->filter[8];
+	for (id=0; id < items; ++id) {
+		itemof(item, id);
+		found = FindQuotientFilter(item, 8, qf);
+		if (found != truth[id] && errors++ < 10)
+			fprintf(stderr, "item %ld: count %ld, not %d\n",
+				id, found, truth[id]);
+	}
+	printf("after deletes: %ld used, n %ld distinct %ld\n",
+		qf->used, qf->n, qf->distinct);
+	printf("%s\n", errors ? "FAILED" : "ok");
+	exit(errors != 0);
+}
+#endif
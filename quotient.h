@@ -0,0 +1,92 @@
+/* A counting quotient filter, as another alternative to the Bloom filter.
+ *
+ * Each ngram's hash is cut down to a fingerprint of QUOTIENT_FPBITS bits,
+ * and the fingerprint split into a quotient (the top qbits) and a
+ * remainder (the rest). The quotient picks the "canonical" slot, and only
+ * the remainder is stored. Remainders with the same quotient sit together
+ * in a run, in order, and runs sit in quotient order, pushed to the right
+ * of their canonical slots as need be; three metadata bits per slot (the
+ * usual occupied, continuation and shifted) are enough to find any run.
+ * So a lookup is a short scan, one or two cache lines, around one spot.
+ *
+ * Counts are kept in the slots too: a remainder seen once is just the
+ * one slot, and anything more is followed by counter slots (the fourth
+ * metadata bit) holding count-1, 28 bits at a time. Since most ngrams
+ * are seen once or twice, that's far more compact than a counter per
+ * Bloom filter bit.
+ *
+ * The fingerprint size is fixed, so when the filter fills up it can
+ * double, with the remainders one bit shorter, and come out just as if
+ * it had been that size to begin with. For the same reason, filters built
+ * separately (per file or per thread) merge exactly: the only errors are
+ * fingerprint collisions, the same for any way of putting it together.
+ *
+ * A filter in a shared memory file can't be moved, so can't grow; it
+ * starts out at about the size of the Bloom filter's expected entries
+ * instead.
+ */
+
+#ifndef _QUOTIENT_H
+#define _QUOTIENT_H
+
+#define QUOTIENT_FPBITS		44	/* bits of the hash kept */
+#define QUOTIENT_VALUEBITS	28	/* bits in a slot for a remainder/count */
+#define QUOTIENT_MINQBITS	16	/* start here, so remainders start at 28 */
+#define QUOTIENT_MINRBITS	8	/* don't grow past this */
+
+/* Slot layout */
+#define QF_VALUE	0x0fffffffU
+#define QF_OCCUPIED	0x10000000U	/* some run has its canonical slot here */
+#define QF_CONTINUATION	0x20000000U	/* not the first of its run */
+#define QF_SHIFTED	0x40000000U	/* not in its canonical slot */
+#define QF_COUNTER	0x80000000U	/* count digits, for the remainder before */
+
+typedef struct _QuotientFilter {
+	/* qbits - quotient bits; there are 2^qbits canonical slots
+	 * rbits - remainder bits (QUOTIENT_FPBITS-qbits)
+	 * shared - in a shared memory file, so can't grow
+	 * nslots - 2^qbits
+	 * xslots - extra slots after those, for runs pushed off the end
+	 * used - slots in use, counters included
+	 * n - total number of items inserted
+	 * distinct - number of distinct fingerprints
+	 * lost - items we had no room for
+	 */
+	int qbits, rbits;
+	int shared;
+	int pad;
+	size_t nslots, xslots;
+	size_t used;
+	size_t n, distinct, lost;
+	u_int32_t slot[0];
+} QuotientFilter;
+
+QuotientFilter *
+#ifdef SHMALLOC
+NewQuotientNgramFilter(int ngram, char *shmfilename, int mode);
+#else
+NewQuotientNgramFilter(int ngram);
+#endif
+
+NgramFilterSet *
+#ifdef SHMALLOC
+NewQuotientNgramFilterSet(Range ngram, char *shmfilename, int mode);
+#else
+NewQuotientNgramFilterSet(Range ngram);
+#endif
+
+/* Basic operations - these parallel the ones in bloom.h */
+int AddQuotientNgramFilterSet(void *item, size_t length, NgramFilterSet *vfilter);
+int DeleteQuotientNgramFilterSet(void *item, size_t length, NgramFilterSet *vfilter);
+u_int64_t FindQuotientHash64(u_int64_t hash, QuotientFilter *qf);
+int FindQuotientFilter(void *item, int ngram, void *vfilter);
+int FindQuotientNgramFilterSet(void *item, size_t length, NgramFilterSet *vfilter);
+int FindQuotientNgramDistFilter(void *item, size_t length, int ngram, double *mu, double *sigma, double *rho, NgramFilterSet *vfilter);
+void DistQuotientNgramFilter(int ngram, double *mu, double *sigma, u_int64_t *max, u_int64_t *min, NgramFilterSet *vfilter);
+void DumpQuotientNgramFilter(FILE *file, int ngram, QuotientFilter *qf);
+void DumpQuotientNgramFilterSet(FILE *file, NgramFilterSet *vfilter);
+void CloseQuotientNgramFilter(QuotientFilter *qf);
+void CloseQuotientNgramFilterSet(NgramFilterSet *vfilter);
+void MergeQuotientNgramFilterSet(NgramFilterSet *into, NgramFilterSet *from);
+
+#endif /* _QUOTIENT_H */
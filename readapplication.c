@@ -203,6 +203,7 @@ struct protoreader portreaders[] = {
 	{IMAPS_PROTO,	readimaps},
 	{-1,		readportother}
 };
+ReaderTable porttable = { "port", portreaders, 65536 };
 
 /* A few ICMP/ICMPv6 types we'll read. Where possible, we'll share
  * handlers between the two because why not.
@@ -218,6 +219,7 @@ struct protoreader typereaders[] = {
 	{ICMP_PARAMETERPROB,	readparameterprob},
 	{-1,		readtypeother},
 };
+ReaderTable typetable = { "icmp type", typereaders, 256 };
 
 struct protoreader type6readers[] = {
 	{ICMP6_DST_UNREACH,	readunreach},
@@ -236,3 +238,4 @@ struct protoreader type6readers[] = {
 	{ND_REDIRECT,	readneighdisc},
 	{-1,		readtypeother},
 };
+ReaderTable type6table = { "icmp6 type", type6readers, 256 };
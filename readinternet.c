@@ -13,6 +13,7 @@
 #include "snorthostcheck.h"
 #include "taggedhostcheck.h"
 #include "entropy.h"
+#include "select.h"
 
 
 /* For now, we are only looking at IPv4 packets. Eventually, we'll
@@ -77,16 +78,16 @@ int readipv4(struct readproto *r, void *esrc, void *edest)
 
 	/* Check if we are filtering this */
 	/* Note: ip->protocol is one byte, so no swapping needed */
-	if (inrangelist(ip->protocol, protocols) != inprotocols)
+	if (!selectproto(ip->protocol))
 		return 0;
 
 	/* Check against snort and/or tagged host list */
 	if (snorthostflag >= 0) {
-		if (checksnorthosts(ip->saddr, ip->daddr) != snorthostflag)
+		if (selectsnorthosts(ip->saddr, ip->daddr) != snorthostflag)
 			return 0;
 	}
 	if (taggedhostflag >= 0) {
-		if (checktaggedhosts(ip->saddr, ip->daddr) != taggedhostflag)
+		if (selecttaggedhosts(ip->saddr, ip->daddr) != taggedhostflag)
 			return 0;
 	}
 
@@ -95,8 +96,9 @@ int readipv4(struct readproto *r, void *esrc, void *edest)
 	rp.outheader = r->header;
 	rp.header = r->header + ip->ihl*4;
 	rp.len = len;
+	rp.context = NULL;
 
-	if ((*readerswitch(rp.type, transportreaders))(&rp, &ip->saddr, &ip->daddr) < 0) {
+	if ((*readerdispatch(rp.type, &transporttable))(&rp, &ip->saddr, &ip->daddr) < 0) {
 		return -1;
 	}
 	return 1;
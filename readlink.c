@@ -12,6 +12,11 @@
 #include "ngram.h"
 #include "entropy.h"
 #include "ymd.h"
+#include "pcapmap.h"
+#include "pcapzip.h"
+#include "pcapindex.h"
+#include "pcapbpf.h"
+#include "select.h"
 
 /*  - skeleton code which reads pcap capture files and
  * checks entropy and/or ngram distributions of the packet body.
@@ -38,6 +43,7 @@ struct protoreader etherreaders[] = {
 		{0x1ab,/* Cisco Discovery Protocol */ readswitch},
 		{-1, readother},
 };
+ReaderTable ethertable = { "ethertype", etherreaders, 65536 };
 
 #ifdef notdef
 int
@@ -81,61 +87,218 @@ nonzerobyte(void *range, int size)
  * and passes it up to the next level.
  */
 
+/* The selection for a packet, however it was read, and then the packet
+ * itself. Returns 0 when we're far enough past the end of the time range
+ * to stop, else 1 (with the packet's result, if any, in *ret). filter is
+ * the selection program (see pcapbpf.h), unless libpcap has run it
+ * already.
+ */
+static int
+readrecord(struct pcap_pkthdr *pkt_header, u_int8_t *pkt_data,
+	int *afterrange, int *atend, int *ret)
+{
+	int process_packet(int len, u_int8_t *data);
+
+	/* The pcap_pkthdr structure isn't actually the
+	 * packet header. Rather, it just has the time
+	 * the packet was received and the length of the
+	 * packet. We can use that information to see if it
+	 * is in our time range, or has been tagged by snort.
+	 */
+	/* Check time range */
+	if (timeflag) {
+		switch (intimerange(&pkt_header->ts,
+				&starttime, &endtime)) {
+		case -1:	/* before range */
+			return 1;
+		case 0:		/* in range */
+			break;
+		case 1:		/* after range */
+			++*afterrange;
+			/* We keep looking for a few packets
+			 * after the end of the range just in 
+			 * case they are slightly out of order
+			 */
+#define AFTERMAX	10
+			if (*afterrange > AFTERMAX) {
+				(*atend)++;
+				return 0;
+			} else {
+				return 1;
+			}
+		}
+	}
+	/* Anything the readers would throw out, the snort list included
+	 * (see select.h)
+	 */
+	if (!selectpacket(pkt_header, pkt_data))
+		return 1;
+
+	/* Now process the packet data, or have a thread do it (unless
+	 * we're a worker already - see ngramthreadfiles)
+	 */
+	if (ngramthreads && !threadset && !threadpipe)
+		ngramthreadpacket(pkt_header->caplen, pkt_data);
+	else
+		*ret = process_packet(pkt_header->caplen, pkt_data);
+	return 1;
+}
+
 int
 readpcap(pcap_t *readp, int *atend)
 {
 	struct pcap_pkthdr *pkt_header;
 	u_int8_t *pkt_data;
-	u_int8_t *pkt;
-	struct readproto rp;
-	struct ether_header *eth;
-	struct etypes *ttype;
-	u_int32_t caplen;
 	int ret;
-	int len;
 	int afterrange=0;
-	int process_packet(int len, u_int8_t *data);
 
+	/* libpcap can weed out most of what we don't want before it gets
+	 * here - but not with a time range, where it would hide packets
+	 * past the end that we have to count.
+	 */
+	if (selectfilter.bf_len && !timeflag)
+		(void) pcap_setfilter(readp, &selectfilter);
 	while ((ret = pcap_next_ex(readp, &pkt_header, (const u_char **)&pkt_data)) > 0) {
-		/* The pcap_pkthdr structure isn't actually the
-		 * packet header. Rather, it just has the time
-		 * the packet was received and the length of the
-		 * packet. We can use that information to see if it
-		 * is in our time range, or has been tagged by snort.
-		 */
-		/* Check time range */
-		if (timeflag) {
-			switch (intimerange(&pkt_header->ts,
-					&starttime, &endtime)) {
-			case -1:	/* before range */
-				continue;
-			case 0:		/* in range */
-				break;
-			case 1:		/* after range */
-				++afterrange;
-				/* We keep looking for a few packets
-				 * after the end of the range just in 
-				 * case they are slightly out of order
-				 */
-#define AFTERMAX	10
-				if (afterrange > AFTERMAX) {
-					*atend++;
-					return ret;
-				} else {
-					continue;
-				}
-			}
+		if (!readrecord(pkt_header, pkt_data, &afterrange, atend, &ret))
+			break;
+	}
+	return ret;
+}
+
+/* The records from start to end of a mapped file, for a worker thread.
+ * The range was cut off at the end of the time range (splitpcap), so
+ * there's no stopping early here.
+ */
+int
+readpcaprange(PcapMap *pm, size_t start, size_t end)
+{
+	PcapMap range = *pm;
+	struct pcap_pkthdr pkt_header;
+	u_int8_t *pkt_data;
+	int ret=0;
+	int afterrange=0, atend=0;
+
+	range.offset = start;
+	range.end = end;
+	while (pcapmapnext(&range, &pkt_header, &pkt_data) > 0)
+		(void) readrecord(&pkt_header, pkt_data, &afterrange, &atend,
+			&ret);
+	return ret;
+}
+
+/* With worker threads, rather than copying each packet out to them, we
+ * walk the record headers, which is quick, and hand them the file in
+ * ranges of whole records, to select and process where they lie
+ * (readpcaprange). The only thing we need to look at is the time, to
+ * stop exactly where readrecord would have; the workers apply the rest
+ * of the selection, so the packets processed are the same.
+ */
+static void
+splitpcap(char *filename, PcapMap *pm, int *atend)
+{
+	struct pcap_pkthdr pkt_header;
+	u_int8_t *pkt_data;
+	size_t start, here, chunk;
+	int got;
+	int afterrange=0;
+
+	chunk = pm->size/(4*ngramthreads);
+	chunk = chunk < PCAP_CHUNKMIN ? PCAP_CHUNKMIN :
+		chunk > PCAP_CHUNKMAX ? PCAP_CHUNKMAX : chunk;
+	start = pm->offset;
+	while ((here = pm->offset),
+			(got = pcapmapnext(pm, &pkt_header, &pkt_data)) > 0) {
+		if (timeflag && intimerange(&pkt_header.ts, &starttime,
+				&endtime) > 0 && ++afterrange > AFTERMAX) {
+			(*atend)++;
+			pm->offset = here;
+			break;
 		}
-		/* Check against snort list */
-		if (snortflag >= 0) {
-			if (checksnort(&pkt_header->ts, pkt_header->len,
-				startymd, endymd) != snortflag)
-					continue;
+		if (pm->offset - start >= chunk) {
+			ngramthreadrange(pm, start, pm->offset);
+			start = pm->offset;
 		}
+	}
+	if (got < 0)
+		fprintf(stderr, "%s: truncated record at %lu\n", filename,
+			(unsigned long)pm->offset);
+	if (pm->offset > start)
+		ngramthreadrange(pm, start, pm->offset);
+	ngramthreadclose(pm);
+}
 
-		/* Now process the packet data */
-		ret = process_packet(pkt_header->caplen, pkt_data);
+/* Read a capture file by name: in place if it's classic pcap (see
+ * pcapmap.h), through libpcap if not - decompressing it first if need be
+ * (see pcapzip.h). With a time range and an index (see pcapindex.h), we
+ * skip the file if it's all outside the range, or go straight to the
+ * start of it if we can.
+ */
+int
+readpcapfile(char *filename, int *atend)
+{
+	PcapMap *pm;
+	pcap_t *readp;
+	char errbuf[PCAP_ERRBUF_SIZE];
+	struct pcap_pkthdr pkt_header;
+	u_int8_t *pkt_data;
+	int ret=0, got;
+	int afterrange=0;
+	FILE *fp;
+	int kind;
+	PcapIndex *pi;
+	size_t seek=0;
+
+	if (timeflag && (pi = pcapindexopen(filename))) {
+		switch (pcapindexrange(pi, &starttime, &endtime)) {
+		case -1:	/* all before */
+			pcapindexclose(pi);
+			return 0;
+		case 1:		/* all after, as if we'd read past the end */
+			(*atend)++;
+			pcapindexclose(pi);
+			return 0;
+		}
+		seek = pcapindexseek(pi, &starttime);
+		pcapindexclose(pi);
+	}
+	if ((fp = pcapzipopen(filename, &kind))) {
+		readp = pcap_fopen_offline(fp, errbuf);
+		if (!readp) {
+			fprintf(stderr, "%s: %s\n", filename, errbuf);
+			fclose(fp);
+			return -1;
+		}
+		ret = readpcap(readp, atend);
+		pcap_close(readp);
+		return ret;
+	}
+	if (kind != PCAPZIP_NONE)
+		return -1;
+	if (!(pm = pcapmapopen(filename))) {
+		readp = pcap_open_offline(filename, errbuf);
+		if (!readp) {
+			fprintf(stderr, "%s: %s\n", filename, errbuf);
+			return -1;
+		}
+		ret = readpcap(readp, atend);
+		pcap_close(readp);
+		return ret;
+	}
+	if (seek > pm->offset && seek < pm->end)
+		pm->offset = seek;
+	if (ngramthreads && !threadset && !threadpipe) {
+		splitpcap(filename, pm, atend);
+		return 0;
+	}
+	while ((got = pcapmapnext(pm, &pkt_header, &pkt_data)) > 0) {
+		if (!readrecord(&pkt_header, pkt_data, &afterrange, atend,
+				&ret))
+			break;
 	}
+	if (got < 0)
+		fprintf(stderr, "%s: truncated record at %lu\n", filename,
+			(unsigned long)pm->offset);
+	pcapmapclose(pm);
 	return ret;
 }
 
@@ -143,15 +306,15 @@ int
 process_packet(int len, u_int8_t *data)
 {
 	struct readproto rp;
-	int ret = 0;
 
 	rp.type = ntohs(((struct ether_header*)
 					data)->ether_type);
 	rp.outheader = data;
 	rp.header = data + sizeof(struct ether_header);
 	rp.len = len;
+	rp.context = NULL;
 
-	if ((*readerswitch(rp.type, etherreaders))(&rp,
+	if ((*readerdispatch(rp.type, &ethertable))(&rp,
 		((struct ether_header*)data)->ether_shost,
 		((struct ether_header*)data)->ether_dhost) < 0)
 			/* ethernet error - ignore for now */
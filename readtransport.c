@@ -18,6 +18,7 @@
 #include "ngram.h"
 #include "entropy.h"
 #include "protocols.h"
+#include "select.h"
 
 int transportprotocols[MAX_PROTOCOLS] = {
 	ICMP_PROTO,
@@ -34,6 +35,29 @@ int transportprotocols[MAX_PROTOCOLS] = {
 	-1
 };
 
+/* The entropy selection (-E), for any of the readers below; it lives
+ * here rather than with the rest of PacketContext so that only the
+ * readers need the entropy code.
+ */
+int
+packetentropy(PacketContext *pc)
+{
+	/* ignore dataless packets for this */
+	if (entropyflag < 0 || pc->length <= 0)
+		return 1;
+	if (entropywindow > 0) {
+		pc->nsegments = entropysegments(pc->payload, pc->length,
+			entropywindow, &entropyrange, entropyflag,
+			entropymargin, pc->segment, PACKET_SEGMENTS);
+		return pc->nsegments > 0;
+	}
+	if (!entropyselect(pc->payload, pc->length, pc->bytes,
+			&entropyrange, entropyflag, entropymargin))
+		return 0;
+	pc->counted = 1;
+	return 1;
+}
+
 int
 checkicmpchecksum(struct icmphdr *icmp)
 {
@@ -57,7 +81,7 @@ int readicmp(struct readproto *r, void *src, void *dest)
 	struct icmphdr *icmp = (struct icmphdr *)r->header;
 	u_int32_t *isrc, *idest;
 	struct readproto rp;
-	double ent;
+	PacketContext pc;
 
 	isrc = (u_int32_t *)src;
 	idest = (u_int32_t *)dest;
@@ -73,32 +97,29 @@ int readicmp(struct readproto *r, void *src, void *dest)
 	rp.outheader = r->header;
 	rp.header = r->header + sizeof(struct icmphdr);
 	rp.len = r->len - sizeof(struct icmphdr);
+	packetcontext(&pc, rp.header, rp.len);
+	rp.context = &pc;
 
 	/* Check if we are filtering this */
-	if (inrangelist(rp.type, ports) != inports)
+	if (!selectport(rp.type))
 		return 0;
 
 
 	/* Evaluate entropy of packet body */
-	if (entropyflag >= 0) {
-		if (rp.len > 0) {	/* ignore dataless packets for this */
-			ent = entropy(rp.header, rp.len);
-			if (indoublerange(ent, &entropyrange) != entropyflag) {
-				/* @@ maybe do high entropy stuff instead? */
-				return 0;
-			}
-		}
+	if (!packetentropy(&pc)) {
+		/* @@ maybe do high entropy stuff instead? */
+		return 0;
 	}
 
 	/* For the first try, we will just mash together all
 	 * the ngrams.
 	 */
 
-	(*ngram->op->additemset)(rp.header, rp.len, ngram->f);
+	ngramaddpacket(&pc);
 
 #ifdef notdef
 	/* Do any custom processing for individual protocols */
-	if ((*readerswitch(rp.type, typereaders))(&rp, src, dest) < 0) {
+	if ((*readerdispatch(rp.type, &typetable))(&rp, src, dest) < 0) {
 		return -1;
 	}
 #endif
@@ -116,8 +137,8 @@ int readtcp(struct readproto *r, void *src, void *dest)
 	struct tcphdr *tcp = (struct tcphdr *)r->header;
 	u_int32_t *isrc, *idest;
 	struct readproto rp;
+	PacketContext pc;
 	u_int16_t tsource, tdest;
-	double ent;
 
 	isrc = (u_int32_t *)src;
 	idest = (u_int32_t *)dest;
@@ -157,32 +178,29 @@ int readtcp(struct readproto *r, void *src, void *dest)
 	rp.outheader = r->header;
 	rp.header = r->header + tcp->doff*4;
 	rp.len = r->len - tcp->doff*4;
+	packetcontext(&pc, rp.header, rp.len);
+	rp.context = &pc;
 
 	/* Check if we are filtering this */
-	if (inrangelist(rp.type, ports) != inports)
+	if (!selectport(rp.type))
 		return 0;
 
 	/* Evaluate entropy of packet body */
-	if (entropyflag >= 0) {
-		if (rp.len > 0) {	/* ignore dataless packets for this */
-			ent = entropy(rp.header, rp.len);
-			if (indoublerange(ent, &entropyrange) != entropyflag) {
-				/* @@ maybe do high entropy stuff instead? */
-				return 0;
-			}
-		}
+	if (!packetentropy(&pc)) {
+		/* @@ maybe do high entropy stuff instead? */
+		return 0;
 	}
 
 	/* For the first try, we will just mash together all
 	 * the ngrams.
 	 */
-	(*ngram->op->additemset)(rp.header, rp.len, ngram->f);
+	ngramaddpacket(&pc);
 	
 	
 #ifdef notdef
 	/* Do any custom processing for individual protocols */
 
-	if ((*readerswitch(rp.type, portreaders))(&rp, src, dest) < 0) {
+	if ((*readerdispatch(rp.type, &porttable))(&rp, src, dest) < 0) {
 		return -1;
 	}
 #endif
@@ -195,9 +213,9 @@ int readudp(struct readproto *r, void *src, void *dest)
 	struct udphdr *udp = (struct udphdr *)r->header;
 	u_int32_t *isrc, *idest;
 	struct readproto rp;
+	PacketContext pc;
 	u_int16_t usource, udest;
 	u_int16_t udplen;
-	double ent;
 
 	isrc = (u_int32_t *)src;
 	idest = (u_int32_t *)dest;
@@ -223,31 +241,28 @@ int readudp(struct readproto *r, void *src, void *dest)
 	/* udp header is fixed at 8 bytes */
 	rp.header = r->header + sizeof(struct udphdr);
 	rp.len = r->len - sizeof(struct udphdr);
+	packetcontext(&pc, rp.header, rp.len);
+	rp.context = &pc;
 
 	/* Check if we are filtering this */
-	if (inrangelist(rp.type, ports) != inports)
+	if (!selectport(rp.type))
 		return 0;
 
 	/* Evaluate entropy of packet body */
-	if (entropyflag >= 0) {
-		if (rp.len > 0) {	/* ignore dataless packets for this */
-			ent = entropy(rp.header, rp.len);
-			if (indoublerange(ent, &entropyrange) != entropyflag) {
-				/* @@ maybe do high entropy stuff instead? */
-				return 0;
-			}
-		}
+	if (!packetentropy(&pc)) {
+		/* @@ maybe do high entropy stuff instead? */
+		return 0;
 	}
 
 	/* For the first try, we will just mash together all
 	 * the ngrams.
 	 */
-	(*ngram->op->additemset)(rp.header, rp.len, ngram->f);
+	ngramaddpacket(&pc);
 	
 	/* Do any custom processing for individual protocols */
 
 #ifdef notdef
-	if ((*readerswitch(rp.type, portreaders))(&rp, src, dest) < 0) {
+	if ((*readerdispatch(rp.type, &porttable))(&rp, src, dest) < 0) {
 		return -1;
 	}
 #endif
@@ -295,3 +310,4 @@ struct protoreader transportreaders[] = {
 	{OSPF_PROTO, readospf},
 	{-1, readotherip},
 };
+ReaderTable transporttable = { "protocol", transportreaders, 256 };
@@ -0,0 +1,421 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <pcap/pcap.h>
+#include <net/ethernet.h>
+#include <arpa/inet.h>
+#include <netinet/ip.h>
+#include "ngram.h"
+#include "protocols.h"
+#include "snortcheck.h"
+#include "snorthostcheck.h"
+#include "taggedhostcheck.h"
+#include "select.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+/* The selection, compiled - see select.h */
+
+/* What a test gets to look at; ip is past the ethernet header, with
+ * caplen bytes of it captured.
+ */
+typedef struct _selectPacket {
+	struct pcap_pkthdr *h;
+	u_int8_t *ip;
+	u_int caplen;
+	int proto;
+	u_int32_t saddr, daddr;
+} SelectPacket;
+
+typedef struct _selectTest {
+	char *name;
+	int (*test)(SelectPacket *sp);	/* 0 to throw the packet out */
+} SelectTest;
+
+#define SELECT_TESTS	8
+
+/* Each thread's counts, by test:
+ * order - the order we try them in
+ * tested, rejected - when run in that order
+ * sampled - how many packets we've run all of them on, and for each,
+ *	how many it would have rejected and how long it took
+ */
+typedef struct _selectCounts {
+	int order[SELECT_TESTS];
+	u_int64_t packets;
+	u_int64_t tested[SELECT_TESTS], rejected[SELECT_TESTS];
+	u_int64_t sampled;
+	u_int64_t samplerejected[SELECT_TESTS], ticks[SELECT_TESTS];
+	struct _selectCounts *next;
+} SelectCounts;
+
+/* A set of IPv4 addresses (in network order, as they are in the
+ * packet), open addressed. Zero marks an empty slot, so 0.0.0.0 itself
+ * gets a flag.
+ */
+typedef struct _hostSet {
+	u_int32_t *slot;
+	int bits;
+	int haszero;
+} HostSet;
+
+static int compiled;
+static u_int8_t protomap[256/8];
+static u_int8_t portmap[65536/8];
+static HostSet taggedset, snorthostset;
+static SelectTest tests[SELECT_TESTS];
+static int ntests;
+
+static __thread SelectCounts *counts;
+static SelectCounts *allcounts;
+static pthread_mutex_t countslock = PTHREAD_MUTEX_INITIALIZER;
+
+#define getbit(map, i)	((map)[(i) >> 3] & (1 << ((i) & 7)))
+#define setbit(map, i)	((map)[(i) >> 3] |= (1 << ((i) & 7)))
+
+/* Cheap, for timing the tests against each other; only the ratios
+ * matter, so cycles will do where we have them.
+ */
+static inline u_int64_t
+selectclock(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u_int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+static inline u_int32_t
+hostslot(HostSet *hs, u_int32_t host)
+{
+	/* Fibonacci hashing - the top bits of the product */
+	return (host * 0x9e3779b1U) >> (32 - hs->bits);
+}
+
+static int
+hostsetinit(HostSet *hs, struct in_addr *hosts, int n)
+{
+	u_int32_t mask, i;
+	int j;
+
+	/* At most half full */
+	for (hs->bits = 4; (1 << hs->bits) < 2*n; ++hs->bits)
+		;
+	if (!(hs->slot = (u_int32_t *)calloc(1 << hs->bits,
+			sizeof(u_int32_t))))
+		return -1;
+	mask = (1 << hs->bits) - 1;
+	for (j=0; j < n; ++j) {
+		if (!hosts[j].s_addr) {
+			hs->haszero = 1;
+			continue;
+		}
+		for (i = hostslot(hs, hosts[j].s_addr); hs->slot[i] &&
+				hs->slot[i] != hosts[j].s_addr; i = (i+1) & mask)
+			;
+		hs->slot[i] = hosts[j].s_addr;
+	}
+	return 0;
+}
+
+static inline int
+inhostset(HostSet *hs, u_int32_t host)
+{
+	u_int32_t mask = (1 << hs->bits) - 1, i;
+
+	if (!host)
+		return hs->haszero;
+	for (i = hostslot(hs, host); hs->slot[i]; i = (i+1) & mask) {
+		if (hs->slot[i] == host)
+			return 1;
+	}
+	return 0;
+}
+
+int
+selectproto(int proto)
+{
+	if (!compiled || proto < 0 || proto > 255)
+		return inrangelist(proto, protocols) == inprotocols;
+	return getbit(protomap, proto) != 0;
+}
+
+int
+selectport(int port)
+{
+	if (!compiled || port < 0 || port > 65535)
+		return inrangelist(port, ports) == inports;
+	return getbit(portmap, port) != 0;
+}
+
+int
+selecttaggedhosts(u_int32_t source, u_int32_t dest)
+{
+	if (!taggedset.slot)
+		return checktaggedhosts(source, dest);
+	return inhostset(&taggedset, source) || inhostset(&taggedset, dest);
+}
+
+int
+selectsnorthosts(u_int32_t source, u_int32_t dest)
+{
+	if (!snorthostset.slot)
+		return checksnorthosts(source, dest);
+	return inhostset(&snorthostset, source) ||
+		inhostset(&snorthostset, dest);
+}
+
+/* The tests, as readrecord and the readers would make them */
+static int
+snorttest(SelectPacket *sp)
+{
+	return checksnort(&sp->h->ts, sp->h->len, startymd, endymd) ==
+		snortflag;
+}
+
+static int
+prototest(SelectPacket *sp)
+{
+	return getbit(protomap, sp->proto) != 0;
+}
+
+static int
+snorthosttest(SelectPacket *sp)
+{
+	return selectsnorthosts(sp->saddr, sp->daddr) == snorthostflag;
+}
+
+static int
+taggedtest(SelectPacket *sp)
+{
+	return selecttaggedhosts(sp->saddr, sp->daddr) == taggedhostflag;
+}
+
+/* The lower numbered port for tcp and udp, the type for icmp (see
+ * readtcp, readicmp); IP in IP goes round again, so isn't tested here.
+ */
+static int
+porttest(SelectPacket *sp)
+{
+	u_int hl = (sp->ip[0] & 0xf) * 4;
+	u_int sport, dport;
+
+	switch (sp->proto) {
+	case TCP_PROTO:
+	case UDP_PROTO:
+		if (sp->caplen < hl + 4)
+			return 0;
+		sport = (sp->ip[hl] << 8) | sp->ip[hl+1];
+		dport = (sp->ip[hl+2] << 8) | sp->ip[hl+3];
+		return getbit(portmap, min(sport, dport)) != 0;
+	case ICMP_PROTO:
+		if (sp->caplen < hl + 1)
+			return 0;
+		return getbit(portmap, sp->ip[hl]) != 0;
+	}
+	return 1;
+}
+
+static void
+addtest(char *name, int (*test)(SelectPacket *sp))
+{
+	tests[ntests].name = name;
+	tests[ntests].test = test;
+	++ntests;
+}
+
+int
+selectcompile(void)
+{
+	extern struct in_addr taggedhosts[], snorthosts[];
+	extern int maxhosts;
+	int i, allprotos=1, allports=1;
+
+	/* Ordered to start with as readrecord and the readers had them */
+	ntests = 0;
+	if (snortflag >= 0)
+		addtest("snort", snorttest);
+	memset(protomap, 0, sizeof(protomap));
+	for (i=0; i < 256; ++i) {
+		if (inrangelist(i, protocols) == inprotocols)
+			setbit(protomap, i);
+		else
+			allprotos = 0;
+	}
+	if (!allprotos)
+		addtest("protocol", prototest);
+	if (snorthostflag >= 0) {
+		if (hostsetinit(&snorthostset, snorthosts, maxhosts) < 0)
+			return -1;
+		addtest("snort hosts", snorthosttest);
+	}
+	if (taggedhostflag >= 0) {
+		if (hostsetinit(&taggedset, taggedhosts, maxhosts) < 0)
+			return -1;
+		addtest("tagged hosts", taggedtest);
+	}
+	memset(portmap, 0, sizeof(portmap));
+	for (i=0; i < 65536; ++i) {
+		if (inrangelist(i, ports) == inports)
+			setbit(portmap, i);
+		else
+			allports = 0;
+	}
+	if (!allports)
+		addtest("port", porttest);
+	compiled = 1;
+	return ntests;
+}
+
+static SelectCounts *
+newcounts(void)
+{
+	SelectCounts *sc;
+	int i;
+
+	if (!(sc = (SelectCounts *)calloc(1, sizeof(SelectCounts))))
+		return NULL;
+	for (i=0; i < ntests; ++i)
+		sc->order[i] = i;
+	pthread_mutex_lock(&countslock);
+	sc->next = allcounts;
+	allcounts = sc;
+	pthread_mutex_unlock(&countslock);
+	return sc;
+}
+
+/* Cheapest per packet thrown out first. A test we've never seen reject
+ * anything still gets a little credit, so it isn't stuck at the end.
+ */
+static void
+reorder(SelectCounts *sc)
+{
+	double rank[SELECT_TESTS], r;
+	int i, j, t;
+
+	if (!sc->sampled)
+		return;
+	for (t=0; t < ntests; ++t)
+		rank[t] = ((double)sc->ticks[t] / sc->sampled) /
+			((sc->samplerejected[t] + 1.0) / (sc->sampled + 2.0));
+	for (i=1; i < ntests; ++i) {
+		t = sc->order[i];
+		r = rank[t];
+		for (j=i; j > 0 && rank[sc->order[j-1]] > r; --j)
+			sc->order[j] = sc->order[j-1];
+		sc->order[j] = t;
+	}
+}
+
+/* Run all the tests, timing them, and answer as usual */
+static int
+sample(SelectCounts *sc, SelectPacket *sp)
+{
+	u_int64_t start;
+	int i, t, pass, keep=1;
+
+	++sc->sampled;
+	for (i=0; i < ntests; ++i) {
+		t = sc->order[i];
+		start = selectclock();
+		pass = (*tests[t].test)(sp);
+		sc->ticks[t] += selectclock() - start;
+		if (!pass)
+			++sc->samplerejected[t];
+		if (keep) {
+			++sc->tested[t];
+			if (!pass) {
+				++sc->rejected[t];
+				keep = 0;
+			}
+		}
+	}
+	return keep;
+}
+
+int
+selectpacket(struct pcap_pkthdr *pkt_header, u_int8_t *pkt_data)
+{
+	SelectPacket sp;
+	SelectCounts *sc;
+	int i, t;
+
+	/* IPv4 is all the readers look at, and only these protocols go
+	 * on to add anything
+	 */
+	if (pkt_header->caplen < ETHER_HDR_LEN + sizeof(struct iphdr) ||
+			((pkt_data[12] << 8) | pkt_data[13]) != ETHERTYPE_IP)
+		return 0;
+	sp.ip = pkt_data + ETHER_HDR_LEN;
+	sp.proto = sp.ip[9];
+	switch (sp.proto) {
+	case TCP_PROTO:
+	case UDP_PROTO:
+	case ICMP_PROTO:
+	case IPV4_PROTO:
+		break;
+	default:
+		return 0;
+	}
+	if (!ntests)
+		return 1;
+	sp.h = pkt_header;
+	sp.caplen = pkt_header->caplen - ETHER_HDR_LEN;
+	memcpy(&sp.saddr, sp.ip + 12, sizeof(u_int32_t));
+	memcpy(&sp.daddr, sp.ip + 16, sizeof(u_int32_t));
+
+	if (!(sc = counts) && !(sc = counts = newcounts())) {
+		for (t=0; t < ntests; ++t)
+			if (!(*tests[t].test)(&sp))
+				return 0;
+		return 1;
+	}
+	if (++sc->packets % SELECT_REORDER == 0)
+		reorder(sc);
+	if (sc->packets % SELECT_SAMPLE == 0)
+		return sample(sc, &sp);
+	for (i=0; i < ntests; ++i) {
+		t = sc->order[i];
+		++sc->tested[t];
+		if (!(*tests[t].test)(&sp)) {
+			++sc->rejected[t];
+			return 0;
+		}
+	}
+	return 1;
+}
+
+void
+selectstats(void)
+{
+	SelectCounts *sc;
+	u_int64_t tested, rejected, sampled, ticks;
+	int t;
+
+	for (t=0; t < ntests; ++t) {
+		tested = rejected = sampled = ticks = 0;
+		pthread_mutex_lock(&countslock);
+		for (sc = allcounts; sc; sc = sc->next) {
+			tested += sc->tested[t];
+			rejected += sc->rejected[t];
+			sampled += sc->sampled;
+			ticks += sc->ticks[t];
+		}
+		pthread_mutex_unlock(&countslock);
+		fprintf(stderr, "Select %s: tested %lu, rejected %lu (%.1f%%), "
+			"%.1f ticks each\n", tests[t].name,
+			(unsigned long)tested, (unsigned long)rejected,
+			tested ? 100.0*rejected/tested : 0.0,
+			sampled ? (double)ticks/sampled : 0.0);
+	}
+}
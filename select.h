@@ -0,0 +1,43 @@
+/* The packet selection, compiled.
+ *
+ * Left to the readers, the selections are checked one at a time as the
+ * packet is decoded: the protocol and hosts in readipv4, the ports in
+ * readtcp and friends, each Rangelist walked from the top (inrangelist)
+ * and each host list binary searched, for every packet. Instead, we
+ * turn them once into tables that take a single probe: a bitmap of the
+ * protocols we take, another of the ports (or ICMP types), and hash
+ * sets of the hosts. The readers use those, and selectpacket puts them
+ * all together to throw out packets before they're decoded at all.
+ *
+ * selectpacket tries its tests in whatever order has been cheapest so
+ * far: now and again (SELECT_SAMPLE) it runs all of them on a packet,
+ * timing each and noting which would have thrown it out, and every
+ * SELECT_REORDER packets it puts them in order of cost over the chance
+ * of rejecting. The counts are per thread, so there's no sharing.
+ *
+ * The time range stays in readrecord, which needs to know about packets
+ * past the end, and the entropy in the readers, which have found the
+ * payload.
+ */
+
+#ifndef _SELECT_H
+#define _SELECT_H
+
+#define SELECT_SAMPLE	64	/* time every this many packets */
+#define SELECT_REORDER	4096	/* reorder every this many */
+
+/* Build the tables from the current selection; the number of tests
+ * selectpacket will make, or -1 if we ran out of memory.
+ */
+int selectcompile(void);
+/* 0 if the readers would throw the packet out */
+int selectpacket(struct pcap_pkthdr *pkt_header, u_int8_t *pkt_data);
+/* The readers' own checks, in a probe each; 1 if selected */
+int selectproto(int proto);
+int selectport(int port);
+int selecttaggedhosts(u_int32_t source, u_int32_t dest);
+int selectsnorthosts(u_int32_t source, u_int32_t dest);
+/* How each test did, over all threads */
+void selectstats(void);
+
+#endif /* _SELECT_H */
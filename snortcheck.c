@@ -23,17 +23,43 @@
  * or one more, since the captures start and end midday.
  */
 
-/* Just be simple-minded */
+/* The alerts go in a vector that grows as they're read, and is sorted
+ * by time once they're all in.
+ *
+ * The packets come along in (more or less) time order, so rather than
+ * search for each packet's times, each thread keeps a cursor for each of
+ * the three times it checks (the time, and an hour either side), which
+ * only ever moves forward through the alerts: usually a step or two,
+ * and galloping over a gap. A packet from before where a cursor has got
+ * to is looked up in a hash set of the exact times instead.
+ */
 
-#define TIMESMAX	100000
+#define SNORT_TIMES	1024	/* to start with */
+#define SNORT_CURSORS	3	/* this time, prevhour, nexthour */
 
 struct snorttime {
 	int ymd;		/* Superfluous, but was used in older code */
 	u_int32_t length;
 	struct timeval time;
-} snorttimes[TIMESMAX];
+} *snorttimes;
 
 int maxtimes;
+static int sizetimes;
+
+/* Open addressing, at most half full; a slot is the index of the first
+ * alert with that time, plus 1 (0 for empty). NULL if we couldn't get
+ * the memory, in which case it's back to bsearch.
+ */
+static size_t *timeset;
+static int timebits;
+
+typedef struct _snortCursor {
+	int pos;			/* first alert not before last */
+	int started;
+	struct timeval last;
+} SnortCursor;
+
+static __thread SnortCursor cursors[SNORT_CURSORS];
 
 /* For now, we match strictly on the time. When/if I have more
  * confidence in the length values, I'll use them, too.
@@ -58,10 +84,54 @@ int cmpsnort(const void *a, const void *b)
  * against duplicate entries, but oh well. Just choose input that doesn't
  * have duplicates.
  */
+static inline size_t
+timeslot(struct timeval *t)
+{
+	u_int64_t key = (u_int64_t)t->tv_sec * 1000000 + t->tv_usec;
+
+	/* Fibonacci hashing - the top bits of the product */
+	return (key * 0x9e3779b97f4a7c15ULL) >> (64 - timebits);
+}
+
 void
 sortsnorttimes(void)
 {
+	size_t mask, slot;
+	int i;
+
 	qsort(snorttimes, maxtimes, sizeof(struct snorttime), cmpsnort);
+	free(timeset);
+	for (timebits = 4; (1L << timebits) < 2L*maxtimes; ++timebits)
+		;
+	if (!(timeset = (size_t *)calloc(1L << timebits, sizeof(size_t))))
+		return;
+	mask = (1L << timebits) - 1;
+	for (i=0; i < maxtimes; ++i) {
+		if (i && !timevalcmp(&snorttimes[i].time,
+				&snorttimes[i-1].time))
+			continue;
+		for (slot = timeslot(&snorttimes[i].time); timeset[slot];
+				slot = (slot+1) & mask)
+			;
+		timeset[slot] = i+1;
+	}
+}
+
+/* Where we'd expect to find a time: the first alert at that time, or
+ * NULL if there isn't one
+ */
+static struct snorttime *
+hashsnort(struct timeval *thistime)
+{
+	size_t mask = (1L << timebits) - 1, slot;
+	struct snorttime *found;
+
+	for (slot = timeslot(thistime); timeset[slot]; slot = (slot+1) & mask) {
+		found = &snorttimes[timeset[slot]-1];
+		if (!timevalcmp(&found->time, thistime))
+			return found;
+	}
+	return NULL;
 }
 
 struct snorttime *
@@ -75,6 +145,67 @@ searchsnort(struct timeval *thistime,  u_int32_t size)
 		maxtimes, sizeof(struct snorttime), cmpsnort);
 }
 
+/* The same, moving a cursor along */
+static struct snorttime *
+cursorsnort(SnortCursor *c, struct timeval *thistime)
+{
+	struct snorttime *found;
+	int lo, hi, mid, step;
+
+	if (c->started && timevalcmp(thistime, &c->last) < 0) {
+		/* Out of order; the cursor stays where it is */
+		if (timeset)
+			return hashsnort(thistime);
+		if (!(found = searchsnort(thistime, 0)))
+			return NULL;
+		while (found > snorttimes &&
+				!timevalcmp(&found[-1].time, thistime))
+			--found;
+		return found;
+	}
+	c->started = 1;
+	c->last = *thistime;
+	/* Everything from pos to lo is before the time; gallop till
+	 * we're past it, then search what's left
+	 */
+	lo = hi = c->pos;
+	for (step = 1; hi < maxtimes &&
+			timevalcmp(&snorttimes[hi].time, thistime) < 0;
+			step *= 2) {
+		lo = hi+1;
+		hi += step;
+	}
+	if (hi > maxtimes)
+		hi = maxtimes;
+	while (lo < hi) {
+		mid = lo + (hi-lo)/2;
+		if (timevalcmp(&snorttimes[mid].time, thistime) < 0)
+			lo = mid+1;
+		else
+			hi = mid;
+	}
+	c->pos = lo;
+	if (lo < maxtimes && !timevalcmp(&snorttimes[lo].time, thistime))
+		return &snorttimes[lo];
+	return NULL;
+}
+
+/* Any of the alerts at found's time in the date range? */
+static int
+insnortrange(struct snorttime *found, int startymd, int endymd)
+{
+	struct snorttime *end = snorttimes + maxtimes;
+	struct timeval thistime;
+
+	if (!found)
+		return 0;
+	thistime = found->time;
+	for (; found < end && !timevalcmp(&found->time, &thistime); ++found)
+		if (inymdrange(found->ymd, startymd, endymd))
+			return 1;
+	return 0;
+}
+
 void
 dumpsnorttimes(void)
 {
@@ -130,6 +261,25 @@ parsedgmlength(char *snortline)
 }
 
 
+/* Room for one more alert, zeroed; NULL if there isn't any */
+static struct snorttime *
+newsnorttime(void)
+{
+	struct snorttime *more;
+
+	if (maxtimes >= sizetimes) {
+		more = (struct snorttime *)realloc(snorttimes,
+			(sizetimes ? 2*sizetimes : SNORT_TIMES) *
+			sizeof(struct snorttime));
+		if (!more)
+			return NULL;
+		snorttimes = more;
+		sizetimes = sizetimes ? 2*sizetimes : SNORT_TIMES;
+	}
+	memset(&snorttimes[maxtimes], 0, sizeof(struct snorttime));
+	return &snorttimes[maxtimes];
+}
+
 /* Read in a snort ASCII file and store the date/time info. Since this
  * is down to the microsecond, this is probably good enough in terms of
  * identifying a packet, but we could also pull in address/port info.
@@ -141,6 +291,7 @@ readsnort(char *file, int startymd, int endymd)
 	int total=0;
 	char line[BUFSIZ], line2[BUFSIZ], grepstring[20], *timestring;
 	FILE *fp;
+	struct snorttime *st;
 
 	fp = fopen(file, "r");
 	if (!fp) {
@@ -174,13 +325,17 @@ readsnort(char *file, int startymd, int endymd)
 		for (ymd = startymd; ymd != endymd; ymd = nextymd(ymd)) {
 			sprintf(grepstring, "%02d/%02d-", (ymd/100)%100, ymd%100);
 			if ((timestring = strstr(line, grepstring))) {
-				snorttimes[maxtimes].ymd = ymd;
-				snorttimes[maxtimes].time =
-					parsetime(timestring, ymd);
+				if (!(st = newsnorttime())) {
+					fprintf(stderr,
+						"No room for snort alerts\n");
+					fclose(fp);
+					return total;
+				}
+				st->ymd = ymd;
+				st->time = parsetime(timestring, ymd);
 				/* Next line should have length */
 				if (fgets(line2, BUFSIZ, fp))
-					snorttimes[maxtimes].length =
-						parsedgmlength(line2);
+					st->length = parsedgmlength(line2);
 				++maxtimes;
 				++total;
 				break;
@@ -202,24 +357,20 @@ readsnortlist(char *list, int startymd, int endymd)
 int
 checksnort(struct timeval *thistime, u_int32_t size, int startymd, int endymd)
 {
-	int i;
-	struct snorttime *found;
-
 /*@@printf("%s\n",
 	sprinttimeval(thistime));*/
 
-	if (found = searchsnort(thistime, size)) {
-		if (inymdrange(found->ymd, startymd, endymd))
-			return 1;
-	}
-	if (found = searchsnort(prevhour(thistime), size)) {
-		if (inymdrange(found->ymd, startymd, endymd))
-			return 1;
-	}
-	if (found = searchsnort(nexthour(thistime), size)) {
-		if (inymdrange(found->ymd, startymd, endymd))
-			return 1;
-	}
+	if (!maxtimes)
+		return 0;
+	if (insnortrange(cursorsnort(&cursors[0], thistime),
+			startymd, endymd))
+		return 1;
+	if (insnortrange(cursorsnort(&cursors[1], prevhour(thistime)),
+			startymd, endymd))
+		return 1;
+	if (insnortrange(cursorsnort(&cursors[2], nexthour(thistime)),
+			startymd, endymd))
+		return 1;
 	return 0;
 }
 
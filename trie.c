@@ -0,0 +1,647 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <memory.h>
+#include <ctype.h>
+#include <math.h>
+#include <sys/types.h>
+#include "ngram.h"
+#include "libstats.h"
+
+#include "trie.h"
+
+NgramFilterSet trieset = {
+	{0,0},
+	NULL
+};
+NgramOps trieops = {
+	NewTrieNgramFilterSet,
+	AddTrieNgramFilterSet,
+	DeleteTrieNgramFilterSet,
+	FindTrieFilter,
+	FindTrieNgramFilterSet,
+	FindTrieNgramDistFilter,
+	DistTrieNgramFilter,
+	DumpTrieNgramFilterSet,
+	CloseTrieNgramFilterSet,
+	MergeTrieNgramFilterSet
+};
+
+Ngram trie = {
+	&trieset,
+	&trieops
+};
+
+/* Starting sizes; both double as needed */
+#define TRIE_NODES	(1<<16)
+#define TRIE_SLOTBITS	16
+
+/* The edge table stays under 3/4 full */
+#define TRIE_FULL(t)	((t)->edges >= (t)->size - (t)->size/4)
+
+#define TRIE_HASH(parent, byte, shift)	\
+	(size_t)(((((u_int64_t)(parent)<<8) | (byte)) * 0x9e3779b97f4a7c15ULL) >> (shift))
+
+static Trie *
+NewTrie(Range ngram)
+{
+	Trie *answer;
+
+	answer = (Trie *)calloc(1, sizeof(Trie));
+	if (!answer) return NULL;
+	answer->ngramsize = ngram;
+	answer->maxnodes = TRIE_NODES;
+	answer->count = (u_int32_t *)calloc(answer->maxnodes,
+		sizeof(u_int32_t));
+	answer->size = 1L<<TRIE_SLOTBITS;
+	answer->shift = 64-TRIE_SLOTBITS;
+	answer->edge = (TrieEdge *)calloc(answer->size, sizeof(TrieEdge));
+	if (!answer->count || !answer->edge) {
+		free(answer->count);
+		free(answer->edge);
+		free(answer);
+		return NULL;
+	}
+	answer->nodes = 1;	/* the root */
+	return answer;
+}
+
+static void
+CloseTrie(Trie *trie)
+{
+	if (!trie) return;
+	free(trie->count);
+	free(trie->edge);
+	free(trie);
+}
+
+/* The trie grows as it goes, so it can't live in a fixed-size shared
+ * memory region; with SHMALLOC, it's in ordinary memory all the same.
+ */
+NgramFilterSet *
+#ifdef SHMALLOC
+NewTrieNgramFilterSet(Range ngram, char *shmfilename, int mode)
+#else
+NewTrieNgramFilterSet(Range ngram)
+#endif
+{
+	NgramFilterSet *answer;
+	Trie *t;
+	int ng;
+
+	answer = (NgramFilterSet *)calloc(1, sizeof(NgramFilterSet));
+	if (!answer) return NULL;
+	if (!(t = NewTrie(ngram))) {
+		free(answer);
+		return NULL;
+	}
+	answer->ngramsize = ngram;
+	for (ng=ngram.min; ng <= ngram.max; ++ng) {
+		answer->filter[ng] = (NgramFilter)t;
+		setngramlabel(NGRAM_TRIE, NULL, ng, sizeof(Trie), 0, 0);
+	}
+	return answer;
+}
+
+void
+CloseTrieNgramFilterSet(NgramFilterSet *set)
+{
+	if (!set) return;
+	CloseTrie((Trie *)set->filter[set->ngramsize.min]);
+	free(set);
+}
+
+/* Bytes in use, for the label */
+static size_t
+TrieBytes(Trie *trie)
+{
+	return sizeof(Trie) + trie->maxnodes*sizeof(u_int32_t) +
+		trie->size*sizeof(TrieEdge);
+}
+
+static int
+TrieGrowEdges(Trie *trie)
+{
+	TrieEdge *old = trie->edge, *e;
+	size_t oldsize = trie->size, i, j, mask;
+
+	e = (TrieEdge *)calloc(2*oldsize, sizeof(TrieEdge));
+	if (!e) return -1;
+	trie->edge = e;
+	trie->size = 2*oldsize;
+	--trie->shift;
+	mask = trie->size-1;
+	for (i=0; i < oldsize; ++i) {
+		if (!old[i].child) continue;
+		j = TRIE_HASH(old[i].parent, old[i].byte, trie->shift);
+		while (e[j].child)
+			j = (j+1) & mask;
+		e[j] = old[i];
+	}
+	free(old);
+	return 0;
+}
+
+static int
+TrieGrowNodes(Trie *trie)
+{
+	u_int32_t *count;
+	u_int32_t more = trie->maxnodes;
+
+	/* Node numbers are 32 bits */
+	if (trie->maxnodes >= 0x80000000U)
+		return -1;
+	count = (u_int32_t *)realloc(trie->count,
+		(size_t)(trie->maxnodes+more)*sizeof(u_int32_t));
+	if (!count) return -1;
+	memset(count+trie->maxnodes, 0, (size_t)more*sizeof(u_int32_t));
+	trie->count = count;
+	trie->maxnodes += more;
+	return 0;
+}
+
+/* Find the child of a node for the given byte, making it if need be
+ * (and add is set). Returns 0 if there isn't one, or no memory for it.
+ */
+static inline u_int32_t
+TrieChild(Trie *trie, u_int32_t parent, u_int8_t byte, int add)
+{
+	size_t i, mask = trie->size-1;
+	TrieEdge *e;
+
+	i = TRIE_HASH(parent, byte, trie->shift);
+	while ((e = trie->edge+i)->child) {
+		if (e->parent == parent && e->byte == byte)
+			return e->child;
+		i = (i+1) & mask;
+	}
+	if (!add)
+		return 0;
+	if (trie->nodes >= trie->maxnodes && TrieGrowNodes(trie) < 0)
+		return 0;
+	if (TRIE_FULL(trie)) {
+		if (TrieGrowEdges(trie) < 0)
+			return 0;
+		/* Find the empty slot again */
+		mask = trie->size-1;
+		i = TRIE_HASH(parent, byte, trie->shift);
+		while ((e = trie->edge+i)->child)
+			i = (i+1) & mask;
+	}
+	e->parent = parent;
+	e->byte = byte;
+	e->child = trie->nodes++;
+	++trie->edges;
+	return e->child;
+}
+
+/* Node info that isn't kept in the trie itself, worked out from the
+ * edges when we need it (stats, dumps, merges). A child is always made
+ * after its parent, so the depths can be done in node order.
+ */
+typedef struct _trieLineage {
+	u_int32_t *parent;
+	u_int8_t *byte;
+	u_int8_t *depth;
+} TrieLineage;
+
+static int
+TrieLineageOf(Trie *trie, TrieLineage *line)
+{
+	size_t i;
+	u_int32_t c;
+
+	line->parent = (u_int32_t *)calloc(trie->nodes, sizeof(u_int32_t));
+	line->byte = (u_int8_t *)calloc(trie->nodes, 1);
+	line->depth = (u_int8_t *)calloc(trie->nodes, 1);
+	if (!line->parent || !line->byte || !line->depth) {
+		free(line->parent);
+		free(line->byte);
+		free(line->depth);
+		return -1;
+	}
+	for (i=0; i < trie->size; ++i) {
+		if (!(c = trie->edge[i].child)) continue;
+		line->parent[c] = trie->edge[i].parent;
+		line->byte[c] = trie->edge[i].byte;
+	}
+	for (c=1; c < trie->nodes; ++c)
+		line->depth[c] = line->depth[line->parent[c]] + 1;
+	return 0;
+}
+
+static void
+TrieLineageFree(TrieLineage *line)
+{
+	free(line->parent);
+	free(line->byte);
+	free(line->depth);
+}
+
+static void
+TrieLabel(Trie *trie)
+{
+	int ng;
+
+	for (ng=trie->ngramsize.min; ng <= trie->ngramsize.max; ++ng)
+		setngramlabel(NGRAM_TRIE, NULL, ng, TrieBytes(trie),
+			trie->total[ng], trie->distinct[ng]);
+}
+
+/* One walk down from the root at each offset gets all the sizes */
+int
+AddTrieNgramFilterSet(void *item, size_t length, NgramFilterSet *vfilter)
+{
+	Trie *trie = (Trie *)vfilter->filter[vfilter->ngramsize.min];
+	Range r = trie->ngramsize;
+	u_int8_t *input = (u_int8_t *)item;
+	u_int32_t node;
+	size_t i;
+	int d, depth;
+	int ret=0;
+
+	for (i=0; i+r.min <= length; ++i) {
+		depth = min(r.max, length-i);
+		node = 0;
+		for (d=1; d <= depth; ++d) {
+			if (!(node = TrieChild(trie, node, input[i+d-1], 1))) {
+				trie->lost += depth - (d > r.min ? d : r.min) + 1;
+				break;
+			}
+			if (d < r.min) continue;
+			if (!trie->count[node]++)
+				++trie->distinct[d];
+			++trie->total[d];
+			++ret;
+		}
+	}
+	TrieLabel(trie);
+	return ret;
+}
+
+int
+DeleteTrieNgramFilterSet(void *item, size_t length, NgramFilterSet *vfilter)
+{
+	Trie *trie = (Trie *)vfilter->filter[vfilter->ngramsize.min];
+	Range r = trie->ngramsize;
+	u_int8_t *input = (u_int8_t *)item;
+	u_int32_t node;
+	size_t i;
+	int d, depth;
+	int ret=0;
+
+	for (i=0; i+r.min <= length; ++i) {
+		depth = min(r.max, length-i);
+		node = 0;
+		for (d=1; d <= depth; ++d) {
+			if (!(node = TrieChild(trie, node, input[i+d-1], 0)))
+				break;
+			if (d < r.min || !trie->count[node]) continue;
+			if (!--trie->count[node])
+				--trie->distinct[d];
+			--trie->total[d];
+			++ret;
+		}
+	}
+	TrieLabel(trie);
+	return ret;
+}
+
+/* Find a single ngram */
+int
+FindTrieFilter(void *item, int ngram, void *vfilter)
+{
+	Trie *trie = (Trie *)vfilter;
+	u_int8_t *input = (u_int8_t *)item;
+	u_int32_t node = 0;
+	int d;
+
+	for (d=0; d < ngram; ++d)
+		if (!(node = TrieChild(trie, node, input[d], 0)))
+			return 0;
+	return trie->count[node] > 0x7fffffff ? 0x7fffffff : trie->count[node];
+}
+
+/* Chop an item into ngrams, and total up their frequencies - again, one
+ * walk per offset for all the sizes.
+ */
+int
+FindTrieNgramFilterSet(void *item, size_t length, NgramFilterSet *vfilter)
+{
+	Trie *trie = (Trie *)vfilter->filter[vfilter->ngramsize.min];
+	Range r = vfilter->ngramsize;
+	u_int8_t *input = (u_int8_t *)item;
+	u_int32_t node;
+	size_t i;
+	int d, depth;
+	int ret=0;
+
+	for (i=0; i+r.min <= length; ++i) {
+		depth = min(r.max, length-i);
+		node = 0;
+		for (d=1; d <= depth; ++d) {
+			if (!(node = TrieChild(trie, node, input[i+d-1], 0)))
+				break;
+			if (d >= r.min)
+				ret += trie->count[node];
+		}
+	}
+	return ret;
+}
+
+int
+FindTrieNgramDistFilter(void *item, size_t length, int ngram, double *mu, double *sigma, double *rho, NgramFilterSet *vfilter)
+{
+	int i;
+	int total=0;
+	static int frequencies[NGRAM_MAX];
+
+	for (i=0; i+ngram <= length && i < NGRAM_MAX; ++i) {
+		frequencies[i] =
+			FindTrieFilter((u_int8_t *)item + i, ngram,
+				vfilter->filter[ngram]);
+		total += frequencies[i];
+	}
+	intarraystats(frequencies, i, mu, sigma, rho);
+	return total;
+}
+
+/* Statistics of the counts of the distinct ngrams of one size. (There's
+ * no table of counters here, so unlike the Bloom filter, there are no
+ * zeros in it.)
+ */
+void
+DistTrieNgramFilter(int ngram, double *mu, double *sigma,
+	u_int64_t *max, u_int64_t *min, NgramFilterSet *vfilter)
+{
+	Trie *trie = (Trie *)vfilter->filter[ngram];
+	TrieLineage line;
+	u_int32_t c;
+	size_t n=0;
+	double sum=0.0, sumsquare=0.0, value;
+
+	*mu = *sigma = 0.0;
+	*max = *min = 0;
+	if (!trie || TrieLineageOf(trie, &line) < 0)
+		return;
+	*min = 0xffffffff;
+	for (c=1; c < trie->nodes; ++c) {
+		if (line.depth[c] != ngram || !trie->count[c]) continue;
+		value = trie->count[c];
+		sum += value;
+		sumsquare += value*value;
+		if (trie->count[c] > *max) *max = trie->count[c];
+		if (trie->count[c] < *min) *min = trie->count[c];
+		++n;
+	}
+	TrieLineageFree(&line);
+	if (!n) {
+		*min = 0;
+		return;
+	}
+	*mu = sum/(double)n;
+	if (n > 1)
+		*sigma = sqrt((sumsquare - (double)n*(*mu)*(*mu))/(double)(n-1));
+	if (trie->lost && dumplevel > 0)
+		fprintf(stderr, "ngram %d: trie ran out of memory, %ld ngrams lost\n",
+			ngram, trie->lost);
+}
+
+/* Each node's children, in byte order: the children of node p are
+ * kid[first[p]] up to kid[first[p+1]]. Two counting sorts, by byte and
+ * then (stably) by parent.
+ */
+static int
+TrieKidsOf(Trie *trie, TrieLineage *line, u_int32_t **first, u_int32_t **kid)
+{
+	u_int32_t *bybyte, c, p;
+	size_t at[256], b, i;
+
+	*first = (u_int32_t *)calloc((size_t)trie->nodes+1, sizeof(u_int32_t));
+	*kid = (u_int32_t *)calloc(trie->nodes, sizeof(u_int32_t));
+	bybyte = (u_int32_t *)calloc(trie->nodes, sizeof(u_int32_t));
+	if (!*first || !*kid || !bybyte) {
+		free(*first);
+		free(*kid);
+		free(bybyte);
+		return -1;
+	}
+	memset(at, 0, sizeof(at));
+	for (c=1; c < trie->nodes; ++c)
+		++at[line->byte[c]];
+	for (b=0, i=0; b < 256; ++b) {
+		i += at[b];
+		at[b] = i - at[b];
+	}
+	for (c=1; c < trie->nodes; ++c)
+		bybyte[at[line->byte[c]]++] = c;
+	for (c=1; c < trie->nodes; ++c)
+		++(*first)[line->parent[c]];
+	for (p=0, i=0; p <= trie->nodes; ++p) {
+		i += (*first)[p];
+		(*first)[p] = i - (*first)[p];
+	}
+	for (i=0; i+1 < trie->nodes; ++i)
+		(*kid)[(*first)[line->parent[bybyte[i]]]++] = bybyte[i];
+	/* Each start has moved up to the next one's */
+	for (p=trie->nodes; p > 0; --p)
+		(*first)[p] = (*first)[p-1];
+	(*first)[0] = 0;
+	free(bybyte);
+	return 0;
+}
+
+/* Dump the ngrams and their counts, size by size, in the same format as
+ * the array's reportngram. Node numbers depend on the order things came
+ * in (and on how threads' tries were merged), so we go down the trie in
+ * byte order instead; the same ngrams always dump the same way.
+ */
+void
+DumpTrieNgramFilterSet(FILE *dumpfile, NgramFilterSet *vfilter)
+{
+	Trie *trie;
+	TrieLineage line;
+	u_int32_t *first, *kid, c;
+	u_int32_t node[NGRAM_RANGEMAX], next[NGRAM_RANGEMAX];
+	u_int8_t bytes[NGRAM_RANGEMAX];
+	int ng, d, i;
+
+	if (!dumpfile) return;
+	trie = (Trie *)vfilter->filter[vfilter->ngramsize.min];
+	if (!trie || TrieLineageOf(trie, &line) < 0)
+		return;
+	if (TrieKidsOf(trie, &line, &first, &kid) < 0) {
+		TrieLineageFree(&line);
+		return;
+	}
+	for (ng=trie->ngramsize.min; ng <= trie->ngramsize.max; ++ng) {
+		fprintf(dumpfile, "ngram %d: %ld total %ld distinct\n", ng,
+			trie->total[ng], trie->distinct[ng]);
+		/* node[d] is the node at depth d on the way down, and
+		 * next[d] the next of its children to look at
+		 */
+		d = 0;
+		node[0] = 0;
+		next[0] = first[0];
+		while (d >= 0) {
+			if (next[d] >= first[node[d]+1]) {
+				--d;
+				continue;
+			}
+			c = kid[next[d]++];
+			bytes[d] = line.byte[c];
+			if (d+1 < ng) {
+				node[++d] = c;
+				next[d] = first[c];
+				continue;
+			}
+			if (!trie->count[c]) continue;
+			fprintf(dumpfile, "%u: ", trie->count[c]);
+			for (i=0; i < ng; ++i) {
+				if (isprint(bytes[i]))
+					fprintf(dumpfile, " %c", bytes[i]);
+				else
+					fprintf(dumpfile, " (%d)", bytes[i]);
+			}
+			fprintf(dumpfile, "\n");
+		}
+	}
+	free(first);
+	free(kid);
+	TrieLineageFree(&line);
+}
+
+/* Add one trie into another, node by node. Since parents come before
+ * their children, each node's parent is already in the other trie by the
+ * time we get to it. The counts are exact, so the result is just what
+ * we'd have got adding everything to one trie.
+ */
+void
+MergeTrieNgramFilterSet(NgramFilterSet *into, NgramFilterSet *from)
+{
+	Trie *to = (Trie *)into->filter[into->ngramsize.min];
+	Trie *fr = (Trie *)from->filter[from->ngramsize.min];
+	TrieLineage line;
+	u_int32_t *map, c, node;
+	int d, ng;
+
+	if (!to || !fr)
+		return;
+	map = (u_int32_t *)calloc(fr->nodes, sizeof(u_int32_t));
+	if (!map || TrieLineageOf(fr, &line) < 0) {
+		fprintf(stderr, "No memory to merge tries\n");
+		free(map);
+		return;
+	}
+	for (c=1; c < fr->nodes; ++c) {
+		d = line.depth[c];
+		/* A parent we couldn't add leaves its children out too */
+		if (line.parent[c] && !map[line.parent[c]])
+			node = 0;
+		else
+			node = TrieChild(to, map[line.parent[c]],
+				line.byte[c], 1);
+		if (!(map[c] = node)) {
+			if (d >= to->ngramsize.min && d <= to->ngramsize.max)
+				to->lost += fr->count[c];
+			continue;
+		}
+		if (!fr->count[c]) continue;
+		if (!to->count[node])
+			++to->distinct[d];
+		to->count[node] += fr->count[c];
+	}
+	for (ng=to->ngramsize.min; ng <= to->ngramsize.max; ++ng)
+		to->total[ng] += fr->total[ng];
+	to->lost += fr->lost;
+	TrieLineageFree(&line);
+	free(map);
+	if (into == ngram->f)
+		TrieLabel(to);
+}
+
+#ifdef TEST
+/* Check the trie against a brute force count: sort all the ngrams of
+ * each size, and count the runs.
+ */
+FILE *dumpfile=NULL;
+int dumplevel;
+
+static int sortsize;
+
+static int
+ngramcmp(const void *a, const void *b)
+{
+	return memcmp(*(u_int8_t **)a, *(u_int8_t **)b, sortsize);
+}
+
+int
+main(int argc, char **argv)
+{
+	Range r = {1, 8};
+	size_t length = 200000, i, j, distinct;
+	int c, ng, alphabet = 6, found, errors=0;
+	u_int8_t *text, **grams;
+	NgramFilterSet *set;
+	Trie *t;
+
+	while ((c = getopt(argc, argv, "n:l:a:")) >= 0) {
+		switch (c) {
+		case 'n':
+			(void) sscanf(optarg, "%d-%d", &r.min, &r.max);
+			break;
+		case 'l':
+			length = atol(optarg);
+			break;
+		case 'a':
+			alphabet = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr,
+				"Usage: trietest [-n min-max] [-l length] [-a alphabet]\n");
+			exit(1);
+		}
+	}
+	text = (u_int8_t *)malloc(length);
+	grams = (u_int8_t **)malloc(length*sizeof(u_int8_t *));
+	set = NewTrieNgramFilterSet(r);
+	if (!text || !grams || !set)
+		exit(2);
+	srandom(1);
+	for (i=0; i < length; ++i)
+		text[i] = 'a' + random()%alphabet;
+	/* Two halves, to check the ends are handled */
+	AddTrieNgramFilterSet(text, length/2, set);
+	AddTrieNgramFilterSet(text+length/2, length-length/2, set);
+	t = (Trie *)set->filter[r.min];
+
+	for (ng=r.min; ng <= r.max; ++ng) {
+		size_t n=0;
+
+		for (i=0; i+ng <= length/2; ++i)
+			grams[n++] = text+i;
+		for (i=length/2; i+ng <= length; ++i)
+			grams[n++] = text+i;
+		sortsize = ng;
+		qsort(grams, n, sizeof(u_int8_t *), ngramcmp);
+		distinct = 0;
+		for (i=0; i < n; i = j) {
+			for (j=i+1; j < n && !memcmp(grams[i], grams[j], ng); ++j)
+				;
+			++distinct;
+			found = FindTrieFilter(grams[i], ng, t);
+			if (found != j-i && errors++ < 10)
+				fprintf(stderr, "ngram %d: %.*s found %d, not %ld\n",
+					ng, ng, grams[i], found, j-i);
+		}
+		if ((t->distinct[ng] != distinct || t->total[ng] != n) &&
+				errors++ < 10)
+			fprintf(stderr, "ngram %d: %ld/%ld total/distinct, not %ld/%ld\n",
+				ng, t->total[ng], t->distinct[ng], n, distinct);
+		printf("ngram %d total %ld distinct %ld\n", ng, n, distinct);
+	}
+	printf("%u nodes, %ld bytes\n", t->nodes, TrieBytes(t));
+	printf("%s\n", errors ? "FAILED" : "ok");
+	exit(errors != 0);
+}
+#endif
@@ -0,0 +1,61 @@
+/* An exact ngram counter, as a trie.
+ *
+ * The array only goes up to n=4, and past that the Bloom filter needs
+ * huge tables (and still has false positives). But the number of distinct
+ * ngrams actually seen is usually far smaller than the tables, so here we
+ * just keep a node for each one. An ngram's node is the child of its
+ * first n-1 bytes' node, so one walk down from the root at each offset
+ * counts every size in the range, rather than one filter per size.
+ *
+ * Nodes are numbered in the order they're made, and all that's kept per
+ * node is its count. The edges (parent, byte -> child) go in an open
+ * addressed hash table, which doubles when it gets full, so memory is
+ * about 20 bytes per distinct ngram (and prefix). Counts are exact, in
+ * 32 bits - there's no COUNTER_MAX here.
+ *
+ * All the sizes share the one trie, so every slot in the filter set
+ * points to the same thing.
+ */
+
+#ifndef _TRIE_H
+#define _TRIE_H
+
+typedef struct _trieEdge {
+	u_int32_t parent;
+	u_int32_t child;	/* 0 for an empty slot (the root is no child) */
+	u_int8_t byte;
+} TrieEdge;
+
+typedef struct _trie {
+	Range ngramsize;
+	u_int32_t nodes;	/* in use, the root (0) included */
+	u_int32_t maxnodes;	/* room for */
+	u_int32_t *count;	/* by node */
+	size_t edges;		/* in use */
+	size_t size;		/* slots in the table, a power of 2 */
+	int shift;		/* 64 - log2(size), for the hash */
+	TrieEdge *edge;
+	size_t lost;		/* ngrams we couldn't get memory for */
+	/* Stats, by ngram size */
+	size_t total[NGRAM_RANGEMAX];
+	size_t distinct[NGRAM_RANGEMAX];
+} Trie;
+
+NgramFilterSet *
+#ifdef SHMALLOC
+NewTrieNgramFilterSet(Range ngram, char *shmfilename, int mode);
+#else
+NewTrieNgramFilterSet(Range ngram);
+#endif
+
+int AddTrieNgramFilterSet(void *item, size_t length, NgramFilterSet *vfilter);
+int DeleteTrieNgramFilterSet(void *item, size_t length, NgramFilterSet *vfilter);
+int FindTrieFilter(void *item, int ngram, void *vfilter);
+int FindTrieNgramFilterSet(void *item, size_t length, NgramFilterSet *vfilter);
+int FindTrieNgramDistFilter(void *item, size_t length, int ngram, double *mu, double *sigma, double *rho, NgramFilterSet *vfilter);
+void DistTrieNgramFilter(int ngram, double *mu, double *sigma, u_int64_t *max, u_int64_t *min, NgramFilterSet *vfilter);
+void DumpTrieNgramFilterSet(FILE *file, NgramFilterSet *vfilter);
+void CloseTrieNgramFilterSet(NgramFilterSet *vfilter);
+void MergeTrieNgramFilterSet(NgramFilterSet *into, NgramFilterSet *from);
+
+#endif /* _TRIE_H */
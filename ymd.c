@@ -291,10 +291,11 @@ inymdrange(int ymd, int startymd, int endymd)
 	return 0;
 }
 
+/* The answers are per thread, since -j workers may be checking times */
 struct timeval *
 nexthour(struct timeval *thistime)
 {
-	static struct timeval answer;
+	static __thread struct timeval answer;
 
 	answer = *thistime;
 	answer.tv_sec += 3600;
@@ -304,7 +305,7 @@ nexthour(struct timeval *thistime)
 struct timeval *
 prevhour(struct timeval *thistime)
 {
-	static struct timeval answer;
+	static __thread struct timeval answer;
 
 	answer = *thistime;
 	answer.tv_sec -= 3600;